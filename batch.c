@@ -0,0 +1,263 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "d86.h"
+#include "loader.h"
+#include "outbuf.h"
+
+// frame header and error message upper bound
+#define FRAME_HEADER_MAX 4096
+
+struct batch
+{
+	char           **paths;
+	uint64           count;
+	const char      *out_dir;
+
+	// combined stream, shared by all workers
+	struct outbuf    out;
+	pthread_mutex_t  lock;
+
+	struct loader    loader;
+	uint64           failed;
+};
+
+// Listing of one image, reused between images of a worker
+struct text
+{
+	char  *data;
+	size_t len;
+	size_t cap;
+};
+
+static void batch_worker(void *ctx, uint task);
+
+// Decodes loaded image into 'text'. On error message is written into 'text'
+// instead and negative value is returned.
+static int decode_one_image(struct d86_ctx *ctx, const char *path,
+                            struct loaded_image *image, struct text *text);
+
+// Makes sure 'text' has 'len' free bytes. Returns 0 on success and negative
+// value if allocation failed.
+static int text_reserve(struct text *text, size_t len);
+
+// Writes listing into the output file or a frame of the combined stream.
+// 'index' is position of the image in the path list.
+static int emit_image(struct batch *batch, uint64 index, const char *path,
+                      int rc, struct text *text);
+
+int64 batch_decode(char **paths, uint64 count, const char *out_dir, int fd,
+                   struct pool *pool, bool threads_only)
+{
+	uint workers;
+	struct batch batch;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.paths   = paths;
+	batch.count   = count;
+	batch.out_dir = out_dir;
+
+	if (outbuf_init(&batch.out, fd, OUTBUF_SIZE) < 0) return -1;
+
+	// files are read in the background while workers decode loaded ones
+	if (loader_start(&batch.loader, paths, count, threads_only) < 0) {
+		outbuf_free(&batch.out);
+		return -1;
+	}
+
+	pthread_mutex_init(&batch.lock, NULL);
+
+	// workers take images one by one, so small and large images balance
+	// out and every worker keeps its decoding context warm
+	workers = pool->thread_count;
+	if (workers > count) workers = count;
+
+	if (workers > 0) pool_run(pool, workers, batch_worker, &batch);
+
+	loader_stop(&batch.loader);
+	pthread_mutex_destroy(&batch.lock);
+	if (outbuf_free(&batch.out) < 0) return -1;
+
+	return batch.failed;
+}
+
+void batch_worker(void *ctx, uint task)
+{
+	int rc;
+	const char *path;
+	struct batch *batch = ctx;
+	struct d86_ctx *d86;
+	struct text text;
+	struct loaded_image image;
+
+	(void)task;
+
+	// images are still drained and reported if this fails
+	d86 = d86_new();
+	memset(&text, 0, sizeof(text));
+
+	while (loader_next(&batch->loader, &image) == 0) {
+		path = batch->paths[image.index];
+
+		rc = decode_one_image(d86, path, &image, &text);
+		loader_release(&batch->loader, &image);
+
+		if (emit_image(batch, image.index, path, rc, &text) < 0) {
+			rc = -1;
+		}
+
+		if (rc < 0) {
+			__atomic_fetch_add(&batch->failed, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	free(text.data);
+	d86_free(d86);
+}
+
+int decode_one_image(struct d86_ctx *ctx, const char *path,
+                     struct loaded_image *image, struct text *text)
+{
+	int64 count, i;
+
+	text->len = 0;
+	if (text_reserve(text, FRAME_HEADER_MAX) < 0) return -3;
+
+	if (!ctx) {
+		text->len = snprintf(text->data, FRAME_HEADER_MAX, "%s\n",
+		                     d86_strerror(D86_ERR_NOMEM));
+		return -3;
+	}
+
+	if (image->err) {
+		text->len = snprintf(text->data, FRAME_HEADER_MAX,
+		                     "failed to read file: %s\n",
+		                     strerror(image->err));
+		return -1;
+	}
+
+	count = d86_decode_range(ctx, image->data, image->size);
+	if (count < 0) {
+		text->len = snprintf(text->data, FRAME_HEADER_MAX,
+		                     "%s at offset %" PRIu64 "\n",
+		                     d86_strerror(count), d86_error_offset(ctx));
+		return -4;
+	}
+
+	text->len = snprintf(text->data, FRAME_HEADER_MAX,
+	                     "; %s\nbits 16\n\n", path);
+
+	for (i = 0; i < count; ++i) {
+		if (text_reserve(text, D86_TEXT_MAX) < 0) {
+			text->len = snprintf(text->data, FRAME_HEADER_MAX,
+			                     "%s\n", d86_strerror(D86_ERR_NOMEM));
+			return -3;
+		}
+
+		text->len += d86_format(ctx, i, text->data + text->len,
+		                        D86_TEXT_MAX);
+	}
+
+	// a trailing prefix leaves the last line open, the next frame header
+	// must start a line of its own
+	if (text->data[text->len - 1] != '\n') {
+		if (text_reserve(text, 1) < 0) {
+			text->len = snprintf(text->data, FRAME_HEADER_MAX,
+			                     "%s\n", d86_strerror(D86_ERR_NOMEM));
+			return -3;
+		}
+
+		text->data[text->len++] = '\n';
+	}
+
+	return 0;
+}
+
+int text_reserve(struct text *text, size_t len)
+{
+	size_t cap;
+	char *data;
+
+	if (text->cap - text->len >= len) return 0;
+
+	cap = text->cap ? text->cap * 2 : 64 * 1024;
+	while (cap - text->len < len) cap *= 2;
+
+	data = realloc(text->data, cap);
+	if (!data) return -1;
+
+	text->data = data;
+	text->cap  = cap;
+
+	return 0;
+}
+
+int emit_image(struct batch *batch, uint64 index, const char *path, int rc,
+               struct text *text)
+{
+	int fd, len;
+	char name[4096];
+	char header[FRAME_HEADER_MAX];
+	const char *base;
+	ssize_t n;
+	size_t done = 0;
+
+	if (!batch->out_dir) {
+		len = snprintf(header, sizeof(header), "; == %s %s %zu\n", path,
+		               rc < 0 ? "error" : "ok", text->len);
+
+		pthread_mutex_lock(&batch->lock);
+		rc = outbuf_write(&batch->out, header, len);
+		if (rc == 0) {
+			rc = outbuf_write(&batch->out, text->data, text->len);
+		}
+		pthread_mutex_unlock(&batch->lock);
+
+		return rc;
+	}
+
+	if (rc < 0) {
+		fprintf(stderr, "%s: %.*s", path, (int)text->len, text->data);
+		return 0;
+	}
+
+	base = strrchr(path, '/');
+	base = base ? base + 1 : path;
+
+	// files of different directories may share a name, the list index
+	// keeps their listings apart
+	snprintf(name, sizeof(name), "%s/%" PRIu64 "-%s.asm", batch->out_dir,
+	         index, base);
+
+	// never overwrite, a listing left by an earlier run is an error
+	fd = open(name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "%s: failed to create '%s': %s\n", path, name,
+		        strerror(errno));
+		return -1;
+	}
+
+	while (done < text->len) {
+		n = write(fd, text->data + done, text->len - done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {
+			fprintf(stderr, "%s: failed to write '%s': %s\n", path,
+			        name, strerror(errno));
+			close(fd);
+			return -1;
+		}
+
+		done += n;
+	}
+
+	close(fd);
+
+	return 0;
+}
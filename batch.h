@@ -0,0 +1,26 @@
+#if !defined BATCH_H
+#define BATCH_H
+
+#include <stdbool.h>
+
+#include "common.h"
+#include "pool.h"
+
+// Decodes every image of 'paths' on 'pool' threads. Output of each image goes
+// into '<out_dir>/<index>-<file name>.asm' if 'out_dir' isn't NULL, where
+// 'index' is position of the path in the list and an existing file is an
+// error of that image. Otherwise it goes into 'fd' as a frame:
+//
+//     ; == <path> <status> <length>
+//     <length bytes of listing>
+//
+// where status is "ok" or "error". The listing always ends with a newline,
+// so every header starts a line. Frames come in order of completion. A
+// failed image doesn't stop the others, its error is written into the frame
+// (or stderr). Files are read ahead through io_uring, or on reader threads
+// if it isn't available or 'threads_only' is set. Returns number of failed
+// images or negative value if the batch couldn't run.
+extern int64 batch_decode(char **paths, uint64 count, const char *out_dir,
+                          int fd, struct pool *pool, bool threads_only);
+
+#endif /* BATCH_H */
@@ -0,0 +1,326 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bitmap.h"
+#include "decoder.h"
+#include "gen.h"
+#include "inst.h"
+
+#define FLAG_COUNT   "-n"
+#define FLAG_REPEAT  "-r"
+#define FLAG_SEED    "-s"
+#define FLAG_PREFIX  "-p"
+#define FLAG_JUMP    "-J"
+#define FLAG_MIX     "-x"
+#define FLAG_MOD     "-m"
+#define FLAG_INPUT   "-i"
+#define FLAG_OUTPUT  "-o"
+
+// text of the format phase is written into a buffer of this size over and
+// over, like into an output buffer that gets flushed
+#define TEXT_CHUNK   (64 * 1024)
+
+struct options
+{
+	struct gen_options gen;
+	uint   repeat;
+	char  *input;  // benchmark existing image instead of generating one
+	char  *output; // only write generated image
+};
+
+struct phase
+{
+	const char *name;
+	double      min; // seconds
+	double      sum;
+};
+
+// Everything phases work on, reused between repeats
+struct bench
+{
+	const uint8  *image;
+	uint64        size;
+
+	struct inst_arena arena;
+	struct inst  *insts;
+	uint64        count;
+	struct bitmap labels;
+	char         *text;     // TEXT_CHUNK bytes
+	uint64        text_len; // formatted bytes, keeps the text alive
+};
+
+typedef int (*phase_fn)(struct bench *b);
+
+void usage(char *argv[])
+{
+	fprintf(stderr, "Usage: %s [-n <insts>] [-r <repeats>] [-s <seed>] "
+	        "[-p <density>] [-J <density>] [-x <mix>] [-m <weights>] "
+	        "[-i <image>] [-o <image>]\n"
+	        "\t-n\tinstructions to generate (default: 1000000)\n"
+	        "\t-r\trepeats of every phase, minimum is reported "
+	        "(default: 10)\n"
+	        "\t-s\tgenerator seed\n"
+	        "\t-p\tshare of prefixed instructions (default: 0.03)\n"
+	        "\t-J\tshare of jumps (default: 0.12)\n"
+	        "\t-x\topcode mix, e.g. mov=40,alu=30,stack=15,string=3,"
+	        "other=12\n"
+	        "\t-m\tmod field weights mem0,mem8,mem16,reg "
+	        "(default: 20,25,10,45)\n"
+	        "\t-i\tbenchmark existing image\n"
+	        "\t-o\twrite generated image and exit\n", argv[0]);
+}
+
+static double now(void);
+
+// Loads image from 'path'. Returns 0 on success and negative value if error
+// occurred.
+static int read_image(const char *path, uint8 **image, uint64 *size);
+static int write_image(const char *path, const uint8 *image, uint64 size);
+
+static int phase_lengths(struct bench *b);
+static int phase_scan(struct bench *b);
+static int phase_labels(struct bench *b);
+static int phase_format(struct bench *b);
+
+int main(int argc, char *argv[])
+{
+	int i, rc = 0;
+	uint k, r;
+	char *end;
+	double t;
+	uint8 *image = NULL;
+	uint64 size = 0;
+
+	struct options opts;
+	struct bench b;
+
+	static const phase_fn fns[] =
+	{
+		phase_lengths, phase_scan, phase_labels, phase_format,
+	};
+	struct phase phases[] =
+	{
+		{ "length scan (inst_scan_lengths)", 1e30, 0 },
+		{ "decode (inst_scan)",              1e30, 0 },
+		{ "labels (inst_mark_labels)",       1e30, 0 },
+		{ "format (decode_inst_text)",       1e30, 0 },
+	};
+
+	memset(&opts, 0, sizeof(opts));
+	memset(&b, 0, sizeof(b));
+	gen_default_options(&opts.gen);
+	opts.repeat = 10;
+
+	for (i = 1; i < argc; ++i) {
+		end = "";
+
+		if (i + 1 >= argc) {
+			usage(argv);
+			return 2;
+		} else if (!strcmp(argv[i], FLAG_COUNT)) {
+			opts.gen.count = strtoull(argv[++i], &end, 0);
+		} else if (!strcmp(argv[i], FLAG_REPEAT)) {
+			opts.repeat = strtoul(argv[++i], &end, 0);
+		} else if (!strcmp(argv[i], FLAG_SEED)) {
+			opts.gen.seed = strtoull(argv[++i], &end, 0);
+		} else if (!strcmp(argv[i], FLAG_PREFIX)) {
+			opts.gen.prefix_density = strtod(argv[++i], &end);
+		} else if (!strcmp(argv[i], FLAG_JUMP)) {
+			opts.gen.jump_density = strtod(argv[++i], &end);
+		} else if (!strcmp(argv[i], FLAG_MIX)) {
+			if (gen_parse_mix(&opts.gen, argv[++i]) < 0) end = "?";
+		} else if (!strcmp(argv[i], FLAG_MOD)) {
+			if (sscanf(argv[++i], "%u,%u,%u,%u",
+			           &opts.gen.mod_weights[MODE_MEM0],
+			           &opts.gen.mod_weights[MODE_MEM8],
+			           &opts.gen.mod_weights[MODE_MEM16],
+			           &opts.gen.mod_weights[MODE_REG]) != 4) {
+				end = "?";
+			}
+		} else if (!strcmp(argv[i], FLAG_INPUT)) {
+			opts.input = argv[++i];
+		} else if (!strcmp(argv[i], FLAG_OUTPUT)) {
+			opts.output = argv[++i];
+		} else {
+			end = "?";
+		}
+
+		if (*end != '\0' || opts.repeat == 0 || opts.gen.count == 0) {
+			usage(argv);
+			return 2;
+		}
+	}
+
+	if (opts.input) {
+		rc = read_image(opts.input, &image, &size);
+	} else {
+		rc = gen_image(&opts.gen, &image, &size);
+	}
+
+	if (rc < 0) return 1;
+
+	if (opts.output) {
+		rc = write_image(opts.output, image, size);
+		free(image);
+		return rc < 0 ? 1 : 0;
+	}
+
+	b.image = image;
+	b.size  = size;
+	b.text  = malloc(TEXT_CHUNK);
+	inst_arena_init(&b.arena);
+	if (!b.text || (size > 0 && bitmap_init(&b.labels, size) < 0)) {
+		fprintf(stderr, "failed to allocate benchmark buffers\n");
+		rc = -1;
+		goto free_and_exit;
+	}
+
+	// warm up caches and fill instructions used by the format phase
+	if (phase_scan(&b) < 0) {
+		rc = -1;
+		goto free_and_exit;
+	}
+
+	for (r = 0; r < opts.repeat; ++r) {
+		for (k = 0; k < sizeof(fns) / sizeof(*fns); ++k) {
+			t = now();
+			if (fns[k](&b) < 0) {
+				fprintf(stderr, "phase '%s' failed\n",
+				        phases[k].name);
+				rc = -1;
+				goto free_and_exit;
+			}
+			t = now() - t;
+
+			phases[k].sum += t;
+			if (t < phases[k].min) phases[k].min = t;
+		}
+	}
+
+	printf("image: %" PRIu64 " bytes, %" PRIu64 " instructions, "
+	       "%u repeats\n\n", b.size, b.count, opts.repeat);
+	printf("%-34s %10s %10s %10s %10s\n", "phase", "min ms", "mean ms",
+	       "MB/s", "ns/inst");
+
+	for (k = 0; k < sizeof(phases) / sizeof(*phases); ++k) {
+		printf("%-34s %10.3f %10.3f %10.1f %10.2f\n", phases[k].name,
+		       phases[k].min * 1e3, phases[k].sum / opts.repeat * 1e3,
+		       b.size / phases[k].min / 1e6,
+		       b.count ? phases[k].min * 1e9 / b.count : 0.0);
+	}
+
+free_and_exit:
+	if (b.labels.data) bitmap_free(&b.labels);
+	inst_arena_free(&b.arena);
+	free(b.text);
+	free(image);
+
+	return rc < 0 ? 1 : 0;
+}
+
+double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int phase_lengths(struct bench *b)
+{
+	return inst_scan_lengths(NULL, b->image, b->size) < 0 ? -1 : 0;
+}
+
+int phase_scan(struct bench *b)
+{
+	int64 count;
+
+	// arena keeps its memory between repeats
+	count = inst_scan(&b->arena, b->image, b->size);
+	if (count < 0) return -1;
+
+	b->insts = b->arena.insts;
+	b->count = count;
+
+	return 0;
+}
+
+int phase_labels(struct bench *b)
+{
+	if (b->size == 0) return 0;
+
+	bitmap_reset(&b->labels);
+
+	return inst_mark_labels(&b->labels, b->image, b->size) < 0 ? -1 : 0;
+}
+
+int phase_format(struct bench *b)
+{
+	uint64 i, len = 0;
+	char *p = b->text;
+	char *end = b->text + TEXT_CHUNK - DECODE_TEXT_MAX;
+
+	for (i = 0; i < b->count; ++i) {
+		if (p > end) {
+			len += p - b->text;
+			p = b->text;
+		}
+
+		p = decode_inst_text(p, b->insts + i, NULL);
+		p = decode_inst_end(p, b->insts + i);
+	}
+
+	b->text_len = len + (p - b->text);
+
+	return 0;
+}
+
+int read_image(const char *path, uint8 **image, uint64 *size)
+{
+	long len;
+	FILE *file;
+
+	file = fopen(path, "rb");
+	if (!file) {
+		fprintf(stderr, "failed to open '%s'\n", path);
+		return -1;
+	}
+
+	fseek(file, 0, SEEK_END);
+	len = ftell(file);
+	fseek(file, 0, SEEK_SET);
+
+	*image = malloc(len > 0 ? len : 1);
+	*size  = len;
+
+	if (!*image || fread(*image, 1, len, file) != (size_t)len) {
+		fprintf(stderr, "failed to read '%s'\n", path);
+		free(*image);
+		fclose(file);
+		return -1;
+	}
+
+	fclose(file);
+
+	return 0;
+}
+
+int write_image(const char *path, const uint8 *image, uint64 size)
+{
+	FILE *file;
+
+	file = fopen(path, "wb");
+	if (!file || fwrite(image, 1, size, file) != size) {
+		fprintf(stderr, "failed to write '%s'\n", path);
+		if (file) fclose(file);
+		return -1;
+	}
+
+	fclose(file);
+
+	return 0;
+}
@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gen.h"
+#include "inst.h"
+
+// jump targets are picked among this many neighbouring instructions
+#define JUMP_REACH 32
+
+static const char *class_names[GEN_CLASS_COUNT] =
+{
+	[GEN_MOV]    = "mov",
+	[GEN_ALU]    = "alu",
+	[GEN_STACK]  = "stack",
+	[GEN_STRING] = "string",
+	[GEN_OTHER]  = "other",
+};
+
+// reg field of opcodes that don't select operation by it
+#define REG_ANY 0xFF
+
+// opcode and reg field for extended opcodes
+struct candidate
+{
+	uint8 op;
+	uint8 reg;
+};
+
+struct candidates
+{
+	struct candidate list[GEN_CLASS_COUNT][256 + 17 * 8];
+	uint             count[GEN_CLASS_COUNT];
+};
+
+// jmp instruction waiting for a forward target
+struct jump
+{
+	uint64 pos;    // offset of the instruction in the image
+	uint64 index;  // instruction index
+	uint8  size;
+};
+
+// xorshift64*
+static uint64 next_rand(uint64 *state);
+static double next_unit(uint64 *state);
+static uint   pick_weighted(uint64 *state, const uint *weights, uint count);
+
+static int  classify(const struct inst_data *data);
+static void collect_candidates(struct candidates *c);
+
+// Writes random instruction of class 'cls' into 'buf'. Returns its size.
+static uint gen_inst(const struct gen_options *opts, uint64 *state,
+                     const struct candidates *c, uint cls, uint8 *buf);
+
+void gen_default_options(struct gen_options *opts)
+{
+	memset(opts, 0, sizeof(*opts));
+
+	opts->count          = 1000000;
+	opts->seed           = 1;
+	opts->prefix_density = 0.03;
+	opts->jump_density   = 0.12;
+
+	opts->mix[GEN_MOV]    = 40;
+	opts->mix[GEN_ALU]    = 30;
+	opts->mix[GEN_STACK]  = 15;
+	opts->mix[GEN_STRING] = 3;
+	opts->mix[GEN_OTHER]  = 12;
+
+	opts->mod_weights[MODE_MEM0]  = 20;
+	opts->mod_weights[MODE_MEM8]  = 25;
+	opts->mod_weights[MODE_MEM16] = 10;
+	opts->mod_weights[MODE_REG]   = 45;
+}
+
+int gen_parse_mix(struct gen_options *opts, const char *str)
+{
+	uint i;
+	char *end;
+	size_t len;
+	unsigned long weight;
+
+	while (*str) {
+		for (i = 0; i < GEN_CLASS_COUNT; ++i) {
+			len = strlen(class_names[i]);
+			if (!strncmp(str, class_names[i], len) && str[len] == '=')
+				break;
+		}
+
+		if (i == GEN_CLASS_COUNT) return -1;
+
+		weight = strtoul(str + len + 1, &end, 10);
+		if (end == str + len + 1) return -1;
+
+		opts->mix[i] = weight;
+
+		str = end;
+		if (*str == ',') ++str;
+		else if (*str != '\0') return -1;
+	}
+
+	return 0;
+}
+
+int gen_image(const struct gen_options *opts, uint8 **image, uint64 *size)
+{
+	int rc = 0;
+	uint len, cls;
+	int64 target, disp;
+	uint64 i, k, pos = 0, state, jump_count = 0;
+	uint64 *offsets = NULL;
+	uint8 *buf = NULL;
+	struct jump *jumps = NULL;
+	struct candidates *c = NULL;
+
+	static const uint8 prefixes[] = { 0x26, 0x2E, 0x36, 0x3E, 0xF0, 0xF3 };
+
+	state = opts->seed * 0x9E3779B97F4A7C15ULL + 1;
+
+	buf     = malloc(opts->count * INST_MAX_SIZE);
+	offsets = malloc((opts->count + 1) * sizeof(*offsets));
+	jumps   = malloc(opts->count * sizeof(*jumps));
+	c       = calloc(1, sizeof(*c));
+	if (!buf || !offsets || !jumps || !c) {
+		fprintf(stderr, "failed to allocate generator buffers\n");
+		rc = -1;
+		goto free_and_exit;
+	}
+
+	collect_candidates(c);
+
+	for (i = 0; i < opts->count; ++i) {
+		offsets[i] = pos;
+
+		// prefix never ends the image
+		if (i + 1 < opts->count &&
+		    next_unit(&state) < opts->prefix_density) {
+			buf[pos++] = prefixes[next_rand(&state) %
+			                      sizeof(prefixes)];
+			continue;
+		}
+
+		if (next_unit(&state) < opts->jump_density) {
+			// jcc/jmp short or call/jmp near, target is set below
+			switch (next_rand(&state) % 4) {
+			case 0:
+			case 1:
+				buf[pos] = 0x70 + next_rand(&state) % 16;
+				len = 2;
+				break;
+			case 2:
+				buf[pos] = 0xEB;
+				len = 2;
+				break;
+			default:
+				buf[pos] = (next_rand(&state) & 1) ? 0xE8 : 0xE9;
+				len = 3;
+				break;
+			}
+
+			jumps[jump_count].pos   = pos;
+			jumps[jump_count].index = i;
+			jumps[jump_count].size  = len;
+			++jump_count;
+
+			pos += len;
+			continue;
+		}
+
+		cls = pick_weighted(&state, opts->mix, GEN_CLASS_COUNT);
+		if (c->count[cls] == 0) cls = GEN_OTHER;
+
+		pos += gen_inst(opts, &state, c, cls, buf + pos);
+	}
+
+	offsets[opts->count] = pos;
+
+	// targets are instruction boundaries around the jump, both directions
+	for (k = 0; k < jump_count; ++k) {
+		i = jumps[k].index;
+
+		target = (int64)i + (int64)(next_rand(&state) %
+		                            (2 * JUMP_REACH + 1)) - JUMP_REACH;
+		if (target < 0) target = 0;
+		if ((uint64)target >= opts->count) target = opts->count - 1;
+
+		disp = (int64)offsets[target] - (int64)(jumps[k].pos +
+		                                        jumps[k].size);
+
+		if (jumps[k].size == 2 && (disp < -128 || disp > 127)) disp = 0;
+
+		buf[jumps[k].pos + 1] = disp & 0xFF;
+		if (jumps[k].size == 3) buf[jumps[k].pos + 2] = (disp >> 8) & 0xFF;
+	}
+
+	*image = buf;
+	*size  = pos;
+	buf    = NULL;
+
+free_and_exit:
+	free(buf);
+	free(offsets);
+	free(jumps);
+	free(c);
+
+	return rc;
+}
+
+uint gen_inst(const struct gen_options *opts, uint64 *state,
+              const struct candidates *c, uint cls, uint8 *buf)
+{
+	int len;
+	uint i;
+	uint8 mod, reg;
+	struct candidate cand;
+
+	cand = c->list[cls][next_rand(state) % c->count[cls]];
+	mod  = pick_weighted(state, opts->mod_weights, 4);
+
+	for (i = 0; i < INST_MAX_SIZE; ++i) {
+		buf[i] = next_rand(state);
+	}
+
+	reg = (cand.reg == REG_ANY) ? (buf[1] >> 3) & 0b111 : cand.reg;
+
+	buf[0] = cand.op;
+	buf[1] = (mod << 6) | (reg << 3) | (buf[1] & 0b111);
+
+	len = inst_length(buf, INST_MAX_SIZE, 0);
+	if (len <= 0) {
+		// candidates are known to be valid
+		fprintf(stderr, "generated invalid instruction 0x%02X 0x%02X\n",
+		        buf[0], buf[1]);
+		abort();
+	}
+
+	return len;
+}
+
+void collect_candidates(struct candidates *c)
+{
+	uint op, reg, row = 0;
+	int cls;
+	const struct inst_data *data;
+
+	for (op = 0; op < 256; ++op) {
+		if (inst_table[op].type != INST_EXTD) {
+			cls = classify(&inst_table[op]);
+			if (cls >= 0) {
+				c->list[cls][c->count[cls]].op  = op;
+				c->list[cls][c->count[cls]].reg = REG_ANY;
+				++c->count[cls];
+			}
+			continue;
+		}
+
+		for (reg = 0; reg < 8; ++reg) {
+			data = &inst_table_extd[row][reg];
+
+			cls = classify(data);
+			if (cls < 0) continue;
+
+			c->list[cls][c->count[cls]].op  = op;
+			c->list[cls][c->count[cls]].reg = reg;
+			++c->count[cls];
+		}
+
+		++row;
+	}
+}
+
+int classify(const struct inst_data *data)
+{
+	switch (data->fmt) {
+	case INST_FMT_RM_ESC:
+	case INST_FMT_JMP_SHORT:
+	case INST_FMT_JMP_NEAR:
+		return -1;
+	default:
+		break;
+	}
+
+	switch (data->type) {
+	case INST_UNK:
+	case INST_EXTD:
+	case INST_LOCK:
+	case INST_REP:
+	case INST_REPNE:
+	case INST_SGMNT:
+	// stop or divert execution
+	case INST_HLT:
+	case INST_INT:
+	case INST_INT3:
+	case INST_INTO:
+	case INST_IRET:
+	case INST_RET:
+	case INST_RETF:
+	case INST_CALL:
+	case INST_CALLF:
+	case INST_JMP:
+	case INST_JMPF:
+		return -1;
+	case INST_MOV:
+	case INST_LEA:
+	case INST_LDS:
+	case INST_LES:
+	case INST_XCHG:
+	case INST_XLAT:
+	case INST_LAHF:
+	case INST_SAHF:
+	case INST_CBW:
+	case INST_CWD:
+		return GEN_MOV;
+	case INST_ADD:
+	case INST_ADC:
+	case INST_SUB:
+	case INST_SBB:
+	case INST_CMP:
+	case INST_AND:
+	case INST_OR:
+	case INST_XOR:
+	case INST_TEST:
+	case INST_INC:
+	case INST_DEC:
+	case INST_NEG:
+	case INST_NOT:
+	case INST_MUL:
+	case INST_IMUL:
+	case INST_DIV:
+	case INST_IDIV:
+	case INST_SHL:
+	case INST_SHR:
+	case INST_SAR:
+	case INST_ROL:
+	case INST_ROR:
+	case INST_RCL:
+	case INST_RCR:
+		return GEN_ALU;
+	case INST_PUSH:
+	case INST_POP:
+	case INST_PUSHF:
+	case INST_POPF:
+		return GEN_STACK;
+	case INST_MOVSB:
+	case INST_MOVSW:
+	case INST_CMPSB:
+	case INST_CMPSW:
+	case INST_LODSB:
+	case INST_LODSW:
+	case INST_STOSB:
+	case INST_STOSW:
+	case INST_SCASB:
+	case INST_SCASW:
+		return GEN_STRING;
+	default:
+		return GEN_OTHER;
+	}
+}
+
+uint64 next_rand(uint64 *state)
+{
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+
+	return *state * 0x2545F4914F6CDD1DULL;
+}
+
+double next_unit(uint64 *state)
+{
+	return (next_rand(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+uint pick_weighted(uint64 *state, const uint *weights, uint count)
+{
+	uint i;
+	uint64 total = 0, r;
+
+	for (i = 0; i < count; ++i) total += weights[i];
+	if (total == 0) return count - 1;
+
+	r = next_rand(state) % total;
+	for (i = 0; i < count; ++i) {
+		if (r < weights[i]) return i;
+		r -= weights[i];
+	}
+
+	return count - 1;
+}
@@ -0,0 +1,41 @@
+#if !defined GEN_H
+#define GEN_H
+
+#include "common.h"
+
+// Opcode classes of the generated instruction mix
+enum gen_class
+{
+	GEN_MOV,    // mov, lea, xchg etc.
+	GEN_ALU,    // arithmetic, logic, shifts
+	GEN_STACK,  // push, pop
+	GEN_STRING, // movsb, stosw etc.
+	GEN_OTHER,  // everything else but jumps and prefixes
+
+	GEN_CLASS_COUNT,
+};
+
+struct gen_options
+{
+	uint64 count;                    // instructions, prefixes included
+	uint64 seed;
+	double prefix_density;           // share of instructions with prefix
+	double jump_density;             // share of jmp/jcc/call instructions
+	uint   mix[GEN_CLASS_COUNT];     // relative weights of opcode classes
+	uint   mod_weights[4];           // relative weights of mod field values
+};
+
+// Fills 'opts' with defaults resembling compiled real mode code.
+extern void gen_default_options(struct gen_options *opts);
+
+// Parses "mov=40,alu=30,..." into 'opts->mix'. Returns 0 on success and
+// negative value if the string is malformed.
+extern int gen_parse_mix(struct gen_options *opts, const char *str);
+
+// Generates valid 8086 image. Every instruction is decodable, jump targets
+// point to instruction boundaries inside the image. '*image' must be freed
+// by the caller. Returns 0 on success and negative value if error occurred.
+extern int gen_image(const struct gen_options *opts, uint8 **image,
+                     uint64 *size);
+
+#endif /* GEN_H */
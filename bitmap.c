@@ -1,9 +1,10 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "bitmap.h"
 
-#define BITS_PER_WORD (sizeof(uint32_t) * 8)
+#define BITS_PER_WORD BITMAP_WORD_BITS
 #define WORD_OFFSET(index) ((index) / BITS_PER_WORD)
 #define BIT_OFFSET(index)  ((index) % BITS_PER_WORD)
 
@@ -12,8 +13,9 @@ int bitmap_init(struct bitmap *map, size_t bit_count)
 	assert(map != NULL);
 	assert(bit_count > 0);
 
-	map->size = WORD_OFFSET(bit_count) + (BIT_OFFSET(bit_count) > 0);
-	map->data = calloc(map->size, sizeof(*map->data));
+	map->size  = WORD_OFFSET(bit_count) + (BIT_OFFSET(bit_count) > 0);
+	map->data  = calloc(map->size, sizeof(*map->data));
+	map->ranks = NULL;
 
 	if (!map->data) return -1;
 	return 0;
@@ -22,7 +24,9 @@ int bitmap_init(struct bitmap *map, size_t bit_count)
 void bitmap_free(struct bitmap *map)
 {
 	free(map->data);
-	map->data = NULL;
+	free(map->ranks);
+	map->data  = NULL;
+	map->ranks = NULL;
 }
 
 int bitmap_set_bit(struct bitmap *map, size_t bit_id)
@@ -32,7 +36,7 @@ int bitmap_set_bit(struct bitmap *map, size_t bit_id)
 
 	if (bit_id >= map->size * BITS_PER_WORD) return -1;
 
-	map->data[WORD_OFFSET(bit_id)] |= (1 << BIT_OFFSET(bit_id));
+	map->data[WORD_OFFSET(bit_id)] |= (1ULL << BIT_OFFSET(bit_id));
 	return 0;
 }
 
@@ -43,7 +47,7 @@ int bitmap_clear_bit(struct bitmap *map, size_t bit_id)
 
 	if (bit_id >= map->size * BITS_PER_WORD) return -1;
 
-	map->data[WORD_OFFSET(bit_id)] &= ~(1 << BIT_OFFSET(bit_id));
+	map->data[WORD_OFFSET(bit_id)] &= ~(1ULL << BIT_OFFSET(bit_id));
 	return 0;
 }
 
@@ -56,7 +60,148 @@ int bitmap_get_bit(struct bitmap *map, size_t bit_id)
 
 	if (bit_id >= map->size * BITS_PER_WORD) return -1;
 
-	bit = map->data[WORD_OFFSET(bit_id)] & (1 << BIT_OFFSET(bit_id));
-	return bit != 0;
+	bit = (map->data[WORD_OFFSET(bit_id)] & (1ULL << BIT_OFFSET(bit_id))) != 0;
+	return bit;
 }
 
+void bitmap_reset(struct bitmap *map)
+{
+	assert(map != NULL);
+
+	memset(map->data, 0, map->size * sizeof(*map->data));
+}
+
+int64_t bitmap_find_next_set(const struct bitmap *map, size_t bit_id)
+{
+	size_t word;
+	uint64_t bits;
+
+	assert(map != NULL);
+
+	word = WORD_OFFSET(bit_id);
+	if (word >= map->size) return -1;
+
+	// ignore bits before 'bit_id' in the first word
+	bits = map->data[word] & (~0ULL << BIT_OFFSET(bit_id));
+
+	while (bits == 0) {
+		if (++word == map->size) return -1;
+		bits = map->data[word];
+	}
+
+	return word * BITS_PER_WORD + __builtin_ctzll(bits);
+}
+
+size_t bitmap_count(const struct bitmap *map)
+{
+	size_t i, count = 0;
+
+	assert(map != NULL);
+
+	for (i = 0; i < map->size; ++i) {
+		count += __builtin_popcountll(map->data[i]);
+	}
+
+	return count;
+}
+
+void bitmap_or(struct bitmap *dst, const struct bitmap *src,
+               size_t bit_offset)
+{
+	size_t i, word;
+
+	assert(dst != NULL && src != NULL);
+	assert(BIT_OFFSET(bit_offset) == 0);
+
+	word = WORD_OFFSET(bit_offset);
+
+	for (i = 0; i < src->size && word + i < dst->size; ++i) {
+		dst->data[word + i] |= src->data[i];
+	}
+}
+
+int bitmap_build_ranks(struct bitmap *map)
+{
+	size_t i, count = 0;
+
+	assert(map != NULL);
+
+	free(map->ranks);
+	map->ranks = malloc((map->size / BITMAP_RANK_WORDS + 1) *
+	                    sizeof(*map->ranks));
+	if (!map->ranks) return -1;
+
+	for (i = 0; i < map->size; ++i) {
+		if (i % BITMAP_RANK_WORDS == 0) {
+			map->ranks[i / BITMAP_RANK_WORDS] = count;
+		}
+
+		count += __builtin_popcountll(map->data[i]);
+	}
+
+	if (i % BITMAP_RANK_WORDS == 0) {
+		map->ranks[i / BITMAP_RANK_WORDS] = count;
+	}
+
+	return 0;
+}
+
+size_t bitmap_rank(const struct bitmap *map, size_t bit_id)
+{
+	size_t i, word, rank;
+
+	assert(map != NULL && map->ranks != NULL);
+
+	word = WORD_OFFSET(bit_id);
+	if (word >= map->size) return bitmap_count(map);
+
+	// at most BITMAP_RANK_WORDS popcounts after the directory lookup
+	rank = map->ranks[word / BITMAP_RANK_WORDS];
+	for (i = word - word % BITMAP_RANK_WORDS; i < word; ++i) {
+		rank += __builtin_popcountll(map->data[i]);
+	}
+
+	if (BIT_OFFSET(bit_id) > 0) {
+		rank += __builtin_popcountll(map->data[word] &
+		                             (~0ULL >> (BITS_PER_WORD -
+		                                        BIT_OFFSET(bit_id))));
+	}
+
+	return rank;
+}
+
+int64_t bitmap_select(const struct bitmap *map, size_t n)
+{
+	size_t lo = 0, hi, mid, word, count;
+	uint64_t bits;
+
+	assert(map != NULL && map->ranks != NULL);
+
+	// last directory entry with rank <= n
+	hi = (map->size + BITMAP_RANK_WORDS - 1) / BITMAP_RANK_WORDS;
+	while (lo + 1 < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (map->ranks[mid] <= n) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
+	}
+
+	count = map->ranks[lo];
+
+	for (word = lo * BITMAP_RANK_WORDS; word < map->size; ++word) {
+		bits = map->data[word];
+		if (count + __builtin_popcountll(bits) > n) break;
+		count += __builtin_popcountll(bits);
+	}
+
+	if (word >= map->size) return -1;
+
+	// drop lower set bits until the wanted one is the lowest
+	for (; count < n; ++count) {
+		bits &= bits - 1;
+	}
+
+	return word * BITS_PER_WORD + __builtin_ctzll(bits);
+}
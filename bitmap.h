@@ -4,12 +4,18 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#define BITMAP_WORD_BITS (sizeof(uint64_t) * 8)
+
 struct bitmap
 {
-	uint32_t *data;
-	size_t    size;
+	uint64_t *data;
+	size_t    size;  // in words
+	uint64_t *ranks; // set bits before every BITMAP_RANK_WORDS words
 };
 
+// words covered by one entry of the rank directory
+#define BITMAP_RANK_WORDS 8
+
 extern int  bitmap_init(struct bitmap *map, size_t bit_count);
 extern void bitmap_free(struct bitmap *map);
 
@@ -17,4 +23,32 @@ extern int bitmap_set_bit(struct bitmap *map, size_t bit_id);
 extern int bitmap_clear_bit(struct bitmap *map, size_t bit_id);
 extern int bitmap_get_bit(struct bitmap *map, size_t bit_id);
 
+// Clears all bits.
+extern void bitmap_reset(struct bitmap *map);
+
+// Returns index of the first set bit at or after 'bit_id' or -1 if there are
+// none.
+extern int64_t bitmap_find_next_set(const struct bitmap *map, size_t bit_id);
+
+// Returns number of set bits.
+extern size_t bitmap_count(const struct bitmap *map);
+
+// Sets bits of 'dst' that are set in 'src', bit 0 of 'src' corresponds to
+// 'bit_offset' in 'dst' ('bit_offset' must be a multiple of
+// BITMAP_WORD_BITS). Bits that don't fit into 'dst' are ignored.
+extern void bitmap_or(struct bitmap *dst, const struct bitmap *src,
+                      size_t bit_offset);
+
+// Builds rank directory used by bitmap_rank() and bitmap_select(). Must be
+// rebuilt after the bitmap is modified. Returns 0 on success and -1 if
+// allocation failed.
+extern int bitmap_build_ranks(struct bitmap *map);
+
+// Returns number of set bits before 'bit_id'. Requires rank directory.
+extern size_t bitmap_rank(const struct bitmap *map, size_t bit_id);
+
+// Returns index of the 'n'-th (starting from 0) set bit or -1 if there are
+// fewer set bits. Requires rank directory.
+extern int64_t bitmap_select(const struct bitmap *map, size_t n);
+
 #endif // BITMAP_H
@@ -0,0 +1,234 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "inst.h"
+
+#define CACHE_MAGIC "D86C"
+#define CACHE_EXT   ".d86"
+
+#define HASH_K1 0x9E3779B97F4A7C15ULL
+#define HASH_K2 0xC2B2AE3D27D4EB4FULL
+
+static uint64 table_hash(void);
+static int    write_all(int fd, const void *data, uint64 size);
+
+// Checks that values used as table indices and lengths are in range, so a
+// corrupted record can't make the printer read out of bounds. Returns true
+// if every instruction is valid.
+static bool   insts_valid(const struct inst *insts, uint64 count,
+                          uint64 image_size);
+
+static inline uint64 hash_mix(uint64 h)
+{
+	h ^= h >> 33;
+	h *= HASH_K2;
+	h ^= h >> 29;
+	h *= HASH_K1;
+	h ^= h >> 32;
+
+	return h;
+}
+
+uint64 cache_hash(const void *data, uint64 size)
+{
+	const uint8 *p = data;
+	uint64 h = HASH_K1 ^ (size * HASH_K2);
+	uint64 w, i;
+
+	for (i = 0; i + 8 <= size; i += 8) {
+		memcpy(&w, p + i, sizeof(w));
+		h = (h ^ hash_mix(w)) * HASH_K1;
+		h = (h << 31) | (h >> 33);
+	}
+
+	for (w = 0; i < size; ++i) {
+		w = (w << 8) | p[i];
+	}
+
+	return hash_mix(h ^ hash_mix(w));
+}
+
+int cache_load(struct cache_entry *entry, const char *dir, uint64 image_hash,
+               uint64 image_size)
+{
+	int fd, rc = 0;
+	char path[4096];
+	void *map;
+	struct stat st;
+	const struct cache_header *hdr;
+
+	assert(entry != NULL && dir != NULL);
+
+	memset(entry, 0, sizeof(*entry));
+
+	snprintf(path, sizeof(path), "%s/%016" PRIx64 CACHE_EXT, dir,
+	         image_hash);
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) return 0;
+
+	if (fstat(fd, &st) < 0 || (uint64)st.st_size < sizeof(*hdr)) {
+		goto close_and_exit;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("failed to map cache record");
+		rc = -1;
+		goto close_and_exit;
+	}
+
+	hdr = map;
+
+	// stale or foreign records are treated as misses
+	if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) ||
+	    hdr->version    != CACHE_VERSION ||
+	    hdr->table_hash != table_hash()  ||
+	    hdr->image_hash != image_hash    ||
+	    hdr->image_size != image_size    ||
+	    hdr->inst_offset % sizeof(uint64) != 0 ||
+	    hdr->inst_offset < sizeof(*hdr) ||
+	    hdr->inst_offset > (uint64)st.st_size ||
+	    // divided, the product could overflow
+	    hdr->inst_count > ((uint64)st.st_size - hdr->inst_offset) /
+	                      sizeof(struct inst) ||
+	    !insts_valid((const struct inst *)((uint8 *)map +
+	                                       hdr->inst_offset),
+	                 hdr->inst_count, image_size)) {
+		munmap(map, st.st_size);
+		goto close_and_exit;
+	}
+
+	entry->map        = map;
+	entry->map_size   = st.st_size;
+	entry->insts      = (const struct inst *)((uint8 *)map +
+	                                          hdr->inst_offset);
+	entry->inst_count = hdr->inst_count;
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	rc = 1;
+
+close_and_exit:
+	close(fd);
+
+	return rc;
+}
+
+int cache_store(const char *dir, uint64 image_hash, uint64 image_size,
+                const struct inst *insts, uint64 count)
+{
+	int fd, rc = 0;
+	char path[4096], tmp_path[4096 + 32];
+	struct cache_header hdr;
+
+	assert(dir != NULL && (insts != NULL || count == 0));
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+	hdr.version       = CACHE_VERSION;
+	hdr.table_hash    = table_hash();
+	hdr.image_hash    = image_hash;
+	hdr.image_size    = image_size;
+	hdr.inst_count    = count;
+	hdr.inst_offset   = sizeof(hdr);
+
+	snprintf(path, sizeof(path), "%s/%016" PRIx64 CACHE_EXT, dir,
+	         image_hash);
+	snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.tmp", path,
+	         (long)getpid());
+
+	fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("failed to create cache record");
+		return -2;
+	}
+
+	if (write_all(fd, &hdr, sizeof(hdr)) < 0 ||
+	    write_all(fd, insts, count * sizeof(*insts)) < 0) {
+		perror("failed to write cache record");
+		close(fd);
+		unlink(tmp_path);
+		return -3;
+	}
+
+	close(fd);
+
+	if (rename(tmp_path, path) < 0) {
+		perror("failed to rename cache record");
+		unlink(tmp_path);
+		rc = -4;
+	}
+
+	return rc;
+}
+
+void cache_release(struct cache_entry *entry)
+{
+	if (entry->map) munmap(entry->map, entry->map_size);
+
+	memset(entry, 0, sizeof(*entry));
+}
+
+// Hash of everything decoding results depend on: opcode tables and layout of
+// struct inst. Changing either invalidates all cached records.
+uint64 table_hash(void)
+{
+	uint64 h;
+
+	h  = cache_hash(inst_table, sizeof(inst_table));
+	h ^= hash_mix(cache_hash(inst_table_extd, sizeof(inst_table_extd)));
+	h ^= hash_mix(sizeof(struct inst) * HASH_K2 + sizeof(struct inst_data));
+
+	return h;
+}
+
+bool insts_valid(const struct inst *insts, uint64 count, uint64 image_size)
+{
+	uint64 i;
+	const struct inst *inst;
+
+	for (i = 0; i < count; ++i) {
+		inst = insts + i;
+
+		if ((uint)inst->base.type >= INST_EXTD ||
+		    (uint)inst->base.fmt > INST_FMT_JMP_FAR ||
+		    inst->base.size == 0 || inst->base.size > INST_MAX_SIZE ||
+		    inst->offset >= image_size ||
+		    // -m reads raw instruction bytes from the image
+		    inst->base.size > image_size - inst->offset) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+int write_all(int fd, const void *data, uint64 size)
+{
+	const uint8 *p = data;
+	ssize_t nwritten;
+
+	while (size > 0) {
+		nwritten = write(fd, p, size);
+		if (nwritten < 0) {
+			if (errno == EINTR) continue;
+			return -1;
+		}
+
+		p    += nwritten;
+		size -= nwritten;
+	}
+
+	return 0;
+}
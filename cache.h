@@ -0,0 +1,50 @@
+#if !defined CACHE_H
+#define CACHE_H
+
+#include "common.h"
+#include "inst.h"
+
+// bump when decoded instruction layout or decoding logic changes
+#define CACHE_VERSION 3
+
+struct cache_header
+{
+	char   magic[4];
+	uint32 version;
+	uint64 table_hash;    // opcode tables and struct inst layout
+	uint64 image_hash;
+	uint64 image_size;
+	uint64 inst_count;
+	uint64 inst_offset;   // file offset of instruction array
+};
+
+// Cached decoding result mapped from the cache directory
+struct cache_entry
+{
+	void              *map;
+	uint64             map_size;
+	const struct inst *insts;    // labels are marked with F_LB
+	uint64             inst_count;
+};
+
+// Fast 64-bit content hash. It isn't cryptographic and a hit isn't checked
+// against the image bytes: records are keyed by hash and size only, so two
+// images of the same size colliding on the hash (by accident or crafted)
+// would share a record. Don't point the cache at untrusted images.
+extern uint64 cache_hash(const void *data, uint64 size);
+
+// Looks up decoded instructions of an image with content hash 'image_hash'
+// (see cache_hash()) in 'dir'. Returns 1 and fills 'entry' on hit, 0 on miss
+// and negative value if error occurred.
+extern int cache_load(struct cache_entry *entry, const char *dir,
+                      uint64 image_hash, uint64 image_size);
+
+// Writes decoded instructions of an image into 'dir'. The record is written
+// into a temporary file first and then renamed. Returns 0 on success and
+// negative value if error occurred.
+extern int cache_store(const char *dir, uint64 image_hash, uint64 image_size,
+                       const struct inst *insts, uint64 count);
+
+extern void cache_release(struct cache_entry *entry);
+
+#endif /* CACHE_H */
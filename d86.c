@@ -0,0 +1,133 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "d86.h"
+#include "bitmap.h"
+#include "common.h"
+#include "decoder.h"
+#include "inst.h"
+
+_Static_assert(D86_TEXT_MAX == DECODE_TEXT_MAX, "text bounds differ");
+
+struct d86_ctx
+{
+	struct inst_arena arena;
+	struct bitmap     labels;
+	uint64            label_bits; // capacity of 'labels'
+
+	// offset of the instruction that failed the last decode call
+	uint64            err_offset;
+};
+
+struct d86_ctx *d86_new(void)
+{
+	struct d86_ctx *ctx;
+
+	ctx = calloc(1, sizeof(*ctx));
+	if (ctx) inst_arena_init(&ctx->arena);
+
+	return ctx;
+}
+
+void d86_free(struct d86_ctx *ctx)
+{
+	if (!ctx) return;
+
+	inst_arena_free(&ctx->arena);
+	if (ctx->labels.data) bitmap_free(&ctx->labels);
+	free(ctx);
+}
+
+int d86_decode_one(struct d86_ctx *ctx, const uint8 *bytes, uint64 len)
+{
+	struct inst *inst;
+
+	if (!ctx || !bytes || len == 0) return D86_ERR_ARGS;
+
+	ctx->err_offset  = 0;
+	ctx->arena.count = 0;
+
+	if (inst_arena_reserve(&ctx->arena, 1) < 0) return D86_ERR_NOMEM;
+
+	inst = ctx->arena.insts;
+	if (inst_decode(inst, bytes, len, 0) < 0) return D86_ERR_BOUNDS;
+	if (inst->base.type == INST_UNK) return D86_ERR_UNKNOWN;
+
+	ctx->arena.count = 1;
+
+	return inst->base.size;
+}
+
+int64 d86_decode_range(struct d86_ctx *ctx, const uint8 *image, uint64 size)
+{
+	int64 rc;
+
+	if (!ctx || (!image && size > 0)) return D86_ERR_ARGS;
+
+	ctx->err_offset  = 0;
+	ctx->arena.count = 0;
+
+	if (size == 0) return 0;
+
+	// scratch memory only grows, so scans of same or smaller images reuse
+	// it as is
+	if (size > ctx->label_bits) {
+		if (ctx->labels.data) bitmap_free(&ctx->labels);
+		ctx->label_bits = 0;
+
+		if (bitmap_init(&ctx->labels, size) < 0) return D86_ERR_NOMEM;
+
+		ctx->label_bits = size;
+	} else {
+		bitmap_reset(&ctx->labels);
+	}
+
+	rc = inst_scan_into(&ctx->arena, &ctx->labels, image, size,
+	                    &ctx->err_offset);
+	if (rc == -5) rc = D86_ERR_NOMEM;
+	if (rc < 0) ctx->arena.count = 0;
+
+	return rc;
+}
+
+uint64 d86_error_offset(const struct d86_ctx *ctx)
+{
+	return ctx ? ctx->err_offset : 0;
+}
+
+int64 d86_inst_offset(const struct d86_ctx *ctx, uint64 index)
+{
+	if (!ctx || index >= ctx->arena.count) return D86_ERR_ARGS;
+
+	return ctx->arena.insts[index].offset;
+}
+
+int d86_format(const struct d86_ctx *ctx, uint64 index, char *buf,
+               uint64 cap)
+{
+	char *p;
+	struct inst tmp;
+
+	if (!ctx || index >= ctx->arena.count || !buf) return D86_ERR_ARGS;
+	if (cap < D86_TEXT_MAX) return D86_ERR_BOUNDS;
+
+	tmp = ctx->arena.insts[index];
+
+	p = decode_inst_text(buf, &tmp, NULL);
+	p = decode_inst_end(p, &tmp);
+
+	return p - buf;
+}
+
+const char *d86_strerror(int err)
+{
+	switch (err) {
+	case D86_OK:          return "success";
+	case D86_ERR_BOUNDS:  return "instruction crosses end of input";
+	case D86_ERR_UNKNOWN: return "unknown instruction";
+	case D86_ERR_NOMEM:   return "out of memory";
+	case D86_ERR_ARGS:    return "invalid arguments";
+	}
+
+	return "unknown error";
+}
@@ -0,0 +1,62 @@
+#if !defined D86_H
+#define D86_H
+
+#include <stdint.h>
+
+// Public interface of the decoder library (libdecoder8086). Functions don't
+// print anything and don't touch global state: everything a scan needs lives
+// in the context, so contexts can be used from different threads at the same
+// time. Scratch memory of a context is reused, repeated scans of images that
+// aren't larger than the previous ones don't allocate.
+
+// upper bound of d86_format() text length
+#define D86_TEXT_MAX 128
+
+enum d86_error
+{
+	D86_OK          =  0,
+	D86_ERR_BOUNDS  = -1, // instruction crosses the end of input
+	D86_ERR_UNKNOWN = -2, // unknown opcode
+	D86_ERR_NOMEM   = -3,
+	D86_ERR_ARGS    = -4,
+};
+
+// Decoder context, holds the instructions of the last decode call. Layout is
+// private to the library.
+struct d86_ctx;
+
+// Returns new context, or NULL if allocation failed.
+extern struct d86_ctx *d86_new(void);
+extern void            d86_free(struct d86_ctx *ctx);
+
+// Decodes a single instruction from the start of 'bytes' into the context.
+// Prefixes are decoded as separate instructions, label flags aren't set.
+// Returns instruction size on success and negative d86_error otherwise.
+extern int d86_decode_one(struct d86_ctx *ctx, const uint8_t *bytes,
+                          uint64_t len);
+
+// Decodes all instructions of 'image' into the context with prefixes applied
+// and labels resolved. Returns instruction count on success and negative
+// d86_error otherwise, see d86_error_offset() for location.
+extern int64_t d86_decode_range(struct d86_ctx *ctx, const uint8_t *image,
+                                uint64_t size);
+
+// Returns offset of the instruction that failed the last decode call.
+extern uint64_t d86_error_offset(const struct d86_ctx *ctx);
+
+// Returns image offset of instruction 'index' of the last decode call, or
+// D86_ERR_ARGS if there's no such instruction.
+extern int64_t d86_inst_offset(const struct d86_ctx *ctx, uint64_t index);
+
+// Writes NASM text of instruction 'index' of the last decode call into 'buf':
+// label line, instruction and what separates it from the next one (newline,
+// or a space after lock and rep prefixes), so texts of consecutive
+// instructions form a listing. Returns text length, D86_ERR_ARGS if there's no
+// such instruction, or D86_ERR_BOUNDS if 'cap' is less than D86_TEXT_MAX.
+extern int d86_format(const struct d86_ctx *ctx, uint64_t index, char *buf,
+                      uint64_t cap);
+
+// Returns static description of an error code.
+extern const char *d86_strerror(int err);
+
+#endif /* D86_H */
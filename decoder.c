@@ -2,40 +2,194 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-#include "bitmap.h"
 #include "decoder.h"
 #include "inst.h"
+#include "labels.h"
+#include "outbuf.h"
+#include "profile.h"
 
 #define W(flags) (!!((flags) & F_W))
 
-static char *segregs[4] = { "es", "cs", "ss", "ds" };
-static char *regs[2][16] =
+// string with its length, so it can be copied without strlen()
+struct name
 {
-	{ "al", "cl", "dl", "bl", "ah", "ch", "dh", "bh" },
-	{ "ax", "cx", "dx", "bx", "sp", "bp", "si", "di" },
+	const char *str;
+	uint8       len;
 };
 
-static const char *gen_name(enum inst_type type);
+#define NAME(str) { str, sizeof(str) - 1 }
 
-typedef void (*decode_fn)(FILE *, struct inst *);
+static const struct name segregs[4] =
+{
+	NAME("es"), NAME("cs"), NAME("ss"), NAME("ds"),
+};
 
-static void decode_rm   (FILE *out, struct inst *inst);
-static void decode_sr   (FILE *out, struct inst *inst);
-static void decode_reg  (FILE *out, struct inst *inst);
-static void decode_v    (FILE *out, struct inst *inst);
-static void decode_imm  (FILE *out, struct inst *inst);
-static void decode_acc  (FILE *out, struct inst *inst);
-static void decode_dx   (FILE *out, struct inst *inst);
-static void decode_imm8 (FILE *out, struct inst *inst);
-static void decode_mem  (FILE *out, struct inst *inst);
-static void decode_addr (FILE *out, struct inst *inst);
-static void decode_naddr(FILE *out, struct inst *inst);
-static void decode_faddr(FILE *out, struct inst *inst);
+static const struct name regs[2][8] =
+{
+	{
+		NAME("al"), NAME("cl"), NAME("dl"), NAME("bl"),
+		NAME("ah"), NAME("ch"), NAME("dh"), NAME("bh"),
+	},
+	{
+		NAME("ax"), NAME("cx"), NAME("dx"), NAME("bx"),
+		NAME("sp"), NAME("bp"), NAME("si"), NAME("di"),
+	},
+};
 
-int decode_inst(FILE *out, struct inst *inst)
+static const struct name ea_base[8] =
 {
-	decode_fn op1 = NULL, op2 = NULL, tmp;
+	NAME("[bx + si"),
+	NAME("[bx + di"),
+	NAME("[bp + si"),
+	NAME("[bp + di"),
+	NAME("[si"),
+	NAME("[di"),
+	NAME("[bp"),
+	NAME("[bx"),
+};
+
+static const struct name names[INST_EXTD + 1] =
+{
+	[INST_AAA]    = NAME("aaa"),
+	[INST_AAD]    = NAME("aad"),
+	[INST_AAM]    = NAME("aam"),
+	[INST_AAS]    = NAME("aas"),
+	[INST_ADC]    = NAME("adc"),
+	[INST_ADD]    = NAME("add"),
+	[INST_AND]    = NAME("and"),
+	[INST_CALL]   = NAME("call"),
+	[INST_CALLF]  = NAME("callf"),
+	[INST_CBW]    = NAME("cbw"),
+	[INST_CLC]    = NAME("clc"),
+	[INST_CLD]    = NAME("cld"),
+	[INST_CLI]    = NAME("cli"),
+	[INST_CMC]    = NAME("cmc"),
+	[INST_CMP]    = NAME("cmp"),
+	[INST_CMPSB]  = NAME("cmpsb"),
+	[INST_CMPSW]  = NAME("cmpsw"),
+	[INST_CWD]    = NAME("cwd"),
+	[INST_DAA]    = NAME("daa"),
+	[INST_DAS]    = NAME("das"),
+	[INST_DEC]    = NAME("dec"),
+	[INST_DIV]    = NAME("div"),
+	[INST_ESC]    = NAME("esc"),
+	[INST_HLT]    = NAME("hlt"),
+	[INST_IDIV]   = NAME("idiv"),
+	[INST_IMUL]   = NAME("imul"),
+	[INST_IN]     = NAME("in"),
+	[INST_INC]    = NAME("inc"),
+	[INST_INT]    = NAME("int"),
+	[INST_INT3]   = NAME("int3"),
+	[INST_INTO]   = NAME("into"),
+	[INST_IRET]   = NAME("iret"),
+	[INST_JA]     = NAME("ja"),
+	[INST_JAE]    = NAME("jae"),
+	[INST_JB]     = NAME("jb"),
+	[INST_JBE]    = NAME("jbe"),
+	[INST_JCXZ]   = NAME("jcxz"),
+	[INST_JE]     = NAME("je"),
+	[INST_JG]     = NAME("jg"),
+	[INST_JGE]    = NAME("jge"),
+	[INST_JL]     = NAME("jl"),
+	[INST_JLE]    = NAME("jle"),
+	[INST_JMP]    = NAME("jmp"),
+	[INST_JMPF]   = NAME("jmpf"),
+	[INST_JNE]    = NAME("jne"),
+	[INST_JNO]    = NAME("jno"),
+	[INST_JNS]    = NAME("jns"),
+	[INST_JO]     = NAME("jo"),
+	[INST_JP]     = NAME("jp"),
+	[INST_JPO]    = NAME("jpo"),
+	[INST_JS]     = NAME("js"),
+	[INST_LAHF]   = NAME("lahf"),
+	[INST_LDS]    = NAME("lds"),
+	[INST_LEA]    = NAME("lea"),
+	[INST_LES]    = NAME("les"),
+	[INST_LOCK]   = NAME("lock"),
+	[INST_LODSB]  = NAME("lodsb"),
+	[INST_LODSW]  = NAME("lodsw"),
+	[INST_LOOP]   = NAME("loop"),
+	[INST_LOOPZ]  = NAME("loopz"),
+	[INST_LOOPNZ] = NAME("loopnz"),
+	[INST_MOV]    = NAME("mov"),
+	[INST_MOVSB]  = NAME("movsb"),
+	[INST_MOVSW]  = NAME("movsw"),
+	[INST_MUL]    = NAME("mul"),
+	[INST_NEG]    = NAME("neg"),
+	[INST_NOP]    = NAME("nop"),
+	[INST_NOT]    = NAME("not"),
+	[INST_OR]     = NAME("or"),
+	[INST_OUT]    = NAME("out"),
+	[INST_POP]    = NAME("pop"),
+	[INST_POPF]   = NAME("popf"),
+	[INST_PUSH]   = NAME("push"),
+	[INST_PUSHF]  = NAME("pushf"),
+	[INST_RCL]    = NAME("rcl"),
+	[INST_RCR]    = NAME("rcr"),
+	[INST_REP]    = NAME("rep"),
+	[INST_REPNE]  = NAME("repne"),
+	[INST_RET]    = NAME("ret"),
+	[INST_RETF]   = NAME("retf"),
+	[INST_ROL]    = NAME("rol"),
+	[INST_ROR]    = NAME("ror"),
+	[INST_SAHF]   = NAME("sahf"),
+	[INST_SAR]    = NAME("sar"),
+	[INST_SBB]    = NAME("sbb"),
+	[INST_SCASB]  = NAME("scasb"),
+	[INST_SCASW]  = NAME("scasw"),
+	[INST_SGMNT]  = NAME(""),
+	[INST_SHL]    = NAME("shl"),
+	[INST_SHR]    = NAME("shr"),
+	[INST_STC]    = NAME("stc"),
+	[INST_STD]    = NAME("std"),
+	[INST_STOSB]  = NAME("stosb"),
+	[INST_STOSW]  = NAME("stosw"),
+	[INST_STI]    = NAME("sti"),
+	[INST_SUB]    = NAME("sub"),
+	[INST_TEST]   = NAME("test"),
+	[INST_WAIT]   = NAME("wait"),
+	[INST_XCHG]   = NAME("xchg"),
+	[INST_XLAT]   = NAME("xlat"),
+	[INST_XOR]    = NAME("xor"),
+	[INST_UNK]    = NAME("<invalid>"),
+};
+
+static const struct name name_unknown = NAME("<unknown>");
+
+typedef char *(*decode_fn)(char *p, struct inst *inst);
+
+static char *put_name(char *p, const struct name *name);
+
+// Name of label at 'addr': its ordinal in 'labels', or its offset if
+// 'labels' is NULL. Targets without a label are printed as plain addresses.
+static char *put_label(char *p, int64 addr, const struct label_index *labels);
+
+// Label line of the instruction, if it has one
+static char *decode_label(char *p, struct inst *inst,
+                          const struct label_index *labels);
+// Mnemonic and operands
+static char *decode_body(char *p, struct inst *inst,
+                         const struct label_index *labels);
+
+static char *decode_rm   (char *p, struct inst *inst);
+static char *decode_sr   (char *p, struct inst *inst);
+static char *decode_reg  (char *p, struct inst *inst);
+static char *decode_v    (char *p, struct inst *inst);
+static char *decode_esc  (char *p, struct inst *inst);
+static char *decode_imm  (char *p, struct inst *inst);
+static char *decode_acc  (char *p, struct inst *inst);
+static char *decode_dx   (char *p, struct inst *inst);
+static char *decode_imm8 (char *p, struct inst *inst);
+static char *decode_mem  (char *p, struct inst *inst);
+static char *decode_naddr(char *p, struct inst *inst);
+static char *decode_faddr(char *p, struct inst *inst);
+
+int decode_inst(struct outbuf *out, struct inst *inst,
+                const struct label_index *labels)
+{
+	char *p;
 
 	if (!out || !inst) {
 		fprintf(stderr, "invalid arguments (out: %p, image: %p)\n", out,
@@ -43,13 +197,138 @@ int decode_inst(FILE *out, struct inst *inst)
 		return -1;
 	}
 
+	PROF_BEGIN(format, "decode_inst");
+
+	p = outbuf_reserve(out, DECODE_TEXT_MAX);
+	if (p) outbuf_commit(out, decode_inst_text(p, inst, labels));
+
+	PROF_END(format);
+
+	return p ? 0 : -2;
+}
+
+char *decode_inst_text(char *p, struct inst *inst,
+                       const struct label_index *labels)
+{
+	return decode_body(decode_label(p, inst, labels), inst, labels);
+}
+
+int decode_memo_init(struct decode_memo *memo)
+{
+	memo->hits     = 0;
+	memo->misses   = 0;
+	memo->bypassed = 0;
+	memo->entries  = calloc(DECODE_MEMO_SIZE, sizeof(*memo->entries));
+
+	if (!memo->entries) {
+		fprintf(stderr, "failed to allocate decode memo\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+void decode_memo_free(struct decode_memo *memo)
+{
+	free(memo->entries);
+	memo->entries = NULL;
+}
+
+int decode_inst_memo(struct outbuf *out, struct decode_memo *memo,
+                     struct inst *inst, const uint8 *raw,
+                     const struct label_index *labels)
+{
+	char *p, *text;
+	uint8 i;
+	uint64 key;
+	struct decode_memo_entry *entry;
+
+	// jmp targets depend on the instruction offset
+	if (!memo || !raw || inst->base.size > INST_MAX_SIZE ||
+	    inst->base.fmt == INST_FMT_JMP_SHORT ||
+	    inst->base.fmt == INST_FMT_JMP_NEAR) {
+		if (memo) memo->bypassed++;
+		return decode_inst(out, inst, labels);
+	}
+
+	p = outbuf_reserve(out, DECODE_TEXT_MAX);
+	if (!p) return -2;
+
+	p = decode_label(p, inst, labels);
+
+	// bytes 0-5: instruction, byte 6: prefixes, byte 7: size (never 0)
+	key = (uint64)inst->base.size << 56 |
+	      (uint64)inst->base.prefixes << 48;
+	for (i = 0; i < inst->base.size; ++i) {
+		key |= (uint64)raw[i] << (i * 8);
+	}
+
+	entry = memo->entries +
+	        ((key * 0x9E3779B97F4A7C15ULL) >> (64 - DECODE_MEMO_BITS));
+
+	if (entry->key == key) {
+		memo->hits++;
+		p = fmt_str(p, entry->text, entry->len);
+	} else {
+		memo->misses++;
+		text = p;
+		p = decode_body(p, inst, labels);
+
+		if (p - text <= (long)sizeof(entry->text)) {
+			entry->key = key;
+			entry->len = p - text;
+			memcpy(entry->text, text, entry->len);
+		}
+	}
+
+	outbuf_commit(out, p);
+
+	return 0;
+}
+
+char *put_label(char *p, int64 addr, const struct label_index *labels)
+{
+	int64 ordinal;
+
+	if (!labels) {
+		p = fmt_str(p, "label_", 6);
+		return fmt_int(p, addr);
+	}
+
+	// targets outside of the image have no bit in the label bitmap
+	ordinal = (addr >= 0) ? label_index_ordinal(labels, addr) : -1;
+	if (ordinal < 0) return fmt_int(p, (int16)addr);
+
+	p = fmt_str(p, "label_", 6);
+	return fmt_uint(p, ordinal);
+}
+
+char *decode_label(char *p, struct inst *inst,
+                   const struct label_index *labels)
+{
 	if (inst->base.flags & F_LB) {
-		fprintf(out, "label_%u:\n", inst->offset);
+		p = put_label(p, inst->offset, labels);
+		p = fmt_str(p, ":\n", 2);
 	}
 
-	fprintf(out, "%s", gen_name(inst->base.type));
+	return p;
+}
+
+char *decode_body(char *p, struct inst *inst,
+                  const struct label_index *labels)
+{
+	int64 addr;
+	decode_fn op1 = NULL, op2 = NULL, tmp;
+
+	assert(inst->base.type != INST_EXTD && "INST_EXTD encountered");
 
-	if (inst->base.prefixes & PFX_FAR) fprintf(out, " far");
+	if (inst->base.type < INST_EXTD) {
+		p = put_name(p, names + inst->base.type);
+	} else {
+		p = put_name(p, &name_unknown);
+	}
+
+	if (inst->base.prefixes & PFX_FAR) p = fmt_str(p, " far", 4);
 
 	switch (inst->base.fmt) {
 	case INST_FMT_RM:
@@ -72,7 +351,8 @@ int decode_inst(FILE *out, struct inst *inst)
 		op2 = decode_imm;
 		break;
 	case INST_FMT_RM_ESC:
-		assert(0 && "not implemented");
+		op1 = decode_esc;
+		op2 = decode_rm;
 		break;
 	case INST_FMT_ACC_DX:
 		op1 = decode_acc;
@@ -108,8 +388,12 @@ int decode_inst(FILE *out, struct inst *inst)
 		op1 = decode_imm;
 		break;
 	case INST_FMT_JMP_SHORT:
-		op1 = decode_addr;
-		break;
+		// the only operand naming a label, it takes no other operand
+		addr = get_jmp_offset(inst);
+		assert(addr != -1);
+
+		*p++ = ' ';
+		return put_label(p, addr, labels);
 	case INST_FMT_JMP_NEAR:
 		op1 = decode_naddr;
 		break;
@@ -127,270 +411,146 @@ int decode_inst(FILE *out, struct inst *inst)
 	}
 
 	if (op1) {
-		fputc(' ', out);
-		op1(out, inst);
+		*p++ = ' ';
+		p = op1(p, inst);
 	}
 
 	if (op2) {
-		fprintf(out, ", ");
-		op2(out, inst);
+		p = fmt_str(p, ", ", 2);
+		p = op2(p, inst);
 	}
 
-	return 0;
+	return p;
 }
 
-const char *gen_name(enum inst_type type)
+char *put_name(char *p, const struct name *name)
 {
-	switch(type) {
-		case INST_AAA:    return "aaa";
-		case INST_AAD:    return "aad";
-		case INST_AAM:    return "aam";
-		case INST_AAS:    return "aas";
-		case INST_ADC:    return "adc";
-		case INST_ADD:    return "add";
-		case INST_AND:    return "and";
-		case INST_CALL:   return "call";
-		case INST_CALLF:  return "callf";
-		case INST_CBW:    return "cbw";
-		case INST_CLC:    return "clc";
-		case INST_CLD:    return "cld";
-		case INST_CLI:    return "cli";
-		case INST_CMC:    return "cmc";
-		case INST_CMP:    return "cmp";
-		case INST_CMPSB:  return "cmpsb";
-		case INST_CMPSW:  return "cmpsw";
-		case INST_CWD:    return "cwd";
-		case INST_DAA:    return "daa";
-		case INST_DAS:    return "das";
-		case INST_DEC:    return "dec";
-		case INST_DIV:    return "div";
-		case INST_ESC:    return "esc";
-		case INST_HLT:    return "hlt";
-		case INST_IDIV:   return "idiv";
-		case INST_IMUL:   return "imul";
-		case INST_IN:     return "in";
-		case INST_INC:    return "inc";
-		case INST_INT:    return "int";
-		case INST_INT3:   return "int3";
-		case INST_INTO:   return "into";
-		case INST_IRET:   return "iret";
-		case INST_JA:     return "ja";
-		case INST_JAE:    return "jae";
-		case INST_JB:     return "jb";
-		case INST_JBE:    return "jbe";
-		case INST_JCXZ:   return "jcxz";
-		case INST_JE:     return "je";
-		case INST_JG:     return "jg";
-		case INST_JGE:    return "jge";
-		case INST_JL:     return "jl";
-		case INST_JLE:    return "jle";
-		case INST_JMP:    return "jmp";
-		case INST_JMPF:   return "jmpf";
-		case INST_JNE:    return "jne";
-		case INST_JNO:    return "jno";
-		case INST_JNS:    return "jns";
-		case INST_JO:     return "jo";
-		case INST_JP:     return "jp";
-		case INST_JPO:    return "jpo";
-		case INST_JS:     return "js";
-		case INST_LAHF:   return "lahf";
-		case INST_LDS:    return "lds";
-		case INST_LEA:    return "lea";
-		case INST_LES:    return "les";
-		case INST_LOCK:   return "lock";
-		case INST_LODSB:  return "lodsb";
-		case INST_LODSW:  return "lodsw";
-		case INST_LOOP:   return "loop";
-		case INST_LOOPZ:  return "loopz";
-		case INST_LOOPNZ: return "loopnz";
-		case INST_MOV:    return "mov";
-		case INST_MOVSB:  return "movsb";
-		case INST_MOVSW:  return "movsw";
-		case INST_MUL:    return "mul";
-		case INST_NEG:    return "neg";
-		case INST_NOP:    return "nop";
-		case INST_NOT:    return "not";
-		case INST_OR:     return "or";
-		case INST_OUT:    return "out";
-		case INST_POP:    return "pop";
-		case INST_POPF:   return "popf";
-		case INST_PUSH:   return "push";
-		case INST_PUSHF:  return "pushf";
-		case INST_RCL:    return "rcl";
-		case INST_RCR:    return "rcr";
-		case INST_REP:    return "rep";
-		case INST_REPNE:  return "repne";
-		case INST_RET:    return "ret";
-		case INST_RETF:   return "retf";
-		case INST_ROL:    return "rol";
-		case INST_ROR:    return "ror";
-		case INST_SAHF:   return "sahf";
-		case INST_SAR:    return "sar";
-		case INST_SBB:    return "sbb";
-		case INST_SCASB:  return "scasb";
-		case INST_SCASW:  return "scasw";
-		case INST_SGMNT:  return "";
-		case INST_SHL:    return "shl";
-		case INST_SHR:    return "shr";
-		case INST_STC:    return "stc";
-		case INST_STD:    return "std";
-		case INST_STOSB:  return "stosb";
-		case INST_STOSW:  return "stosw";
-		case INST_STI:    return "sti";
-		case INST_SUB:    return "sub";
-		case INST_TEST:   return "test";
-		case INST_WAIT:   return "wait";
-		case INST_XCHG:   return "xchg";
-		case INST_XLAT:   return "xlat";
-		case INST_XOR:    return "xor";
-
-		case INST_UNK:
-			return "<invalid>";
-		case INST_EXTD:
-			assert(0 && "INST_EXTD encountered");
-	}
-
-	return "<unknown>";
+	return fmt_str(p, name->str, name->len);
 }
 
-void decode_rm(FILE *out, struct inst *inst)
+char *decode_rm(char *p, struct inst *inst)
 {
-	int   len;
-	char  ea_str[64];
-	char *op;
-
 	uint8  w, mod, r_m;
 
 	int16 disp = *((int16 *)&inst->disp);
 
-	static char *ea_base[8] =
-	{
-		"bx + si",
-		"bx + di",
-		"bp + si",
-		"bp + di",
-		"si",
-		"di",
-		"bp",
-		"bx",
-	};
-
 	w   = W(inst->base.flags);
 	mod = FIELD_MOD(inst->fields);
 	r_m = FIELD_RM(inst->fields);
 
-	op = regs[w][r_m];
-
-	if (mod != MODE_REG) {
-		if (mod == MODE_MEM0 && r_m == 0b110) {
-			len = snprintf(ea_str, sizeof(ea_str), "[%u]",
-			               disp & 0xFFFF);
-		} else {
-			// [ ea_base + d8 ]
-			if (mod == MODE_MEM8) {
-				// only low byte
-				disp &= 0x00FF;
-				// if sign bit is set then sign-extend
-				if (disp & 0x80) disp |= 0xFF00;
-
-			// [ ea_base ]
-			} else if (mod == MODE_MEM0) {
-				// no displacement
-				disp = 0;
-			}
-
-			len = snprintf(ea_str, sizeof(ea_str), "[%s",
-			               ea_base[r_m]);
-			if (disp != 0) {
-				len += snprintf(ea_str + len,
-				                sizeof(ea_str) - len, " %c %d",
-				                (disp < 0) ? '-' : '+',
-				                abs(disp));
-			}
-
-			len += snprintf(ea_str + len, sizeof(ea_str) - len,
-			                "]");
-		}
+	if (mod == MODE_REG) return put_name(p, &regs[w][r_m]);
 
-		op = ea_str;
+	if (inst->base.prefixes & PFX_WIDE) {
+		p = w ? fmt_str(p, "word ", 5) : fmt_str(p, "byte ", 5);
+	}
 
-		if (inst->base.prefixes & PFX_WIDE) {
-			fprintf(out, "%s ", w ? "word" : "byte");
-		}
+	if (inst->base.prefixes & PFX_SGMNT) {
+		p = put_name(p, &segregs[SGMNT_OP(inst->base.prefixes)]);
+		*p++ = ':';
+	}
 
-		if (inst->base.prefixes & PFX_SGMNT) {
-			fprintf(out, "%s:", segregs[SGMNT_OP(inst->base.prefixes)]);
-		}
+	if (mod == MODE_MEM0 && r_m == 0b110) {
+		*p++ = '[';
+		p = fmt_uint(p, disp & 0xFFFF);
+		*p++ = ']';
+		return p;
+	}
+
+	// [ ea_base + d8 ]
+	if (mod == MODE_MEM8) {
+		// only low byte
+		disp &= 0x00FF;
+		// if sign bit is set then sign-extend
+		if (disp & 0x80) disp |= 0xFF00;
+
+	// [ ea_base ]
+	} else if (mod == MODE_MEM0) {
+		// no displacement
+		disp = 0;
 	}
 
-	fprintf(out, "%s", op);
+	p = put_name(p, &ea_base[r_m]);
+	if (disp != 0) {
+		p = fmt_str(p, (disp < 0) ? " - " : " + ", 3);
+		p = fmt_uint(p, abs(disp));
+	}
+
+	*p++ = ']';
+
+	return p;
 }
 
-void decode_reg(FILE *out, struct inst *inst)
+char *decode_reg(char *p, struct inst *inst)
 {
 	uint8 w, reg;
 
 	w   = W(inst->base.flags);
 	reg = FIELD_REG(inst->fields);
 
-	fprintf(out, "%s", regs[w][reg]);
+	return put_name(p, &regs[w][reg]);
 }
 
-void decode_sr(FILE *out, struct inst *inst)
+char *decode_sr(char *p, struct inst *inst)
 {
-	fprintf(out, "%s", segregs[SR_OP(inst->base.flags)]);
+	return put_name(p, &segregs[SR_OP(inst->base.flags)]);
 }
 
-void decode_v(FILE *out, struct inst *inst)
+char *decode_v(char *p, struct inst *inst)
 {
-	fprintf(out, "%s", (inst->base.flags & F_V) ? "cl" : "1");
+	if (inst->base.flags & F_V) return fmt_str(p, "cl", 2);
+
+	*p++ = '1';
+	return p;
 }
 
-void decode_imm(FILE *out, struct inst *inst)
+char *decode_esc(char *p, struct inst *inst)
 {
-	int16 imm = *((int16 *)&inst->data);
-	fprintf(out, "%d", imm);
+	return fmt_uint(p, FIELD_ESC(inst->fields));
 }
 
-void decode_acc(FILE *out, struct inst *inst)
+char *decode_imm(char *p, struct inst *inst)
 {
-	fprintf(out, "%s", regs[W(inst->base.flags)][0]);
+	int16 imm = *((int16 *)&inst->data);
+	return fmt_int(p, imm);
 }
 
-void decode_dx(FILE *out, struct inst *inst)
+char *decode_acc(char *p, struct inst *inst)
 {
-	(void)inst;
-	fprintf(out, "dx");
+	return put_name(p, &regs[W(inst->base.flags)][0]);
 }
 
-void decode_imm8(FILE *out, struct inst *inst)
+char *decode_dx(char *p, struct inst *inst)
 {
-	fprintf(out, "%u", inst->data & 0xFF);
+	(void)inst;
+	return fmt_str(p, "dx", 2);
 }
 
-void decode_mem(FILE *out, struct inst *inst)
+char *decode_imm8(char *p, struct inst *inst)
 {
-	fprintf(out, "[%u]", inst->data & 0xFFFF);
+	return fmt_uint(p, inst->data & 0xFF);
 }
 
-void decode_addr(FILE *out, struct inst *inst)
+char *decode_mem(char *p, struct inst *inst)
 {
-	int addr = get_jmp_offset(inst);
-	assert(addr != -1);
+	*p++ = '[';
+	p = fmt_uint(p, inst->data & 0xFFFF);
+	*p++ = ']';
 
-	fprintf(out, "label_%d", addr);
+	return p;
 }
 
-void decode_naddr(FILE *out, struct inst *inst)
+char *decode_naddr(char *p, struct inst *inst)
 {
-	int16_t addr = get_jmp_offset(inst);
+	int64 addr = get_jmp_offset(inst);
 	assert(addr != -1);
 
-	fprintf(out, "%d", addr);
+	// printed as a 16-bit signed value
+	return fmt_int(p, (int16)addr);
 }
 
-void decode_faddr(FILE *out, struct inst *inst)
+char *decode_faddr(char *p, struct inst *inst)
 {
-	fprintf(out, "%u:%u", inst->data_ext, inst->data);
+	p = fmt_uint(p, inst->data_ext);
+	*p++ = ':';
+	return fmt_uint(p, inst->data);
 }
-
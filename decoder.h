@@ -1,13 +1,88 @@
 #if !defined DECODER_H
 #define DECODER_H
 
-#include <stdio.h>
+#include <stdbool.h>
 
 #include "common.h"
 #include "inst.h"
+#include "labels.h"
+#include "outbuf.h"
 
-// Decodes an instruction and writes string representation into out file.
-// Returns 0 on success and non-zero value if an error occurred.
-extern int decode_inst(FILE *out, struct inst *inst);
+// Upper bound of text length produced for a single instruction (label line
+// included).
+#define DECODE_TEXT_MAX 128
+
+#define DECODE_MEMO_BITS 12
+#define DECODE_MEMO_SIZE (1 << DECODE_MEMO_BITS)
+
+struct decode_memo_entry
+{
+	uint64 key;
+	uint8  len;
+	char   text[55];
+};
+
+// Direct-mapped cache of formatted instruction text keyed by raw instruction
+// bytes and prefix state
+struct decode_memo
+{
+	struct decode_memo_entry *entries;
+
+	uint64 hits;
+	uint64 misses;
+	uint64 bypassed; // instructions that can't be memoized (jmp targets)
+};
+
+// Decodes an instruction and appends string representation to 'out'. Labels
+// are named label_<ordinal> after their position in 'labels', or
+// label_<offset> if 'labels' is NULL. Returns 0 on success and non-zero value
+// if an error occurred.
+extern int decode_inst(struct outbuf *out, struct inst *inst,
+                       const struct label_index *labels);
+
+// Writes string representation of an instruction into 'p', which must have
+// room for DECODE_TEXT_MAX bytes. Labels are named as in decode_inst().
+// Returns pointer past the last written byte.
+extern char *decode_inst_text(char *p, struct inst *inst,
+                              const struct label_index *labels);
+
+// Prefixes share the line with the next instruction
+static inline bool decode_joins_next(const struct inst *inst)
+{
+	switch (inst->base.type) {
+	case INST_SGMNT:
+	case INST_LOCK:
+	case INST_REP:
+	case INST_REPNE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Writes what follows instruction text: nothing after a segment override,
+// space after lock and rep prefixes and newline otherwise. Returns pointer
+// past the last written byte.
+static inline char *decode_inst_end(char *p, const struct inst *inst)
+{
+	if (!decode_joins_next(inst)) {
+		*p++ = '\n';
+	} else if (inst->base.type != INST_SGMNT) {
+		*p++ = ' ';
+	}
+
+	return p;
+}
+
+// Returns 0 on success and negative value if allocation failed.
+extern int  decode_memo_init(struct decode_memo *memo);
+extern void decode_memo_free(struct decode_memo *memo);
+
+// Same as decode_inst(), but reuses text of previously formatted instruction
+// with the same bytes and prefixes. 'raw' points to the instruction bytes in
+// the image, NULL disables lookup.
+extern int decode_inst_memo(struct outbuf *out, struct decode_memo *memo,
+                            struct inst *inst, const uint8 *raw,
+                            const struct label_index *labels);
 
 #endif /* DECODER_H */
@@ -0,0 +1,202 @@
+#include <string.h>
+
+#include "encoder.h"
+#include "inst.h"
+
+// aam and aad carry the base in the second byte, nasm always emits 10
+#define ASCII_ADJUST_BASE 0x0A
+
+struct layout
+{
+	uint8          modrm;
+	enum field_src sr;
+	enum field_src reg;
+	enum data_kind data;
+};
+
+#define FMT_LAYOUT(name, modrm, sr, reg, data) \
+	[INST_FMT_##name] = { modrm, sr, reg, data },
+
+static const struct layout layouts[INST_FMT_JMP_FAR + 1] =
+{
+	INST_FORMATS(FMT_LAYOUT)
+};
+
+// reg field value meaning the opcode isn't extended
+#define REG_NONE 0xFF
+
+static void add_candidate(struct inst_encoder *enc, uint16 *count,
+                          enum inst_type type, uint8 op, uint8 reg);
+
+// Writes instruction with opcode 'op' and operand fields of 'inst'. Returns
+// its size.
+static int encode_with(const struct inst *inst, uint8 op, uint8 reg,
+                       uint8 *buf);
+
+// Compares everything decoding produces from instruction bytes, i.e.
+// ignores offset, label flag and prefixes of preceding instructions.
+static int same_inst(const struct inst *a, const struct inst *b);
+
+void inst_encoder_init(struct inst_encoder *enc)
+{
+	uint op, reg, row = 0;
+	uint16 count = 0;
+
+	memset(enc, 0, sizeof(*enc));
+
+	// lists are built in reverse, so walk opcodes backwards to keep
+	// canonical (lowest) opcodes first
+	for (op = 256; op-- > 0;) {
+		if (inst_table[op].type != INST_EXTD) {
+			add_candidate(enc, &count, inst_table[op].type, op,
+			              REG_NONE);
+		}
+	}
+
+	for (op = 256, row = 17; op-- > 0;) {
+		if (inst_table[op].type != INST_EXTD) continue;
+
+		--row;
+		for (reg = 8; reg-- > 0;) {
+			add_candidate(enc, &count,
+			              inst_table_extd[row][reg].type, op, reg);
+		}
+	}
+}
+
+void add_candidate(struct inst_encoder *enc, uint16 *count,
+                   enum inst_type type, uint8 op, uint8 reg)
+{
+	uint16 id;
+
+	if (type == INST_UNK || type == INST_EXTD) return;
+
+	// index 0 terminates lists
+	id = ++*count;
+
+	enc->cands[id].op   = op;
+	enc->cands[id].reg  = reg;
+	enc->cands[id].next = enc->head[type];
+	enc->head[type]     = id;
+}
+
+int inst_encode(const struct inst_encoder *enc, const struct inst *inst,
+                uint8 *buf)
+{
+	int size;
+	uint16 id;
+	struct inst check;
+
+	if (inst->base.type >= INST_EXTD ||
+	    inst->base.fmt > INST_FMT_JMP_FAR) {
+		return -1;
+	}
+
+	// opcodes carry reg and sr fields, so the right one is found by
+	// decoding every candidate back
+	for (id = enc->head[inst->base.type]; id; id = enc->cands[id].next) {
+		size = encode_with(inst, enc->cands[id].op,
+		                   enc->cands[id].reg, buf);
+
+		if (inst_decode(&check, buf, size, 0) == 0 &&
+		    check.base.size == size && same_inst(&check, inst)) {
+			return size;
+		}
+	}
+
+	return -1;
+}
+
+enum encode_match inst_verify(const struct inst_encoder *enc,
+                              const struct inst *inst, const uint8 *raw)
+{
+	int size;
+	uint8 buf[INST_MAX_SIZE];
+	struct inst orig;
+
+	size = inst_encode(enc, inst, buf);
+	if (size < 0 || size != inst->base.size) return ENCODE_MISMATCH;
+
+	if (memcmp(buf, raw, size) == 0) return ENCODE_EXACT;
+
+	// e.g. 0x82 is an undocumented copy of 0x80
+	if (inst_decode(&orig, raw, size, 0) == 0 && same_inst(&orig, inst)) {
+		return ENCODE_ALIAS;
+	}
+
+	return ENCODE_MISMATCH;
+}
+
+int encode_with(const struct inst *inst, uint8 op, uint8 reg, uint8 *buf)
+{
+	int len = 0;
+	uint8 mod, rm;
+	const struct layout *layout = &layouts[inst->base.fmt];
+
+	buf[len++] = op;
+
+	if (layout->modrm) {
+		mod = FIELD_MOD(inst->fields);
+		rm  = FIELD_RM(inst->fields);
+
+		if (reg == REG_NONE) {
+			reg = 0;
+			if (layout->reg == FLD_MODRM) reg = FIELD_REG(inst->fields);
+			if (layout->sr  == FLD_MODRM) reg = FIELD_SR(inst->fields);
+		}
+
+		buf[len++] = (mod << 6) | (reg << 3) | rm;
+
+		if (mod == MODE_MEM8) {
+			buf[len++] = inst->disp & 0xFF;
+		} else if (mod == MODE_MEM16 || (mod == MODE_MEM0 && rm == 0b110)) {
+			buf[len++] = inst->disp & 0xFF;
+			buf[len++] = inst->disp >> 8;
+		}
+	}
+
+	switch (layout->data) {
+	case DATA_IMM:
+		buf[len++] = inst->data & 0xFF;
+		if (!(inst->base.flags & F_S) && (inst->base.flags & F_W)) {
+			buf[len++] = inst->data >> 8;
+		}
+		break;
+	case DATA_BYTE:
+		buf[len++] = inst->data & 0xFF;
+		break;
+	case DATA_WORD:
+		buf[len++] = inst->data & 0xFF;
+		buf[len++] = inst->data >> 8;
+		break;
+	case DATA_FAR:
+		buf[len++] = inst->data & 0xFF;
+		buf[len++] = inst->data >> 8;
+		buf[len++] = inst->data_ext & 0xFF;
+		buf[len++] = inst->data_ext >> 8;
+		break;
+	case DATA_NONE:
+		break;
+	}
+
+	while (len < inst->base.size && len < INST_MAX_SIZE) {
+		buf[len++] = ASCII_ADJUST_BASE;
+	}
+
+	return len;
+}
+
+int same_inst(const struct inst *a, const struct inst *b)
+{
+	uint8 table_pfx = PFX_WIDE | PFX_FAR;
+
+	return a->base.type == b->base.type &&
+	       a->base.fmt  == b->base.fmt &&
+	       (a->base.flags & ~F_LB) == (b->base.flags & ~F_LB) &&
+	       (a->base.prefixes & table_pfx) ==
+	       (b->base.prefixes & table_pfx) &&
+	       a->fields   == b->fields &&
+	       a->disp     == b->disp &&
+	       a->data     == b->data &&
+	       a->data_ext == b->data_ext;
+}
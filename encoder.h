@@ -0,0 +1,45 @@
+#if !defined ENCODER_H
+#define ENCODER_H
+
+#include "common.h"
+#include "inst.h"
+
+// opcodes and extended opcode rows
+#define ENCODER_CANDIDATES (256 + 17 * 8)
+
+// Reverse index of inst_table and inst_table_extd: opcodes (with reg field
+// for extended ones) grouped by instruction type.
+struct inst_encoder
+{
+	struct
+	{
+		uint8  op;
+		uint8  reg;
+		uint16 next; // next candidate of the same type, 0 ends the list
+	} cands[ENCODER_CANDIDATES + 1];
+
+	uint16 head[INST_EXTD + 1];
+};
+
+// Result of comparing re-encoded instruction with original bytes
+enum encode_match
+{
+	ENCODE_EXACT,    // same bytes
+	ENCODE_ALIAS,    // different bytes that decode to the same instruction
+	ENCODE_MISMATCH, // can't be encoded back
+};
+
+extern void inst_encoder_init(struct inst_encoder *enc);
+
+// Encodes 'inst' into 'buf' (INST_MAX_SIZE bytes at least). Prefixes are
+// separate instructions and aren't encoded. Returns instruction size on
+// success and negative value if no opcode produces the same instruction.
+extern int inst_encode(const struct inst_encoder *enc, const struct inst *inst,
+                       uint8 *buf);
+
+// Re-encodes 'inst' and compares it with 'raw', its original bytes.
+extern enum encode_match inst_verify(const struct inst_encoder *enc,
+                                     const struct inst *inst,
+                                     const uint8 *raw);
+
+#endif /* ENCODER_H */
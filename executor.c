@@ -1,11 +1,50 @@
 #include <assert.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "executor.h"
+#include "flags.h"
 #include "inst.h"
+#include "profile.h"
 
-static void execute_mov(struct cpu_state *state, struct inst *inst);
+static int execute_mov(struct cpu_state *state, struct inst *inst);
+static int execute_alu(struct cpu_state *state, struct inst *inst);
+static int execute_flags(struct cpu_state *state, struct inst *inst);
+static int execute_xchg(struct cpu_state *state, struct inst *inst);
+static int execute_push(struct cpu_state *state, struct inst *inst);
+static int execute_pop(struct cpu_state *state, struct inst *inst);
+static int execute_jmp(struct cpu_state *state, struct inst *inst);
+static int execute_call(struct cpu_state *state, struct inst *inst);
+static int execute_ret(struct cpu_state *state, struct inst *inst);
+
+static inline uint8 *reg8(struct cpu_state *state, uint8 reg)
+{
+	return &state->regs8[reg & 0b11][reg >> 2];
+}
+
+// Linear address of the memory operand of [mod ... r/m] instruction
+static uint32 rm_addr(struct cpu_state *state, struct inst *inst);
+
+static uint16 read_mem(struct cpu_state *state, uint32 addr, bool wide);
+static void   write_mem(struct cpu_state *state, uint32 addr, bool wide,
+                        uint16 value);
+
+// Invalidates cached code of the page 'addr' belongs to, if there is any
+static void   track_write(struct cpu_state *state, uint32 addr);
+
+// r/m operand access, register or memory depending on mod
+static uint16 read_rm(struct cpu_state *state, struct inst *inst, bool wide);
+static void   write_rm(struct cpu_state *state, struct inst *inst, bool wide,
+                       uint16 value);
+
+static uint16 read_reg(struct cpu_state *state, uint8 reg, bool wide);
+static void   write_reg(struct cpu_state *state, uint8 reg, bool wide,
+                        uint16 value);
+
+static void   push(struct cpu_state *state, uint16 value);
+static uint16 pop(struct cpu_state *state);
 
 int executor_init_state(struct cpu_state *state)
 {
@@ -16,101 +55,501 @@ int executor_init_state(struct cpu_state *state)
 
 	memset(state, 0, sizeof(*state));
 
+	state->memory = calloc(MEMORY_SIZE, 1);
+	if (!state->memory) {
+		fprintf(stderr, "failed to allocate memory\n");
+		return -1;
+	}
+
 	return 0;
 }
 
+void executor_free_state(struct cpu_state *state)
+{
+	free(state->memory);
+	state->memory = NULL;
+}
+
 int executor_exec(struct cpu_state *state, struct inst *inst)
 {
+	int rc = 0;
+
 	if (!state || !inst) {
 		fprintf(stderr, "invalid arguments (state: %p, inst: %p)\n",
 		        state, inst);
 		return -1;
 	}
 
+	PROF_BEGIN(exec, "executor_exec");
+
 	switch (inst->base.type) {
 	case INST_MOV:
-		execute_mov(state, inst); break;
+		rc = execute_mov(state, inst); break;
+	case INST_ADD:
+	case INST_ADC:
+	case INST_SUB:
+	case INST_SBB:
+	case INST_CMP:
+	case INST_AND:
+	case INST_OR:
+	case INST_XOR:
+	case INST_TEST:
+	case INST_INC:
+	case INST_DEC:
+	case INST_NEG:
+		rc = execute_alu(state, inst); break;
+	case INST_CLC:
+	case INST_STC:
+	case INST_CMC:
+	case INST_CLD:
+	case INST_STD:
+	case INST_CLI:
+	case INST_STI:
+	case INST_PUSHF:
+	case INST_POPF:
+	case INST_LAHF:
+	case INST_SAHF:
+		rc = execute_flags(state, inst); break;
+	case INST_XCHG:
+		rc = execute_xchg(state, inst); break;
+	case INST_PUSH:
+		rc = execute_push(state, inst); break;
+	case INST_POP:
+		rc = execute_pop(state, inst); break;
+	case INST_JA ... INST_JS:
+	case INST_LOOP:
+	case INST_LOOPZ:
+	case INST_LOOPNZ:
+		rc = execute_jmp(state, inst); break;
+	case INST_CALL:
+		rc = execute_call(state, inst); break;
+	case INST_RET:
+	case INST_RETF:
+		rc = execute_ret(state, inst); break;
+	case INST_NOP:
+		break;
+	case INST_HLT:
+		rc = EXEC_HALT; break;
 	default:
-		assert(0 && "");
+		rc = EXEC_UNSUPPORTED; break;
 	}
 
-	return 0;
+	PROF_END(exec);
+
+	return rc;
 }
 
-void execute_mov(struct cpu_state *state, struct inst *inst)
+int execute_mov(struct cpu_state *state, struct inst *inst)
 {
-	uint8   mod, rm, reg, sr;
-	uint16 *reg_reg16 = NULL, *rm_reg16 = NULL;
-	uint8  *reg_reg8  = NULL, *rm_reg8  = NULL;
-	uint16 *sr_reg    = NULL;
-	void   *dest      = NULL, *src = NULL;
-
-	mod = FIELD_MOD(inst->fields);
-	rm  = FIELD_RM(inst->fields);
-	reg = FIELD_REG(inst->fields);
-	sr  = FIELD_SR(inst->fields);
-
-	rm_reg8   = &state->regs8[rm  & 0b11][rm  >> 2];
-	reg_reg8  = &state->regs8[reg & 0b11][reg >> 2];
-
-	rm_reg16  = &state->regs16[rm];
-	reg_reg16 = &state->regs16[reg];
-
-	sr_reg    = &state->segregs[sr];
+	uint32 addr;
+	uint16 seg;
+	uint8 reg  = FIELD_REG(inst->fields);
+	uint8 sr   = FIELD_SR(inst->fields);
+	bool  wide = inst->base.flags & F_W;
 
 	switch (inst->base.fmt) {
 	case INST_FMT_RM_REG:
-		if (mod != MODE_REG)
-			assert(0 && "not implemented");
+		if (inst->base.flags & F_D) {
+			write_reg(state, reg, wide, read_rm(state, inst, wide));
+		} else {
+			write_rm(state, inst, wide, read_reg(state, reg, wide));
+		}
 
-		if (inst->base.flags & F_W) {
-			dest = rm_reg16; src = reg_reg16;
-			if (inst->base.flags & F_D) {
-				dest = reg_reg16; src = rm_reg16;
-			}
+		break;
+	case INST_FMT_ACC_MEM:
+		seg = state->ds;
+		if (inst->base.prefixes & PFX_SGMNT) {
+			seg = state->segregs[SGMNT_OP(inst->base.prefixes)];
+		}
 
-			*((uint16 *)dest) = *((uint16 *)src);
+		// direction is reversed: d means accumulator is the source
+		addr = linear_addr(seg, inst->data);
+		if (inst->base.flags & F_D) {
+			write_mem(state, addr, wide, read_reg(state, 0, wide));
 		} else {
-			dest = rm_reg8; src = reg_reg8;
-			if (inst->base.flags & F_D) {
-				dest = reg_reg8; src = rm_reg8;
-			}
-
-			*((uint8 *)dest) = *((uint8 *)src);
+			write_reg(state, 0, wide, read_mem(state, addr, wide));
 		}
 
 		break;
-		
-	case INST_FMT_ACC_MEM:
 	case INST_FMT_REG_IMM:
-		if (inst->base.flags & F_W) {
-			*reg_reg16 = inst->data;
+		write_reg(state, reg, wide, inst->data);
+		break;
+	case INST_FMT_RM_IMM:
+		write_rm(state, inst, wide, inst->data);
+		break;
+	case INST_FMT_RM_SR:
+		if (inst->base.flags & F_D) {
+			state->segregs[sr] = read_rm(state, inst, true);
 		} else {
-			*reg_reg8  = inst->data & 0xFF;
+			write_rm(state, inst, true, state->segregs[sr]);
 		}
 
 		break;
-	case INST_FMT_RM_SR:
-		if (mod != MODE_REG)
-			assert(0 && "not implemented");
+	default:
+		return EXEC_UNSUPPORTED;
+	}
 
+	return 0;
+}
+
+int execute_alu(struct cpu_state *state, struct inst *inst)
+{
+	uint16 res;
+	uint8 reg = FIELD_REG(inst->fields);
+	bool wide = inst->base.flags & F_W;
+	bool keep = inst->base.type != INST_CMP && inst->base.type != INST_TEST;
+	enum inst_type type = inst->base.type;
+
+	switch (inst->base.fmt) {
+	case INST_FMT_RM_REG:
 		if (inst->base.flags & F_D) {
-			*sr_reg = *rm_reg16;
+			res = flags_alu(state, type, wide,
+			                read_reg(state, reg, wide),
+			                read_rm(state, inst, wide));
+			if (keep) write_reg(state, reg, wide, res);
 		} else {
-			*rm_reg16 = *sr_reg;
+			res = flags_alu(state, type, wide,
+			                read_rm(state, inst, wide),
+			                read_reg(state, reg, wide));
+			if (keep) write_rm(state, inst, wide, res);
 		}
 
 		break;
 	case INST_FMT_RM_IMM:
-		if (mod != MODE_REG)
-			assert(0 && "not implemented");
+		res = flags_alu(state, type, wide, read_rm(state, inst, wide),
+		                inst->data);
+		if (keep) write_rm(state, inst, wide, res);
+		break;
+	case INST_FMT_ACC_IMM:
+		res = flags_alu(state, type, wide, read_reg(state, 0, wide),
+		                inst->data);
+		if (keep) write_reg(state, 0, wide, res);
+		break;
+	case INST_FMT_REG:
+		state->regs16[reg] = flags_alu(state, type, true,
+		                               state->regs16[reg], 0);
+		break;
+	case INST_FMT_RM:
+		res = flags_alu(state, type, wide, read_rm(state, inst, wide),
+		                0);
+		write_rm(state, inst, wide, res);
+		break;
+	default:
+		return EXEC_UNSUPPORTED;
+	}
+
+	return 0;
+}
+
+int execute_flags(struct cpu_state *state, struct inst *inst)
+{
+	uint16 flags;
 
-		if (inst->base.flags & F_W) {
-			*rm_reg16 = inst->data;
+	switch (inst->base.type) {
+	case INST_CLC:
+		flags_put(state, flags_get(state) & ~FLAG_CF); break;
+	case INST_STC:
+		flags_put(state, flags_get(state) | FLAG_CF); break;
+	case INST_CMC:
+		flags_put(state, flags_get(state) ^ FLAG_CF); break;
+	// control flags aren't computed lazily
+	case INST_CLD:
+		state->flags &= ~FLAG_DF; break;
+	case INST_STD:
+		state->flags |= FLAG_DF; break;
+	case INST_CLI:
+		state->flags &= ~FLAG_IF; break;
+	case INST_STI:
+		state->flags |= FLAG_IF; break;
+	case INST_PUSHF:
+		push(state, flags_get(state) | FLAGS_FIXED); break;
+	case INST_POPF:
+		flags_put(state, pop(state)); break;
+	case INST_LAHF:
+		*reg8(state, 4) = (flags_get(state) | FLAGS_FIXED) & 0xFF;
+		break;
+	case INST_SAHF:
+		flags = flags_get(state) & 0xFF00;
+		flags_put(state, flags | *reg8(state, 4));
+		break;
+	default:
+		return EXEC_UNSUPPORTED;
+	}
+
+	return 0;
+}
+
+int execute_xchg(struct cpu_state *state, struct inst *inst)
+{
+	uint16 tmp;
+	uint8 reg = FIELD_REG(inst->fields);
+	bool wide = inst->base.flags & F_W;
+
+	switch (inst->base.fmt) {
+	case INST_FMT_RM_REG:
+		tmp = read_rm(state, inst, wide);
+		write_rm(state, inst, wide, read_reg(state, reg, wide));
+		write_reg(state, reg, wide, tmp);
+		break;
+	case INST_FMT_ACC_REG:
+		tmp = state->ax;
+		state->ax = state->regs16[reg];
+		state->regs16[reg] = tmp;
+		break;
+	default:
+		return EXEC_UNSUPPORTED;
+	}
+
+	return 0;
+}
+
+int execute_push(struct cpu_state *state, struct inst *inst)
+{
+	switch (inst->base.fmt) {
+	case INST_FMT_REG:
+		// 8086 pushes sp value after decrement
+		if (FIELD_REG(inst->fields) == 4) {
+			push(state, state->sp - 2);
 		} else {
-			*rm_reg8  = inst->data & 0xFF;
+			push(state, state->regs16[FIELD_REG(inst->fields)]);
 		}
+		break;
+	case INST_FMT_SR:
+		push(state, state->segregs[FIELD_SR(inst->fields)]);
+		break;
+	case INST_FMT_RM:
+		push(state, read_rm(state, inst, true));
+		break;
 	default:
+		return EXEC_UNSUPPORTED;
+	}
+
+	return 0;
+}
+
+int execute_pop(struct cpu_state *state, struct inst *inst)
+{
+	switch (inst->base.fmt) {
+	case INST_FMT_REG:
+		state->regs16[FIELD_REG(inst->fields)] = pop(state);
+		break;
+	case INST_FMT_SR:
+		state->segregs[FIELD_SR(inst->fields)] = pop(state);
+		break;
+	case INST_FMT_RM:
+		write_rm(state, inst, true, pop(state));
 		break;
+	default:
+		return EXEC_UNSUPPORTED;
+	}
+
+	return 0;
+}
+
+int execute_jmp(struct cpu_state *state, struct inst *inst)
+{
+	uint32 addr;
+	uint16 ip;
+
+	if (!jmp_taken(state, inst->base.type)) return 0;
+
+	switch (inst->base.fmt) {
+	case INST_FMT_JMP_SHORT:
+		state->ip += (int8)(inst->data & 0xFF);
+		break;
+	case INST_FMT_JMP_NEAR:
+		state->ip += inst->data;
+		break;
+	case INST_FMT_JMP_FAR:
+		state->ip = inst->data;
+		state->cs = inst->data_ext;
+		break;
+	case INST_FMT_RM:
+		if (!(inst->base.prefixes & PFX_FAR)) {
+			state->ip = read_rm(state, inst, true);
+			break;
+		}
+
+		addr = rm_addr(state, inst);
+		ip   = read_mem(state, addr, true);
+		state->cs = read_mem(state, (addr + 2) & MEMORY_MASK, true);
+		state->ip = ip;
+		break;
+	default:
+		return EXEC_UNSUPPORTED;
 	}
+
+	return 0;
+}
+
+int execute_call(struct cpu_state *state, struct inst *inst)
+{
+	uint32 addr;
+	uint16 ip, cs;
+
+	switch (inst->base.fmt) {
+	case INST_FMT_JMP_NEAR:
+		push(state, state->ip);
+		state->ip += inst->data;
+		break;
+	case INST_FMT_JMP_FAR:
+		push(state, state->cs);
+		push(state, state->ip);
+		state->ip = inst->data;
+		state->cs = inst->data_ext;
+		break;
+	case INST_FMT_RM:
+		if (!(inst->base.prefixes & PFX_FAR)) {
+			// target is read before sp changes
+			ip = read_rm(state, inst, true);
+			push(state, state->ip);
+			state->ip = ip;
+			break;
+		}
+
+		addr = rm_addr(state, inst);
+		ip   = read_mem(state, addr, true);
+		cs   = read_mem(state, (addr + 2) & MEMORY_MASK, true);
+
+		push(state, state->cs);
+		push(state, state->ip);
+		state->ip = ip;
+		state->cs = cs;
+		break;
+	default:
+		return EXEC_UNSUPPORTED;
+	}
+
+	return 0;
+}
+
+int execute_ret(struct cpu_state *state, struct inst *inst)
+{
+	state->ip = pop(state);
+	if (inst->base.type == INST_RETF) state->cs = pop(state);
+
+	// ret imm16 releases arguments
+	if (inst->base.fmt == INST_FMT_IMM) state->sp += inst->data;
+
+	return 0;
+}
+
+uint32 rm_addr(struct cpu_state *state, struct inst *inst)
+{
+	uint16 offset, seg;
+	uint8 mod = FIELD_MOD(inst->fields);
+	uint8 rm  = FIELD_RM(inst->fields);
+
+	assert(mod != MODE_REG);
+
+	switch (rm) {
+	case 0b000: offset = state->bx + state->si; break;
+	case 0b001: offset = state->bx + state->di; break;
+	case 0b010: offset = state->bp + state->si; break;
+	case 0b011: offset = state->bp + state->di; break;
+	case 0b100: offset = state->si; break;
+	case 0b101: offset = state->di; break;
+	case 0b110: offset = (mod == MODE_MEM0) ? 0 : state->bp; break;
+	default:    offset = state->bx; break;
+	}
+
+	if (mod == MODE_MEM0 && rm == 0b110) {
+		offset = inst->disp;
+	} else if (mod == MODE_MEM8) {
+		offset += (int8)(inst->disp & 0xFF);
+	} else if (mod == MODE_MEM16) {
+		offset += inst->disp;
+	}
+
+	// bp based addresses are relative to the stack segment
+	seg = state->ds;
+	if (rm == 0b010 || rm == 0b011 || (rm == 0b110 && mod != MODE_MEM0)) {
+		seg = state->ss;
+	}
+
+	if (inst->base.prefixes & PFX_SGMNT) {
+		seg = state->segregs[SGMNT_OP(inst->base.prefixes)];
+	}
+
+	return linear_addr(seg, offset);
+}
+
+uint16 read_mem(struct cpu_state *state, uint32 addr, bool wide)
+{
+	uint16 value = state->memory[addr];
+
+	if (wide) value |= state->memory[(addr + 1) & MEMORY_MASK] << 8;
+
+	return value;
+}
+
+void write_mem(struct cpu_state *state, uint32 addr, bool wide, uint16 value)
+{
+	uint32 next = (addr + 1) & MEMORY_MASK;
+
+	state->memory[addr] = value & 0xFF;
+	if (wide) state->memory[next] = value >> 8;
+
+	if (state->code_pages) {
+		track_write(state, addr);
+		if (wide) track_write(state, next);
+	}
+}
+
+void track_write(struct cpu_state *state, uint32 addr)
+{
+	uint32 page = addr >> CODE_PAGE_BITS;
+
+	if (!state->code_pages[page]) return;
+
+	++state->code_gens[page];
+	state->code_written = true;
+}
+
+uint16 read_rm(struct cpu_state *state, struct inst *inst, bool wide)
+{
+	if (FIELD_MOD(inst->fields) == MODE_REG) {
+		return read_reg(state, FIELD_RM(inst->fields), wide);
+	}
+
+	return read_mem(state, rm_addr(state, inst), wide);
+}
+
+void write_rm(struct cpu_state *state, struct inst *inst, bool wide,
+              uint16 value)
+{
+	if (FIELD_MOD(inst->fields) == MODE_REG) {
+		write_reg(state, FIELD_RM(inst->fields), wide, value);
+	} else {
+		write_mem(state, rm_addr(state, inst), wide, value);
+	}
+}
+
+uint16 read_reg(struct cpu_state *state, uint8 reg, bool wide)
+{
+	return wide ? state->regs16[reg] : *reg8(state, reg);
+}
+
+void write_reg(struct cpu_state *state, uint8 reg, bool wide, uint16 value)
+{
+	if (wide) {
+		state->regs16[reg] = value;
+	} else {
+		*reg8(state, reg) = value & 0xFF;
+	}
+}
+
+void push(struct cpu_state *state, uint16 value)
+{
+	state->sp -= 2;
+	write_mem(state, linear_addr(state->ss, state->sp), true, value);
+}
+
+uint16 pop(struct cpu_state *state)
+{
+	uint16 value = read_mem(state, linear_addr(state->ss, state->sp), true);
+
+	state->sp += 2;
+
+	return value;
 }
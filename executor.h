@@ -1,9 +1,44 @@
 #if !defined EXECUTOR_H
 #define EXECUTOR_H
 
+#include <stdbool.h>
+
 #include "common.h"
 #include "inst.h"
 
+// 20-bit address space
+#define MEMORY_SIZE (1 << 20)
+#define MEMORY_MASK (MEMORY_SIZE - 1)
+
+// granularity of self-modifying code detection
+#define CODE_PAGE_BITS  8
+#define CODE_PAGE_COUNT (MEMORY_SIZE >> CODE_PAGE_BITS)
+
+// executor_exec() results besides 0
+#define EXEC_HALT         1  // hlt executed
+#define EXEC_UNSUPPORTED -2  // instruction isn't implemented
+
+// Operation that last set arithmetic flags, see flags.h
+enum lazy_op
+{
+	LAZY_NONE,  // 'flags' is up to date
+	LAZY_ADD,   // add, adc
+	LAZY_SUB,   // sub, sbb, cmp, neg
+	LAZY_LOGIC, // and, or, xor, test
+	LAZY_INC,   // like add of 1, carry is kept in 'cf'
+	LAZY_DEC,   // like sub of 1, carry is kept in 'cf'
+};
+
+struct lazy_flags
+{
+	uint8  op;   // enum lazy_op
+	bool   wide;
+	bool   cf;   // carry before inc/dec
+	uint16 dst;
+	uint16 src;
+	uint16 res;
+};
+
 union reg
 {
 	struct
@@ -48,9 +83,36 @@ struct cpu_state
 	};
 
 	uint16 ip;
+
+	// arithmetic flags here are stale unless 'lazy.op' is LAZY_NONE, use
+	// flags_get() to read the register
+	uint16            flags;
+	struct lazy_flags lazy;
+
+	uint8 *memory; // MEMORY_SIZE bytes
+
+	// Set by whoever caches decoded code, NULL otherwise. A write into a
+	// page with non-zero 'code_pages' entry bumps its 'code_gens' entry and
+	// sets 'code_written'.
+	uint8  *code_pages;
+	uint16 *code_gens;
+	bool    code_written;
 };
 
-extern int executor_init_state(struct cpu_state *state);
+// Linear address of 'seg':'offset'
+static inline uint32 linear_addr(uint16 seg, uint16 offset)
+{
+	return (((uint32)seg << 4) + offset) & MEMORY_MASK;
+}
+
+// Clears registers and allocates zeroed memory. Returns 0 on success and
+// negative value if error occurred.
+extern int  executor_init_state(struct cpu_state *state);
+extern void executor_free_state(struct cpu_state *state);
+
+// Executes 'inst'. 'ip' must already point to the next instruction, jumps
+// are relative to it. Returns 0 on success, EXEC_HALT after hlt and negative
+// value if instruction can't be executed.
 extern int executor_exec(struct cpu_state *state, struct inst *inst);
 
 #endif /* EXECUTOR_H */
@@ -0,0 +1,28 @@
+#include "flags.h"
+
+uint16 flags_get(struct cpu_state *state)
+{
+	uint16 flags;
+
+	if (state->lazy.op == LAZY_NONE) return state->flags;
+
+	flags = state->flags & ~FLAGS_ARITH;
+
+	if (flag_cf(state)) flags |= FLAG_CF;
+	if (flag_pf(state)) flags |= FLAG_PF;
+	if (flag_af(state)) flags |= FLAG_AF;
+	if (flag_zf(state)) flags |= FLAG_ZF;
+	if (flag_sf(state)) flags |= FLAG_SF;
+	if (flag_of(state)) flags |= FLAG_OF;
+
+	state->flags   = flags;
+	state->lazy.op = LAZY_NONE;
+
+	return flags;
+}
+
+void flags_put(struct cpu_state *state, uint16 flags)
+{
+	state->flags   = flags & FLAGS_ALL;
+	state->lazy.op = LAZY_NONE;
+}
@@ -0,0 +1,235 @@
+#if !defined FLAGS_H
+#define FLAGS_H
+
+#include <assert.h>
+#include <stdbool.h>
+
+#include "common.h"
+#include "executor.h"
+#include "inst.h"
+
+#define FLAG_CF 0x0001
+#define FLAG_PF 0x0004
+#define FLAG_AF 0x0010
+#define FLAG_ZF 0x0040
+#define FLAG_SF 0x0080
+#define FLAG_TF 0x0100
+#define FLAG_IF 0x0200
+#define FLAG_DF 0x0400
+#define FLAG_OF 0x0800
+
+#define FLAGS_ARITH (FLAG_CF | FLAG_PF | FLAG_AF | FLAG_ZF | FLAG_SF | \
+                     FLAG_OF)
+#define FLAGS_ALL   (FLAGS_ARITH | FLAG_TF | FLAG_IF | FLAG_DF)
+// bits 1 and 12-15 always read as set on 8086
+#define FLAGS_FIXED 0xF002
+
+// Arithmetic flags are computed from the last recorded operation only when
+// something reads them. Single flag getters don't touch the state, so a
+// jcc after cmp costs one expression.
+
+static inline uint16 lazy_sign(const struct lazy_flags *lazy)
+{
+	return lazy->wide ? 0x8000 : 0x80;
+}
+
+static inline bool flag_cf(const struct cpu_state *state)
+{
+	const struct lazy_flags *l = &state->lazy;
+
+	switch (l->op) {
+	case LAZY_ADD:
+		// carry out of the top bit
+		return ((l->dst & l->src) | ((l->dst | l->src) & ~l->res)) &
+		       lazy_sign(l);
+	case LAZY_SUB:
+		// borrow into the top bit
+		return ((~l->dst & l->src) | ((~l->dst | l->src) & l->res)) &
+		       lazy_sign(l);
+	case LAZY_LOGIC:
+		return false;
+	case LAZY_INC:
+	case LAZY_DEC:
+		return l->cf;
+	default:
+		return state->flags & FLAG_CF;
+	}
+}
+
+static inline bool flag_zf(const struct cpu_state *state)
+{
+	const struct lazy_flags *l = &state->lazy;
+
+	if (l->op == LAZY_NONE) return state->flags & FLAG_ZF;
+
+	return (l->res & (l->wide ? 0xFFFF : 0xFF)) == 0;
+}
+
+static inline bool flag_sf(const struct cpu_state *state)
+{
+	const struct lazy_flags *l = &state->lazy;
+
+	if (l->op == LAZY_NONE) return state->flags & FLAG_SF;
+
+	return l->res & lazy_sign(l);
+}
+
+static inline bool flag_of(const struct cpu_state *state)
+{
+	const struct lazy_flags *l = &state->lazy;
+
+	switch (l->op) {
+	case LAZY_ADD:
+	case LAZY_INC:
+		// operands of the same sign, result of the other one
+		return (l->dst ^ l->res) & (l->src ^ l->res) & lazy_sign(l);
+	case LAZY_SUB:
+	case LAZY_DEC:
+		return (l->dst ^ l->src) & (l->dst ^ l->res) & lazy_sign(l);
+	case LAZY_LOGIC:
+		return false;
+	default:
+		return state->flags & FLAG_OF;
+	}
+}
+
+static inline bool flag_pf(const struct cpu_state *state)
+{
+	const struct lazy_flags *l = &state->lazy;
+
+	if (l->op == LAZY_NONE) return state->flags & FLAG_PF;
+
+	// set for even number of bits in the low byte
+	return !__builtin_parity(l->res & 0xFF);
+}
+
+static inline bool flag_af(const struct cpu_state *state)
+{
+	const struct lazy_flags *l = &state->lazy;
+
+	switch (l->op) {
+	case LAZY_NONE:
+		return state->flags & FLAG_AF;
+	case LAZY_LOGIC:
+		return false;
+	default:
+		// carry or borrow between the nibbles of the low byte
+		return (l->dst ^ l->src ^ l->res) & 0x10;
+	}
+}
+
+// Records operation, 'res' must be truncated to the operand width
+static inline void flags_record(struct cpu_state *state, enum lazy_op op,
+                                bool wide, uint16 dst, uint16 src,
+                                uint16 res)
+{
+	state->lazy.op   = op;
+	state->lazy.wide = wide;
+	state->lazy.dst  = dst;
+	state->lazy.src  = src;
+	state->lazy.res  = res;
+}
+
+// Computes 'type' (add, adc, sub, sbb, cmp, and, or, xor, test, inc, dec,
+// neg) of 'dst' and 'src' and records it for flags. Returns the result.
+static inline uint16 flags_alu(struct cpu_state *state, enum inst_type type,
+                               bool wide, uint16 dst, uint16 src)
+{
+	uint16 res  = 0;
+	uint16 mask = wide ? 0xFFFF : 0xFF;
+	enum lazy_op op = LAZY_LOGIC;
+
+	dst &= mask;
+	src &= mask;
+
+	switch (type) {
+	case INST_ADD:
+		res = dst + src;
+		op  = LAZY_ADD;
+		break;
+	case INST_ADC:
+		res = dst + src + flag_cf(state);
+		op  = LAZY_ADD;
+		break;
+	case INST_SUB:
+	case INST_CMP:
+		res = dst - src;
+		op  = LAZY_SUB;
+		break;
+	case INST_SBB:
+		res = dst - src - flag_cf(state);
+		op  = LAZY_SUB;
+		break;
+	case INST_AND:
+	case INST_TEST:
+		res = dst & src;
+		break;
+	case INST_OR:
+		res = dst | src;
+		break;
+	case INST_XOR:
+		res = dst ^ src;
+		break;
+	case INST_INC:
+	case INST_DEC:
+		// carry isn't affected
+		state->lazy.cf = flag_cf(state);
+		src = 1;
+		res = (type == INST_INC) ? dst + 1 : dst - 1;
+		op  = (type == INST_INC) ? LAZY_INC : LAZY_DEC;
+		break;
+	case INST_NEG:
+		src = dst;
+		dst = 0;
+		res = -src;
+		op  = LAZY_SUB;
+		break;
+	default:
+		assert(0 && "not an alu instruction");
+	}
+
+	res &= mask;
+	flags_record(state, op, wide, dst, src, res);
+
+	return res;
+}
+
+// Condition of jcc, jcxz and loops, loops decrement cx first. Other jumps
+// are always taken.
+static inline bool jmp_taken(struct cpu_state *state, enum inst_type type)
+{
+	switch (type) {
+	case INST_JO:     return flag_of(state);
+	case INST_JNO:    return !flag_of(state);
+	case INST_JB:     return flag_cf(state);
+	case INST_JAE:    return !flag_cf(state);
+	case INST_JE:     return flag_zf(state);
+	case INST_JNE:    return !flag_zf(state);
+	case INST_JBE:    return flag_cf(state) || flag_zf(state);
+	case INST_JA:     return !flag_cf(state) && !flag_zf(state);
+	case INST_JS:     return flag_sf(state);
+	case INST_JNS:    return !flag_sf(state);
+	case INST_JP:     return flag_pf(state);
+	case INST_JPO:    return !flag_pf(state);
+	case INST_JL:     return flag_sf(state) != flag_of(state);
+	case INST_JGE:    return flag_sf(state) == flag_of(state);
+	case INST_JLE:    return flag_zf(state) ||
+	                         flag_sf(state) != flag_of(state);
+	case INST_JG:     return !flag_zf(state) &&
+	                         flag_sf(state) == flag_of(state);
+	case INST_JCXZ:   return state->cx == 0;
+	case INST_LOOP:   return --state->cx != 0;
+	case INST_LOOPZ:  return --state->cx != 0 && flag_zf(state);
+	case INST_LOOPNZ: return --state->cx != 0 && !flag_zf(state);
+	default:          return true;
+	}
+}
+
+// Returns flags register with arithmetic flags computed. The result is
+// stored back, so later reads are cheap until the next operation.
+extern uint16 flags_get(struct cpu_state *state);
+
+// Replaces flags register, undefined bits are dropped.
+extern void   flags_put(struct cpu_state *state, uint16 flags);
+
+#endif /* FLAGS_H */
@@ -0,0 +1,170 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "decoder.h"
+#include "format.h"
+
+// expected text length of an instruction, buffers grow past it if needed
+#define TEXT_ESTIMATE 24
+// buffers passed to one writev() call, well below IOV_MAX on Linux
+#define IOV_BATCH     64
+
+struct range
+{
+	char  *text;
+	size_t len;
+	int    err;
+};
+
+struct format
+{
+	struct inst  *insts;
+	uint64        count;
+	struct range *ranges;
+	uint          range_count;
+};
+
+static void format_range(void *ctx, uint task);
+
+// Writes buffers of all ranges in order. Returns 0 on success and negative
+// value if write failed.
+static int write_ranges(int fd, struct range *ranges, uint range_count);
+
+int inst_format_parallel(int fd, struct inst *insts, uint64 count,
+                         struct pool *pool)
+{
+	int rc = 0;
+	uint k;
+	uint64 range_count;
+	struct format format;
+
+	if (count == 0) return 0;
+
+	range_count = count / FORMAT_MIN_RANGE;
+	if (range_count > (uint64)pool->thread_count * 4) {
+		range_count = (uint64)pool->thread_count * 4;
+	}
+	if (range_count == 0) range_count = 1;
+
+	format.insts       = insts;
+	format.count       = count;
+	format.range_count = range_count;
+	format.ranges      = calloc(range_count, sizeof(*format.ranges));
+	if (!format.ranges) {
+		fprintf(stderr, "failed to allocate format ranges\n");
+		return -3;
+	}
+
+	pool_run(pool, format.range_count, format_range, &format);
+
+	for (k = 0; k < format.range_count; ++k) {
+		if (format.ranges[k].err < 0) {
+			fprintf(stderr, "failed to allocate text buffer\n");
+			rc = -3;
+			goto free_and_exit;
+		}
+	}
+
+	rc = write_ranges(fd, format.ranges, format.range_count);
+
+free_and_exit:
+	for (k = 0; k < format.range_count; ++k) {
+		free(format.ranges[k].text);
+	}
+
+	free(format.ranges);
+
+	return rc;
+}
+
+// Every instruction is formatted on its own: labels are flagged in the
+// instruction and prefixes only decide what follows their own text, so
+// range boundaries don't need any special handling.
+void format_range(void *ctx, uint task)
+{
+	char *text;
+	size_t cap;
+	uint64 i, from, to;
+	struct format *format = ctx;
+	struct range *range = format->ranges + task;
+
+	from = format->count / format->range_count * task;
+	to   = (task + 1 < format->range_count) ?
+	       format->count / format->range_count * (task + 1) :
+	       format->count;
+
+	cap = (to - from) * TEXT_ESTIMATE + DECODE_TEXT_MAX;
+	range->text = malloc(cap);
+	if (!range->text) {
+		range->err = -3;
+		return;
+	}
+
+	for (i = from; i < to; ++i) {
+		if (cap - range->len < DECODE_TEXT_MAX) {
+			text = realloc(range->text, cap * 2);
+			if (!text) {
+				range->err = -3;
+				return;
+			}
+
+			range->text = text;
+			cap *= 2;
+		}
+
+		text = decode_inst_text(range->text + range->len,
+		                        format->insts + i, NULL);
+		text = decode_inst_end(text, format->insts + i);
+
+		range->len = text - range->text;
+	}
+}
+
+int write_ranges(int fd, struct range *ranges, uint range_count)
+{
+	uint k, iov_count;
+	ssize_t n;
+	struct iovec iov[IOV_BATCH];
+	struct iovec *it;
+
+	for (k = 0; k < range_count; k += iov_count) {
+		iov_count = range_count - k;
+		if (iov_count > sizeof(iov) / sizeof(*iov)) {
+			iov_count = sizeof(iov) / sizeof(*iov);
+		}
+
+		memset(iov, 0, sizeof(iov));
+		for (it = iov; it < iov + iov_count; ++it) {
+			it->iov_base = ranges[k + (it - iov)].text;
+			it->iov_len  = ranges[k + (it - iov)].len;
+		}
+
+		// retry until every buffer of the batch is written
+		it = iov;
+		while (it < iov + iov_count) {
+			n = writev(fd, it, iov + iov_count - it);
+			if (n < 0) {
+				if (errno == EINTR) continue;
+
+				fprintf(stderr, "failed to write output: %s\n",
+				        strerror(errno));
+				return -1;
+			}
+
+			for (; it < iov + iov_count &&
+			       (size_t)n >= it->iov_len; ++it) {
+				n -= it->iov_len;
+			}
+
+			if (it < iov + iov_count) {
+				it->iov_base = (char *)it->iov_base + n;
+				it->iov_len -= n;
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,19 @@
+#if !defined FORMAT_H
+#define FORMAT_H
+
+#include "common.h"
+#include "inst.h"
+#include "pool.h"
+
+// instructions formatted by one task at least
+#define FORMAT_MIN_RANGE (16 * 1024)
+
+// Formats 'insts' on 'pool' threads and writes the text into 'fd'. The array
+// is split into ranges, each range is formatted into its own buffer and the
+// buffers are written in order with writev(). Output is identical to
+// formatting the instructions one by one. Returns 0 on success and negative
+// value if error occurred.
+extern int inst_format_parallel(int fd, struct inst *insts, uint64 count,
+                                struct pool *pool);
+
+#endif /* FORMAT_H */
@@ -0,0 +1,61 @@
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "image.h"
+
+int image_map(struct image *image, const char *path)
+{
+	int fd, rc = 0;
+	void *data;
+	struct stat st;
+
+	assert(image != NULL);
+
+	image->data = NULL;
+	image->size = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror("failed to open file");
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		perror("failed to stat file");
+		rc = -2;
+		goto close_and_exit;
+	}
+
+	if (st.st_size == 0) goto close_and_exit;
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		perror("failed to map file");
+		rc = -3;
+		goto close_and_exit;
+	}
+
+	// image is scanned front to back, so let the kernel read ahead
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	madvise(data, st.st_size, MADV_WILLNEED);
+
+	image->data = data;
+	image->size = st.st_size;
+
+close_and_exit:
+	close(fd);
+
+	return rc;
+}
+
+void image_unmap(struct image *image)
+{
+	if (image->data) munmap((void *)image->data, image->size);
+
+	image->data = NULL;
+	image->size = 0;
+}
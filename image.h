@@ -0,0 +1,18 @@
+#if !defined IMAGE_H
+#define IMAGE_H
+
+#include "common.h"
+
+struct image
+{
+	const uint8 *data;
+	uint64       size;
+};
+
+// Maps file at 'path' into memory read-only. Empty files are represented by
+// NULL data and zero size. Returns 0 on success and negative value if error
+// occurred.
+extern int  image_map(struct image *image, const char *path);
+extern void image_unmap(struct image *image);
+
+#endif /* IMAGE_H */
@@ -1,9 +1,12 @@
 #include <assert.h>
+#include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "inst.h"
 #include "bitmap.h"
+#include "profile.h"
 
 #define W(flags) (!!((flags) & F_W))
 
@@ -19,7 +22,7 @@
 // extended opcode
 #define EXTD(byte) (((byte) >> 3) & 0b111)
 
-struct inst_data inst_table[256] =
+const struct inst_data inst_table[256] =
 {
 	{ INST_ADD,    INST_FMT_RM_REG,    0,            0, 2 }, // 0x00
 	{ INST_ADD,    INST_FMT_RM_REG,    F_W,          0, 2 }, // 0x01
@@ -279,7 +282,7 @@ struct inst_data inst_table[256] =
 	{ INST_EXTD,   INST_FMT_NONE,      0,            0, 0 }, // 0xFF
 };
 
-struct inst_data inst_table_extd[17][8] =
+const struct inst_data inst_table_extd[17][8] =
 {
 	// [0x00]: 0x80 (0b1000 0000)
 	{
@@ -470,9 +473,237 @@ struct inst_data inst_table_extd[17][8] =
 	},
 };
 
-int get_jmp_offset(struct inst *inst)
+// Row of inst_table_extd (plus one) for opcodes marked with INST_EXTD in
+// inst_table, zero otherwise.
+static const uint8 extd_rows[256] =
 {
-	int    label_addr = 0;
+	/* 0x00 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	/* 0x10 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	/* 0x20 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	/* 0x30 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	/* 0x40 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	/* 0x50 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	/* 0x60 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	/* 0x70 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	/* 0x80 */  1,  2,  3,  4,  0,  0,  0,  0,  0,  0,  0,  0,  5,  0,  6,  7,
+	/* 0x90 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	/* 0xA0 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	/* 0xB0 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	/* 0xC0 */  0,  0,  0,  0,  0,  0,  8,  9,  0,  0,  0,  0,  0,  0,  0,  0,
+	/* 0xD0 */ 10, 11, 12, 13,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	/* 0xE0 */  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+	/* 0xF0 */  0,  0,  0,  0,  0,  0, 14, 15,  0,  0,  0,  0,  0,  0, 16, 17,
+};
+
+// Displacement size for every mod r/m byte:
+// [mod=01] - 8-bit displacement
+// [mod=10] or [mod=00 r/m=110] - 16-bit displacement (or direct address)
+#define DISP_SIZE(m) ((MOD(m) == MODE_MEM16 ||                                \
+                       (MOD(m) == MODE_MEM0 && RM(m) == 0b110)) ? 2 :          \
+                      (MOD(m) == MODE_MEM8))
+
+#define DISP_SIZE4(m)  DISP_SIZE(m),       DISP_SIZE((m) + 1),                 \
+                       DISP_SIZE((m) + 2), DISP_SIZE((m) + 3)
+#define DISP_SIZE16(m) DISP_SIZE4(m),       DISP_SIZE4((m) + 4),               \
+                       DISP_SIZE4((m) + 8), DISP_SIZE4((m) + 12)
+#define DISP_SIZE64(m) DISP_SIZE16(m),        DISP_SIZE16((m) + 16),           \
+                       DISP_SIZE16((m) + 32), DISP_SIZE16((m) + 48)
+
+static const uint8 disp_sizes[256] =
+{
+	DISP_SIZE64(0x00), DISP_SIZE64(0x40), DISP_SIZE64(0x80), DISP_SIZE64(0xC0),
+};
+
+#define FMT_MODRM(name, modrm, sr, reg, data) [INST_FMT_##name] = modrm,
+
+static const uint8 fmt_modrm[INST_FMT_JMP_FAR + 1] =
+{
+	INST_FORMATS(FMT_MODRM)
+};
+
+// Extracts operand fields of an instruction with format 'fmt' from 'raw'.
+// 'tmp' holds table data with full instruction size. Called with constant
+// layout only, so every format gets its own copy without dead branches.
+static inline __attribute__((always_inline))
+void extract_fields(struct inst *inst, const uint8 *raw,
+                    const struct inst_data *tmp, uint disp_size, int modrm,
+                    enum field_src sr, enum field_src reg,
+                    enum data_kind data)
+{
+	uint8 lo = 0, hi = 0;
+	uint data_size = 1;
+	uint16 disp = 0, fields = 0, value = 0, value_ext = 0;
+
+	// also save displacement and mod, r/m fields if instruction has form:
+	// [mod ... r/m] [disp-lo] [disp-hi]
+	if (modrm) {
+		if (disp_size > 0) disp  = raw[2];
+		if (disp_size > 1) disp |= raw[3] << 8;
+
+		fields |= (MOD(raw[1]) & 0b11)  << 0;
+		fields |= (RM(raw[1])  & 0b111) << 4;
+	}
+
+	if (sr == FLD_OPCODE) fields |= (SR(raw[0]) & 0b111) << 2;
+	if (sr == FLD_MODRM)  fields |= (SR(raw[1]) & 0b111) << 2;
+
+	if (reg == FLD_OPCODE) fields |= (REG2(raw[0]) & 0b111) << 7;
+	if (reg == FLD_MODRM)  fields |= (REG(raw[1])  & 0b111) << 7;
+
+	switch (data) {
+	case DATA_IMM:
+		if (tmp->flags & F_S) {
+			value = raw[tmp->size - data_size];
+			if (value & 0x80)
+				value |= 0xFF00;
+			break;
+		}
+
+		if (W(tmp->flags)) {
+			data_size = 2;
+			hi = raw[tmp->size - data_size + 1];
+		}
+
+		lo = raw[tmp->size - data_size];
+		value = (hi << 8) | lo;
+		break;
+	case DATA_BYTE:
+		value = raw[1];
+		break;
+	case DATA_WORD:
+		value = (raw[2] << 8) | raw[1];
+		break;
+	case DATA_FAR:
+		value     = (raw[2] << 8) | raw[1];
+		value_ext = (raw[4] << 8) | raw[3];
+		break;
+	case DATA_NONE:
+		break;
+	}
+
+	// every field is written, so 'inst' doesn't have to be cleared first
+	inst->disp     = disp;
+	inst->data     = value;
+	inst->data_ext = value_ext;
+	inst->fields   = fields;
+}
+
+typedef void (*extract_fn)(struct inst *inst, const uint8 *raw,
+                           const struct inst_data *tmp, uint disp_size);
+
+#define FMT_EXTRACT_FN(name, modrm, sr, reg, data)                           \
+	static void extract_##name(struct inst *inst, const uint8 *raw,      \
+	                           const struct inst_data *tmp,              \
+	                           uint disp_size)                           \
+	{                                                                    \
+		extract_fields(inst, raw, tmp, disp_size, modrm, sr, reg,    \
+		               data);                                        \
+	}
+
+INST_FORMATS(FMT_EXTRACT_FN)
+
+#define FMT_EXTRACT(name, modrm, sr, reg, data) \
+	[INST_FMT_##name] = extract_##name,
+
+static const extract_fn fmt_extract[INST_FMT_JMP_FAR + 1] =
+{
+	INST_FORMATS(FMT_EXTRACT)
+};
+
+// Looks up instruction data by opcode and mod r/m byte
+static inline const struct inst_data *inst_lookup(uint8 op, uint8 modrm)
+{
+	uint8 row = extd_rows[op];
+
+	return row ? &inst_table_extd[row - 1][EXTD(modrm)] : &inst_table[op];
+}
+
+// Returns displacement size of instruction with given format and mod r/m
+static inline uint8 inst_disp_size(enum inst_format fmt, uint8 modrm)
+{
+	return fmt_modrm[fmt] ? disp_sizes[modrm] : 0;
+}
+
+// Length classes used by the length-only scanner:
+// [bits 0-2] - instruction size without displacement
+// [bit 3]    - mod r/m byte present, displacement size is added
+// [bit 7]    - extended opcode, bits 0-4 are the row in len_extd
+// zero means unknown instruction
+#define LEN_SIZE  0x07
+#define LEN_MODRM 0x08
+#define LEN_EXTD  0x80
+
+static const uint8 len_classes[256] =
+{
+	/* 0x00 */ 0x0A, 0x0A, 0x0A, 0x0A, 0x02, 0x03, 0x01, 0x01,
+	/* 0x08 */ 0x0A, 0x0A, 0x0A, 0x0A, 0x02, 0x03, 0x01, 0x00,
+	/* 0x10 */ 0x0A, 0x0A, 0x0A, 0x0A, 0x02, 0x03, 0x01, 0x01,
+	/* 0x18 */ 0x0A, 0x0A, 0x0A, 0x0A, 0x02, 0x03, 0x01, 0x01,
+	/* 0x20 */ 0x0A, 0x0A, 0x0A, 0x0A, 0x02, 0x03, 0x01, 0x01,
+	/* 0x28 */ 0x0A, 0x0A, 0x0A, 0x0A, 0x02, 0x03, 0x01, 0x01,
+	/* 0x30 */ 0x0A, 0x0A, 0x0A, 0x0A, 0x02, 0x03, 0x01, 0x01,
+	/* 0x38 */ 0x0A, 0x0A, 0x0A, 0x0A, 0x02, 0x03, 0x01, 0x01,
+	/* 0x40 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	/* 0x48 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	/* 0x50 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	/* 0x58 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	/* 0x60 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	/* 0x68 */ 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	/* 0x70 */ 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+	/* 0x78 */ 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+	/* 0x80 */ 0x80, 0x81, 0x82, 0x83, 0x0A, 0x0A, 0x0A, 0x0A,
+	/* 0x88 */ 0x0A, 0x0A, 0x0A, 0x0A, 0x84, 0x0A, 0x85, 0x86,
+	/* 0x90 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	/* 0x98 */ 0x01, 0x01, 0x05, 0x01, 0x01, 0x01, 0x01, 0x01,
+	/* 0xA0 */ 0x03, 0x03, 0x03, 0x03, 0x01, 0x01, 0x01, 0x01,
+	/* 0xA8 */ 0x02, 0x03, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	/* 0xB0 */ 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+	/* 0xB8 */ 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+	/* 0xC0 */ 0x00, 0x00, 0x03, 0x01, 0x0A, 0x0A, 0x87, 0x88,
+	/* 0xC8 */ 0x00, 0x00, 0x03, 0x01, 0x01, 0x02, 0x01, 0x01,
+	/* 0xD0 */ 0x89, 0x8A, 0x8B, 0x8C, 0x02, 0x02, 0x00, 0x01,
+	/* 0xD8 */ 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A,
+	/* 0xE0 */ 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02,
+	/* 0xE8 */ 0x03, 0x03, 0x05, 0x02, 0x01, 0x01, 0x01, 0x01,
+	/* 0xF0 */ 0x01, 0x00, 0x01, 0x01, 0x01, 0x01, 0x8D, 0x8E,
+	/* 0xF8 */ 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x8F, 0x90,
+};
+
+static const uint8 len_extd[17][8] =
+{
+	{ 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B }, // 0x80
+	{ 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C }, // 0x81
+	{ 0x0B, 0x00, 0x0B, 0x0B, 0x00, 0x0B, 0x00, 0x0B }, // 0x82
+	{ 0x0B, 0x00, 0x0B, 0x0B, 0x00, 0x0B, 0x00, 0x0B }, // 0x83
+	{ 0x0A, 0x0A, 0x0A, 0x0A, 0x00, 0x00, 0x00, 0x00 }, // 0x8C
+	{ 0x0A, 0x0A, 0x0A, 0x0A, 0x00, 0x00, 0x00, 0x00 }, // 0x8E
+	{ 0x0A, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // 0x8F
+	{ 0x0B, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // 0xC6
+	{ 0x0C, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // 0xC7
+	{ 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x00, 0x0A }, // 0xD0
+	{ 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x00, 0x0A }, // 0xD1
+	{ 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x00, 0x0A }, // 0xD2
+	{ 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x00, 0x0A }, // 0xD3
+	{ 0x0B, 0x00, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A }, // 0xF6
+	{ 0x0C, 0x00, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A }, // 0xF7
+	{ 0x0A, 0x0A, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 }, // 0xFE
+	{ 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x00 }, // 0xFF
+};
+
+// Returns size of instruction with given opcode and mod r/m byte or zero if
+// instruction is unknown.
+static inline uint8 len_lookup(uint8 op, uint8 modrm)
+{
+	uint8 cls = len_classes[op];
+
+	if (cls & LEN_EXTD) cls = len_extd[cls & ~LEN_EXTD][EXTD(modrm)];
+
+	return (cls & LEN_SIZE) + ((cls & LEN_MODRM) ? disp_sizes[modrm] : 0);
+}
+
+int64 get_jmp_offset(struct inst *inst)
+{
+	int64  label_addr = 0;
 	uint8  tmp8;
 	uint16 tmp16;
 
@@ -492,250 +723,410 @@ int get_jmp_offset(struct inst *inst)
 	return label_addr;
 }
 
-int get_inst_data(struct inst *inst, uint8 * const image, uint size,
-                  uint offset)
+int get_inst_data(struct inst *inst, const uint8 *image, uint64 size,
+                  uint64 offset)
 {
-	uint8 extd_op  = 0, i = 0;
-	struct inst_data tmp;
+	if (inst_decode(inst, image, size, offset) < 0) {
+		fprintf(stderr, "out of image boundaries (offset: %" PRIu64
+		        ", inst_size: %u, image_size: %" PRIu64 ")\n", offset,
+		        inst->base.size, size);
+		return -1;
+	}
 
-	uint8 lo = 0, hi = 0;
-	uint data_size   = 1;
+	return 0;
+}
 
-	uint mod, rm;
+int inst_decode(struct inst *inst, const uint8 *image, uint64 size,
+                uint64 offset)
+{
+	struct inst_data tmp;
+
+	uint8 modrm;
 	uint disp_size   = 0;
-	uint8 *inst_raw = image + offset;
-
-	memset(inst, 0, sizeof(*inst));
-
-	tmp = inst_table[inst_raw[0]];
-	if (tmp.type == INST_EXTD) {
-		switch (inst_raw[0]) {
-		case 0x80: i = 0x00; break;
-		case 0x81: i = 0x01; break;
-		case 0x82: i = 0x02; break;
-		case 0x83: i = 0x03; break;
-		case 0x8C: i = 0x04; break;
-		case 0x8E: i = 0x05; break;
-		case 0x8F: i = 0x06; break;
-		case 0xC6: i = 0x07; break;
-		case 0xC7: i = 0x08; break;
-		case 0xD0: i = 0x09; break;
-		case 0xD1: i = 0x0A; break;
-		case 0xD2: i = 0x0B; break;
-		case 0xD3: i = 0x0C; break;
-		case 0xF6: i = 0x0D; break;
-		case 0xF7: i = 0x0E; break;
-		case 0xFE: i = 0x0F; break;
-		case 0xFF: i = 0x10; break;
-		}
+	const uint8 *inst_raw = image + offset;
 
-		extd_op = EXTD(inst_raw[1]);
-		tmp     = inst_table_extd[i][extd_op];
-	}
+	// don't look past the end of image for the second byte
+	modrm = (size - offset > 1) ? inst_raw[1] : 0;
+
+	tmp        = *inst_lookup(inst_raw[0], modrm);
+	disp_size  = inst_disp_size(tmp.fmt, modrm);
+	tmp.size  += disp_size;
 
 	if (offset + tmp.size > size) {
-		fprintf(stderr, "out of image boundaries (offset: %u, "
-		        "inst_size: %u, image_size: %u)\n", offset, tmp.size,
-		        size);
+		// let the caller report the size it needed
+		inst->base.size = tmp.size;
 		return -1;
 	}
 
-	// also save displacement and mod, r/m fields if instruction has form:
-	// [mod ... r/m] [disp-lo] [disp-hi]
-	switch (tmp.fmt) {
-	case INST_FMT_RM:
-	case INST_FMT_RM_V:
-	case INST_FMT_RM_SR:
-	case INST_FMT_RM_REG:
-	case INST_FMT_RM_IMM:
-	case INST_FMT_RM_ESC:
-		mod = MOD(inst_raw[1]);
-		rm  = RM(inst_raw[1]);
-
-		// direct address and 16-bit displacement
-		if (mod == MODE_MEM16 || (mod == MODE_MEM0 && rm == 0b110))
-			disp_size = 2;
-
-		// 8-bit displacement
-		if (mod == MODE_MEM8)
-			disp_size = 1;
-
-		tmp.size  += disp_size;
-		inst->disp = (inst_raw[3] << 8) * (disp_size > 1) | inst_raw[2];
-
-		inst->fields |= (mod & 0b11)  << 0;
-		inst->fields |= (rm  & 0b111) << 4;
-	default:
-		break;
+	fmt_extract[tmp.fmt](inst, inst_raw, &tmp, disp_size);
+
+	// external opcode of esc is split between opcode and mod r/m bytes
+	if (tmp.fmt == INST_FMT_RM_ESC) {
+		inst->fields |= (ESC1(inst_raw[0]) << 3 | ESC2(modrm)) << 10;
 	}
 
-	// save sr field
-	switch (tmp.fmt) {
-	case INST_FMT_SR:
-		inst->fields |= (SR(inst_raw[0]) & 0b111) << 2;
-		break;
-	case INST_FMT_RM_SR:
-		inst->fields |= (SR(inst_raw[1]) & 0b111) << 2;
+	inst->offset = offset;
+	inst->base   = tmp;
+
+	return 0;
+}
+
+void inst_apply_prefixes(struct inst *inst, uint8 *prefixes)
+{
+	switch (inst->base.type) {
+	case INST_LOCK:
+		*prefixes |= PFX_LOCK;
 		break;
-	default:
+	case INST_SGMNT:
+		*prefixes |= inst->base.flags;
+		*prefixes |= PFX_SGMNT;
 		break;
-	}
-
-	// save reg field
-	switch (tmp.fmt) {
-	case INST_FMT_REG:
-	case INST_FMT_ACC_REG:
-	case INST_FMT_REG_IMM:
-		inst->fields |= (REG2(inst_raw[0]) & 0b111) << 7;
+	case INST_REP:
+		*prefixes |= PFX_REP;
 		break;
-	case INST_FMT_RM_REG:
-		inst->fields |= (REG(inst_raw[1]) & 0b111) << 7;
+	case INST_REPNE:
+		*prefixes |= PFX_REPNE;
 		break;
+	// if it isn't a prefix instruction, assign accumulated prefixes
 	default:
-		break;
+		inst->base.prefixes |= *prefixes;
+		*prefixes = 0;
 	}
+}
 
-	// save data/addr fields
-	switch (tmp.fmt) {
-	case INST_FMT_IMM:
-	case INST_FMT_ACC_IMM:
-	case INST_FMT_REG_IMM:
-	case INST_FMT_RM_IMM:
-		if (tmp.flags & F_S) {
-			inst->data = inst_raw[tmp.size - data_size];
-			if (inst->data & 0x80)
-				inst->data |= 0xFF00;
-			break;
-		}
+void inst_arena_init(struct inst_arena *arena)
+{
+	assert(arena != NULL);
 
-		if (W(tmp.flags)) {
-			data_size = 2;
-			hi = inst_raw[tmp.size - data_size + 1];
+	arena->insts = NULL;
+	arena->count = 0;
+	arena->cap   = 0;
+}
+
+void inst_arena_free(struct inst_arena *arena)
+{
+	free(arena->insts);
+	inst_arena_init(arena);
+}
+
+int inst_arena_reserve(struct inst_arena *arena, uint64 cap)
+{
+	struct inst *insts;
+
+	if (cap <= arena->cap) return 0;
+
+	if (cap < arena->cap * 2)   cap = arena->cap * 2;
+	if (cap < INST_ARENA_CHUNK) cap = INST_ARENA_CHUNK;
+
+	insts = realloc(arena->insts, cap * sizeof(*insts));
+	if (!insts) return -1;
+
+	arena->insts = insts;
+	arena->cap   = cap;
+
+	return 0;
+}
+
+// Sets F_LB flag on already decoded instruction located at 'offset'.
+static void mark_label(struct inst_arena *arena, uint64 offset)
+{
+	uint64 lo = 0, hi = arena->count, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (arena->insts[mid].offset < offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
 		}
+	}
 
-		lo = inst_raw[tmp.size - data_size];
-		inst->data = (hi << 8) | lo;
-		break;
-	case INST_FMT_ACC_IMM8:
-	case INST_FMT_JMP_SHORT:
-		inst->data = inst_raw[1];
+	if (lo < arena->count && arena->insts[lo].offset == offset) {
+		arena->insts[lo].base.flags |= F_LB;
+	}
+}
+
+int64 inst_scan(struct inst_arena *arena, const uint8 *image, uint64 size)
+{
+	int64 rc = 0;
+	uint64 err_offset = 0;
+	struct inst inst;
+	struct bitmap labels;
+
+	if (!arena || (!image && size > 0)) {
+		fprintf(stderr, "invalid arguments (arena: %p, image: %p)\n",
+		        arena, image);
+		return -4;
+	}
+
+	arena->count = 0;
+	if (size == 0) return 0;
+
+	if (bitmap_init(&labels, size) < 0) {
+		fprintf(stderr, "failed to initialize bitmap for labels\n");
+		return -3;
+	}
+
+	// the arena starts at INST_ARENA_CHUNK instructions and doubles as the
+	// scan fills it
+	PROF_BEGIN_BYTES(scan, "inst_scan", size);
+	rc = inst_scan_into(arena, &labels, image, size, &err_offset);
+	PROF_END(scan);
+
+	switch (rc) {
+	case -1:
+		// decode again to print the details
+		get_inst_data(&inst, image, size, err_offset);
+		fprintf(stderr, "failed to get instruction data\n");
 		break;
-	case INST_FMT_ACC_MEM:
-	case INST_FMT_JMP_NEAR:
-		inst->data = (inst_raw[2] << 8) | inst_raw[1];
+	case -2:
+		fprintf(stderr, "unknown instruction encountered: 0x%02X\n",
+		        image[err_offset]);
 		break;
-	case INST_FMT_JMP_FAR:
-		inst->data     = (inst_raw[2] << 8) | inst_raw[1];
-		inst->data_ext = (inst_raw[4] << 8) | inst_raw[3];
+	case -5:
+		fprintf(stderr, "failed to grow instruction arena\n");
 		break;
 	default:
 		break;
 	}
 
-	if (offset + tmp.size > size) {
-		fprintf(stderr, "out of image boundaries (offset: %u, "
-		        "inst_size: %u, image_size: %u)\n", offset, tmp.size,
-		        size);
-		return -2;
+	bitmap_free(&labels);
+
+	return rc;
+}
+
+int64 inst_scan_into(struct inst_arena *arena, struct bitmap *labels,
+                     const uint8 *image, uint64 size, uint64 *err_offset)
+{
+	int64 label_addr = 0;
+	uint64 offset = 0;
+	uint8 prefixes = 0;
+	struct inst *inst;
+
+	arena->count = 0;
+
+	while (offset < size) {
+		if (arena->count == arena->cap &&
+		    inst_arena_reserve(arena, arena->cap + INST_ARENA_CHUNK) < 0) {
+			*err_offset = offset;
+			return -5;
+		}
+
+		inst = arena->insts + arena->count;
+
+		if (inst_decode(inst, image, size, offset) < 0) {
+			*err_offset = offset;
+			return -1;
+		}
+
+		if (inst->base.type == INST_UNK) {
+			*err_offset = offset;
+			return -2;
+		}
+
+		inst_apply_prefixes(inst, &prefixes);
+
+		// label was set by one of the previous instructions
+		if (bitmap_get_bit(labels, offset) > 0) {
+			inst->base.flags |= F_LB;
+		}
+
+		++arena->count;
+
+		// forward labels are picked up when the target is decoded,
+		// backward ones are set on the already decoded instruction
+		label_addr = get_jmp_offset(inst);
+		if (label_addr > (int64)offset) {
+			bitmap_set_bit(labels, label_addr);
+		} else if (label_addr >= 0) {
+			mark_label(arena, label_addr);
+		}
+
+		offset += inst->base.size;
 	}
 
-	inst->offset = offset;
-	inst->base   = tmp;
+	return arena->count;
+}
 
-	return 0;
+int inst_length(const uint8 *image, uint64 size, uint64 offset)
+{
+	uint8 len, modrm;
+	const uint8 *inst_raw = image + offset;
+
+	modrm = (size - offset > 1) ? inst_raw[1] : 0;
+
+	len = len_lookup(inst_raw[0], modrm);
+	if (len == 0) return -2;
+	if (offset + len > size) return -1;
+
+	return len;
 }
 
-int inst_scan_image(struct inst * const insts, uint count,
-                    uint8 * const image, uint size)
+int64 inst_scan_lengths(struct bitmap *boundaries, const uint8 *image,
+                        uint64 size)
 {
-	int rc = 0;
-	int label_addr = 0;
-	uint i, offset = 0;
-	uint8 prefixes = 0;
+	int len;
+	int64 count = 0;
+	uint64 offset = 0;
+
+	if (!image && size > 0) {
+		fprintf(stderr, "invalid arguments (image: %p)\n", image);
+		return -4;
+	}
+
+	PROF_BEGIN_BYTES(lengths, "length scan", size);
+
+	for (; offset < size; ++count) {
+		len = inst_length(image, size, offset);
+		if (len == -1) {
+			fprintf(stderr, "out of image boundaries (offset: %"
+			        PRIu64 ", image_size: %" PRIu64 ")\n", offset,
+			        size);
+			PROF_END(lengths);
+			return -1;
+		}
+
+		if (len == -2) {
+			fprintf(stderr, "unknown instruction encountered: "
+			        "0x%02X\n", image[offset]);
+			PROF_END(lengths);
+			return -2;
+		}
+
+		if (boundaries) bitmap_set_bit(boundaries, offset);
+
+		offset += len;
+	}
+
+	PROF_END(lengths);
+
+	return count;
+}
+
+int64 inst_mark_labels(struct bitmap *labels, const uint8 *image,
+                       uint64 size)
+{
+	int len;
+	int64 count = 0;
+	int64 label_addr = 0;
+	uint64 offset = 0;
+	enum inst_format fmt;
 	struct inst inst;
-	struct bitmap labels;
 
-	// return instruction count if insts is NULL
-	if (!insts) {
-		for (count = 0; offset < size; ++count) {
-			if (get_inst_data(&inst, image, size, offset) < 0) {
-				fprintf(stderr, "failed to get instruction\n");
-				return -1;
-			}
+	if (!labels || (!image && size > 0)) {
+		fprintf(stderr, "invalid arguments (labels: %p, image: %p)\n",
+		        labels, image);
+		return -4;
+	}
 
-			if (inst.base.type == INST_UNK) {
-				fprintf(stderr, "unknown instruction "
-				        "encountered: 0x%02X\n", image[offset]);
-				return -2;
-			}
+	PROF_BEGIN_BYTES(labels, "mark labels", size);
+
+	for (; offset < size; ++count) {
+		len = inst_length(image, size, offset);
+		if (len == -1) {
+			fprintf(stderr, "out of image boundaries (offset: %"
+			        PRIu64 ", image_size: %" PRIu64 ")\n", offset,
+			        size);
+			PROF_END(labels);
+			return -1;
+		}
 
-			offset += inst.base.size;
+		if (len == -2) {
+			fprintf(stderr, "unknown instruction encountered: "
+			        "0x%02X\n", image[offset]);
+			PROF_END(labels);
+			return -2;
+		}
+
+		// jumps aren't extended opcodes, the first byte tells them
+		// apart; nothing else is decoded
+		fmt = inst_table[image[offset]].fmt;
+		if (fmt == INST_FMT_JMP_SHORT || fmt == INST_FMT_JMP_NEAR) {
+			inst_decode(&inst, image, size, offset);
+
+			// targets outside of the image get no bit, they are
+			// never numbered
+			label_addr = get_jmp_offset(&inst);
+			if (label_addr >= 0 && (uint64)label_addr < size) {
+				bitmap_set_bit(labels, label_addr);
+			}
 		}
 
-		return count;
+		offset += len;
 	}
 
-	if (bitmap_init(&labels, size) < 0) {
-		fprintf(stderr, "failed to initialize bitmap for labels\n");
-		rc = -3;
-		goto free_and_exit;
+	PROF_END(labels);
+
+	return count;
+}
+
+int64 inst_scan_each(struct bitmap *labels, const uint8 *image, uint64 size,
+                     inst_emit_fn emit, void *ctx)
+{
+	int64 count = 0, label;
+	uint64 offset = 0;
+	uint8 prefixes = 0;
+	struct inst inst;
+
+	if (!labels || (!image && size > 0) || !emit) {
+		fprintf(stderr, "invalid arguments (labels: %p, image: %p, "
+		        "emit: %p)\n", labels, image, emit);
+		return -4;
 	}
 
-	for (i = 0; i < count && offset < size; ++i) {
-		if (get_inst_data(insts + i, image, size, offset) < 0) {
+	label = bitmap_find_next_set(labels, 0);
+
+	for (; offset < size; ++count) {
+		if (get_inst_data(&inst, image, size, offset) < 0) {
 			fprintf(stderr, "failed to get instruction data\n");
-			rc = -1;
-			goto free_and_exit;
+			return -1;
 		}
 
-		if (insts[i].base.type == INST_UNK) {
+		if (inst.base.type == INST_UNK) {
 			fprintf(stderr, "unknown instruction encountered: "
 			        "0x%02X\n", image[offset]);
-			rc = -2;
-			goto free_and_exit;
+			return -2;
 		}
 
-		// handle explicit prefixes
-		switch (insts[i].base.type) {
-		case INST_LOCK:
-			prefixes |= PFX_LOCK;
-			break;
-		case INST_SGMNT:
-			prefixes |= insts[i].base.flags;
-			prefixes |= PFX_SGMNT;
-			break;
-		case INST_REP:
-			prefixes |= PFX_REP;
-			break;
-		case INST_REPNE:
-			prefixes |= PFX_REPNE;
-			break;
-		// if it isn't a prefix instruction, assign accumulated prefixes
-		default:
-			insts[i].base.prefixes |= prefixes;
-			prefixes = 0;
+		inst_apply_prefixes(&inst, &prefixes);
+
+		// labels pointing inside instructions are never printed
+		while (label >= 0 && (uint64)label < offset) {
+			label = bitmap_find_next_set(labels, label + 1);
 		}
 
-		label_addr = get_jmp_offset(insts + i);
-		if (label_addr >= 0) {
-			bitmap_set_bit(&labels, label_addr);
+		if (label >= 0 && (uint64)label == offset) {
+			inst.base.flags |= F_LB;
 		}
 
-		offset += insts[i].base.size;
+		if (emit(&inst, ctx) != 0) return -6;
+
+		offset += inst.base.size;
 	}
 
-	// setting F_LB flag for label generation
-	for (i = 0, offset = 0; i < count && offset < size; ++i) {
-		if (bitmap_get_bit(&labels, offset) > 0) {
-			insts[i].base.flags |= F_LB;
-		}
+	return count;
+}
 
-		offset += insts[i].base.size;
-	}
+int64 inst_scan_image(struct inst * const insts, uint64 count,
+                      const uint8 *image, uint64 size)
+{
+	int64 rc;
+	struct inst_arena arena;
+
+	inst_arena_init(&arena);
+
+	rc = inst_scan(&arena, image, size);
+	if (rc < 0) goto free_and_exit;
+
+	// return instruction count if insts is NULL
+	if (!insts) goto free_and_exit;
+
+	if (count > arena.count) count = arena.count;
+	memcpy(insts, arena.insts, count * sizeof(*insts));
+	rc = 0;
 
 free_and_exit:
-	bitmap_free(&labels);
+	inst_arena_free(&arena);
 
 	return rc;
 }
-
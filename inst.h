@@ -3,6 +3,8 @@
 
 #include "common.h"
 
+struct bitmap;
+
 #define F_W  (0b1  << 0)
 #define F_D  (0b1  << 1)
 #define F_S  (0b1  << 2)
@@ -42,6 +44,10 @@
 #define MODE_MEM16 0b10
 #define MODE_REG   0b11
 
+// the longest instruction: [opcode] [mod r/m] [disp-lo] [disp-hi] [data-lo]
+// [data-hi]
+#define INST_MAX_SIZE 6
+
 enum inst_format
 {
 	INST_FMT_NONE,
@@ -122,6 +128,48 @@ enum inst_type
 	INST_EXTD,
 };
 
+// Where sr and reg fields are taken from
+enum field_src
+{
+	FLD_NONE,
+	FLD_OPCODE, // first byte
+	FLD_MODRM,  // mod r/m byte
+};
+
+// What data/addr fields hold
+enum data_kind
+{
+	DATA_NONE,
+	DATA_IMM,  // immediate at the end of instruction, size depends on w, s
+	DATA_BYTE, // byte after opcode
+	DATA_WORD, // word after opcode
+	DATA_FAR,  // segment:offset pair after opcode
+};
+
+// Operand layout of every instruction format:
+// X(format, [mod ... r/m] byte followed by displacement, sr field, reg field,
+//   data)
+#define INST_FORMATS(X)                                                      \
+	X(NONE,      0, FLD_NONE,   FLD_NONE,   DATA_NONE)                   \
+	X(RM,        1, FLD_NONE,   FLD_NONE,   DATA_NONE)                   \
+	X(RM_V,      1, FLD_NONE,   FLD_NONE,   DATA_NONE)                   \
+	X(RM_SR,     1, FLD_MODRM,  FLD_NONE,   DATA_NONE)                   \
+	X(RM_REG,    1, FLD_NONE,   FLD_MODRM,  DATA_NONE)                   \
+	X(RM_IMM,    1, FLD_NONE,   FLD_NONE,   DATA_IMM)                    \
+	X(RM_ESC,    1, FLD_NONE,   FLD_NONE,   DATA_NONE)                   \
+	X(ACC_DX,    0, FLD_NONE,   FLD_NONE,   DATA_NONE)                   \
+	X(ACC_IMM8,  0, FLD_NONE,   FLD_NONE,   DATA_BYTE)                   \
+	X(ACC_IMM,   0, FLD_NONE,   FLD_NONE,   DATA_IMM)                    \
+	X(ACC_REG,   0, FLD_NONE,   FLD_OPCODE, DATA_NONE)                   \
+	X(ACC_MEM,   0, FLD_NONE,   FLD_NONE,   DATA_WORD)                   \
+	X(REG,       0, FLD_NONE,   FLD_OPCODE, DATA_NONE)                   \
+	X(REG_IMM,   0, FLD_NONE,   FLD_OPCODE, DATA_IMM)                    \
+	X(SR,        0, FLD_OPCODE, FLD_NONE,   DATA_NONE)                   \
+	X(IMM,       0, FLD_NONE,   FLD_NONE,   DATA_IMM)                    \
+	X(JMP_SHORT, 0, FLD_NONE,   FLD_NONE,   DATA_BYTE)                   \
+	X(JMP_NEAR,  0, FLD_NONE,   FLD_NONE,   DATA_WORD)                   \
+	X(JMP_FAR,   0, FLD_NONE,   FLD_NONE,   DATA_FAR)
+
 struct inst_data
 {
 	enum inst_type   type;
@@ -138,23 +186,102 @@ struct inst
 	uint16 data;     // addr, imm
 	uint16 data_ext; // if instruction size is 6 bytes
 	uint16 fields;   // mod, reg, r/m, sr, esc
-	uint   offset;   // location in image
+	uint64 offset;   // location in image
+};
+
+// Called for every decoded instruction in image order. Non-zero return value
+// stops decoding.
+typedef int (*inst_emit_fn)(struct inst *inst, void *ctx);
+
+// Growable storage for decoded instructions. Memory is allocated in chunks
+// of at least INST_ARENA_CHUNK instructions and reused between scans.
+struct inst_arena
+{
+	struct inst *insts;
+	uint64       count;
+	uint64       cap;
 };
 
+#define INST_ARENA_CHUNK 4096
+
+// Opcode tables, indexed by the first byte and, for INST_EXTD opcodes, by the
+// reg field of the mod r/m byte.
+extern const struct inst_data inst_table[256];
+extern const struct inst_data inst_table_extd[17][8];
+
 // Calculates target offset of a jmp instruction (call, jmp, jne etc). Returns
 // offset on success and negative if it's not a jmp instruction.
-extern int get_jmp_offset(struct inst *inst);
+extern int64 get_jmp_offset(struct inst *inst);
 
 // Extracts instruction data from 'image' at given 'offset'. Returns 0 on
 // success and negative value if error occurred.
-extern int get_inst(struct inst *inst, uint8 * const image, uint size,
-                    uint offset);
+extern int get_inst_data(struct inst *inst, const uint8 *image, uint64 size,
+                         uint64 offset);
+
+// Same as get_inst_data(), but doesn't print anything. If instruction doesn't
+// fit into the image, -1 is returned and 'inst->base.size' holds its size.
+// Safe to call from several threads.
+extern int inst_decode(struct inst *inst, const uint8 *image, uint64 size,
+                       uint64 offset);
+
+// Handles explicit prefixes. Prefix instructions are accumulated into
+// 'prefixes', which are then assigned to the next non-prefix instruction.
+extern void inst_apply_prefixes(struct inst *inst, uint8 *prefixes);
+
+extern void inst_arena_init(struct inst_arena *arena);
+extern void inst_arena_free(struct inst_arena *arena);
+
+// Makes sure 'arena' can hold at least 'cap' instructions. Returns 0 on
+// success and negative value if allocation failed.
+extern int  inst_arena_reserve(struct inst_arena *arena, uint64 cap);
+
+// Extracts all instructions from 'image' into 'arena' in a single pass,
+// growing it as needed. Labels are resolved in the same pass. Returns
+// instruction count on success and negative value if invalid instruction is
+// encountered or error occurred.
+extern int64 inst_scan(struct inst_arena *arena, const uint8 *image,
+                       uint64 size);
+
+// Core of inst_scan() that neither prints nor allocates beyond growing
+// 'arena'. 'labels' must hold 'size' bits at least and be cleared. Returns
+// instruction count on success, -1 if instruction crosses image boundaries,
+// -2 if it's unknown and -5 if arena couldn't grow; offset of the failed
+// instruction is stored in 'err_offset'.
+extern int64 inst_scan_into(struct inst_arena *arena, struct bitmap *labels,
+                            const uint8 *image, uint64 size,
+                            uint64 *err_offset);
+
+// Returns size of instruction located at 'offset' in 'image' without
+// decoding it. Returns -1 if instruction crosses image boundaries and -2 if
+// it's unknown.
+extern int inst_length(const uint8 *image, uint64 size, uint64 offset);
+
+// Walks instruction lengths in 'image' and marks offset of every instruction
+// in 'boundaries' bitmap ('size' bits at least) if it isn't NULL. Returns
+// instruction count on success and negative value if error occurred.
+extern int64 inst_scan_lengths(struct bitmap *boundaries, const uint8 *image,
+                               uint64 size);
+
+// Marks offsets of jmp instruction targets found in 'image' in 'labels'
+// bitmap, which must be at least 'size' bits long. Instructions are stepped
+// over by length (see inst_length()), only jmp instructions are decoded. Returns instruction count on success and
+// negative value if error occurred.
+extern int64 inst_mark_labels(struct bitmap *labels, const uint8 *image,
+                              uint64 size);
+
+// Decodes instructions from 'image' one at a time and passes them to 'emit'
+// without storing them. F_LB flag is set from 'labels' produced by
+// inst_mark_labels(). Returns instruction count on success and negative
+// value if error occurred.
+extern int64 inst_scan_each(struct bitmap *labels, const uint8 *image,
+                            uint64 size, inst_emit_fn emit, void *ctx);
 
-// Extracts instructions from 'image' and writes 'count' instructions into
+// Compatibility wrapper around inst_scan(). Extracts instructions from 'image'
+// and writes 'count' instructions into
 // 'insts' array. If 'insts' is NULL, function returns instruction count. If
 // invalid instruction is encountered or error occurred negative value is
 // returned. Returns 0 on success.
-extern int inst_scan_image(struct inst * const insts, uint count,
-                           uint8 * const image, uint size);
+extern int64 inst_scan_image(struct inst * const insts, uint64 count,
+                             const uint8 *image, uint64 size);
 
 #endif /* INST_H */
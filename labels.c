@@ -0,0 +1,58 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "labels.h"
+
+int label_index_init(struct label_index *index, struct bitmap *labels)
+{
+	uint64 i;
+	int64 bit;
+
+	assert(index != NULL && labels != NULL);
+
+	index->labels  = labels;
+	index->offsets = NULL;
+	index->count   = 0;
+
+	if (bitmap_build_ranks(labels) < 0) {
+		fprintf(stderr, "failed to build label rank directory\n");
+		return -3;
+	}
+
+	index->count = bitmap_count(labels);
+	if (index->count == 0) return 0;
+
+	index->offsets = malloc(index->count * sizeof(*index->offsets));
+	if (!index->offsets) {
+		fprintf(stderr, "failed to allocate label offsets\n");
+		index->count = 0;
+		return -3;
+	}
+
+	bit = bitmap_find_next_set(labels, 0);
+	for (i = 0; bit >= 0; ++i) {
+		index->offsets[i] = bit;
+		bit = bitmap_find_next_set(labels, bit + 1);
+	}
+
+	assert(i == index->count);
+
+	return 0;
+}
+
+void label_index_free(struct label_index *index)
+{
+	free(index->offsets);
+	index->offsets = NULL;
+	index->count   = 0;
+}
+
+int64 label_index_ordinal(const struct label_index *index, uint64 offset)
+{
+	assert(index != NULL && index->labels != NULL);
+
+	if (bitmap_get_bit(index->labels, offset) <= 0) return -1;
+
+	return bitmap_rank(index->labels, offset);
+}
@@ -0,0 +1,33 @@
+#if !defined LABELS_H
+#define LABELS_H
+
+#include "common.h"
+#include "bitmap.h"
+
+// Index over a label bitmap: sorted label offsets and label ordinals
+// (number of labels before given offset) without rescanning the bitmap.
+struct label_index
+{
+	struct bitmap *labels;
+	uint64        *offsets;
+	uint64         count;
+};
+
+// Builds index over 'labels'. The bitmap must outlive the index and must not
+// be modified while index is in use. Returns 0 on success and negative value
+// if error occurred.
+extern int  label_index_init(struct label_index *index, struct bitmap *labels);
+extern void label_index_free(struct label_index *index);
+
+// Returns ordinal of label at 'offset' or -1 if there is no label there.
+extern int64 label_index_ordinal(const struct label_index *index,
+                                 uint64 offset);
+
+// Returns offset of label with ordinal 'n' or -1 if there is no such label.
+static inline int64 label_index_offset(const struct label_index *index,
+                                       uint64 n)
+{
+	return (n < index->count) ? (int64)index->offsets[n] : -1;
+}
+
+#endif /* LABELS_H */
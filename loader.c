@@ -0,0 +1,409 @@
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "loader.h"
+
+// largest single read, io_uring and read() both cap a request near 2 GiB
+#define READ_CHUNK (1 << 30)
+
+// File being read through io_uring
+struct pending
+{
+	int                 fd;
+	uint64              done;   // bytes read so far
+	struct loaded_image image;
+};
+
+static void *uring_reader(void *arg);
+static void *thread_reader(void *arg);
+
+// Takes a slot and the next path index. Waits for a free slot if 'block' is
+// set. Returns 0 on success, 1 if all paths are taken and -1 if no slot is
+// free.
+static int  take_path(struct loader *loader, bool block, uint64 *index);
+static void push_image(struct loader *loader, struct loaded_image *image);
+static void reader_done(struct loader *loader);
+
+// Opens file of 'image' and allocates its buffer. Returns file descriptor or
+// -1 with 'image->err' set. Empty files are complete, no descriptor is
+// returned for them.
+static int  open_image(struct loader *loader, struct loaded_image *image);
+
+// Reads rest of the file with blocking calls.
+static void read_rest(int fd, struct loaded_image *image, uint64 done);
+
+// Queues read of the remaining part of 'pending'. Returns 0 on success and
+// -1 if no submission entry could be freed.
+static int  submit_read(struct uring *ring, struct pending *pending,
+                        uint slot);
+
+int loader_start(struct loader *loader, char **paths, uint64 count,
+                 bool threads_only)
+{
+	uint i, threads;
+	void *(*reader)(void *);
+
+	assert(loader != NULL);
+
+	memset(loader, 0, sizeof(*loader));
+	loader->paths = paths;
+	loader->count = count;
+
+	loader->ring.fd = -1;
+	if (!threads_only && uring_init(&loader->ring, LOADER_DEPTH) == 0) {
+		loader->uring = true;
+	}
+
+	// io_uring keeps all reads in flight from one thread
+	reader  = loader->uring ? uring_reader : thread_reader;
+	threads = loader->uring ? 1 : LOADER_THREADS;
+
+	pthread_mutex_init(&loader->lock, NULL);
+	pthread_cond_init(&loader->ready, NULL);
+	pthread_cond_init(&loader->space, NULL);
+
+	for (i = 0; i < threads; ++i) {
+		// counted before the thread starts, a reader may finish before
+		// pthread_create() returns
+		pthread_mutex_lock(&loader->lock);
+		++loader->running;
+		pthread_mutex_unlock(&loader->lock);
+
+		if (pthread_create(loader->threads + i, NULL, reader,
+		                   loader) != 0) {
+			fprintf(stderr, "failed to create reader thread\n");
+			reader_done(loader);
+			break;
+		}
+
+		++loader->thread_count;
+	}
+
+	if (loader->thread_count == 0) {
+		loader_stop(loader);
+		return -1;
+	}
+
+	return 0;
+}
+
+int loader_next(struct loader *loader, struct loaded_image *image)
+{
+	pthread_mutex_lock(&loader->lock);
+
+	while (loader->queued == 0 && loader->running > 0) {
+		pthread_cond_wait(&loader->ready, &loader->lock);
+	}
+
+	if (loader->queued == 0) {
+		pthread_mutex_unlock(&loader->lock);
+		return 1;
+	}
+
+	*image = loader->queue[loader->head];
+	loader->head = (loader->head + 1) % LOADER_SLOTS;
+	--loader->queued;
+
+	pthread_mutex_unlock(&loader->lock);
+
+	return 0;
+}
+
+void loader_release(struct loader *loader, struct loaded_image *image)
+{
+	free(image->data);
+	image->data = NULL;
+
+	pthread_mutex_lock(&loader->lock);
+	--loader->slots;
+	pthread_cond_signal(&loader->space);
+	pthread_mutex_unlock(&loader->lock);
+}
+
+void loader_stop(struct loader *loader)
+{
+	uint i;
+
+	for (i = 0; i < loader->thread_count; ++i) {
+		pthread_join(loader->threads[i], NULL);
+	}
+
+	if (loader->uring) uring_free(&loader->ring);
+
+	pthread_cond_destroy(&loader->space);
+	pthread_cond_destroy(&loader->ready);
+	pthread_mutex_destroy(&loader->lock);
+}
+
+void *uring_reader(void *arg)
+{
+	int rc, res;
+	uint i, slot, inflight = 0, free_count = LOADER_DEPTH;
+	uint free_slots[LOADER_DEPTH];
+	bool sync = false, taken = false;
+	uint64 index;
+
+	struct loader *loader = arg;
+	struct uring *ring = &loader->ring;
+	struct pending pending[LOADER_DEPTH];
+	struct pending *p;
+	struct io_uring_cqe *cqe;
+
+	for (i = 0; i < LOADER_DEPTH; ++i) free_slots[i] = i;
+
+	for (;;) {
+		// open files while there are free slots, wait for one only if
+		// nothing is in flight
+		while (!taken && inflight < LOADER_DEPTH) {
+			rc = take_path(loader, inflight == 0, &index);
+			if (rc < 0) break;
+			if (rc > 0) {
+				taken = true;
+				break;
+			}
+
+			slot = free_slots[--free_count];
+			p    = pending + slot;
+
+			memset(p, 0, sizeof(*p));
+			p->image.index = index;
+			p->fd = open_image(loader, &p->image);
+
+			// a full ring is read around synchronously
+			if (p->fd < 0 || sync || submit_read(ring, p, slot) < 0) {
+				if (p->fd >= 0) {
+					read_rest(p->fd, &p->image, 0);
+					close(p->fd);
+				}
+
+				push_image(loader, &p->image);
+				free_slots[free_count++] = slot;
+				continue;
+			}
+
+			++inflight;
+		}
+
+		if (inflight == 0) {
+			if (taken) break;
+			continue;
+		}
+
+		// a busy ring keeps unsubmitted entries for the next call
+		rc = uring_submit(ring, 1);
+		assert(rc == 0 || rc == -EAGAIN || rc == -EBUSY);
+
+		while ((cqe = uring_peek_cqe(ring))) {
+			slot = cqe->user_data;
+			res  = cqe->res;
+			uring_cqe_seen(ring);
+
+			p = pending + slot;
+
+			if ((res == -EINTR || res == -EAGAIN) &&
+			    submit_read(ring, p, slot) == 0) {
+				continue;
+			}
+
+			// kernels before 5.6 don't know IORING_OP_READ, the
+			// rest is read synchronously then, as it is when the
+			// read can't be queued again
+			if (res == -EINVAL || res == -EOPNOTSUPP) {
+				sync = true;
+				read_rest(p->fd, &p->image, p->done);
+			} else if (res == -EINTR || res == -EAGAIN) {
+				read_rest(p->fd, &p->image, p->done);
+			} else if (res < 0) {
+				free(p->image.data);
+				p->image.data = NULL;
+				p->image.err  = -res;
+			} else if (res == 0) {
+				// file was truncated after fstat()
+				p->image.size = p->done;
+			} else {
+				p->done += res;
+				if (p->done < p->image.size &&
+				    submit_read(ring, p, slot) == 0) {
+					continue;
+				}
+
+				if (p->done < p->image.size) {
+					read_rest(p->fd, &p->image, p->done);
+				}
+			}
+
+			close(p->fd);
+			push_image(loader, &p->image);
+			free_slots[free_count++] = slot;
+			--inflight;
+		}
+	}
+
+	reader_done(loader);
+
+	return NULL;
+}
+
+void *thread_reader(void *arg)
+{
+	int fd;
+	uint64 index;
+	struct loader *loader = arg;
+	struct loaded_image image;
+
+	while (take_path(loader, true, &index) == 0) {
+		memset(&image, 0, sizeof(image));
+		image.index = index;
+
+		fd = open_image(loader, &image);
+		if (fd >= 0) {
+			read_rest(fd, &image, 0);
+			close(fd);
+		}
+
+		push_image(loader, &image);
+	}
+
+	reader_done(loader);
+
+	return NULL;
+}
+
+int take_path(struct loader *loader, bool block, uint64 *index)
+{
+	int rc = 0;
+
+	pthread_mutex_lock(&loader->lock);
+
+	while (block && loader->slots == LOADER_SLOTS &&
+	       loader->next < loader->count) {
+		pthread_cond_wait(&loader->space, &loader->lock);
+	}
+
+	if (loader->next >= loader->count) {
+		rc = 1;
+	} else if (loader->slots == LOADER_SLOTS) {
+		rc = -1;
+	} else {
+		*index = loader->next++;
+		++loader->slots;
+	}
+
+	pthread_mutex_unlock(&loader->lock);
+
+	return rc;
+}
+
+void push_image(struct loader *loader, struct loaded_image *image)
+{
+	pthread_mutex_lock(&loader->lock);
+
+	loader->queue[(loader->head + loader->queued) % LOADER_SLOTS] = *image;
+	++loader->queued;
+	pthread_cond_signal(&loader->ready);
+
+	pthread_mutex_unlock(&loader->lock);
+}
+
+void reader_done(struct loader *loader)
+{
+	pthread_mutex_lock(&loader->lock);
+
+	--loader->running;
+	pthread_cond_broadcast(&loader->ready);
+
+	pthread_mutex_unlock(&loader->lock);
+}
+
+int open_image(struct loader *loader, struct loaded_image *image)
+{
+	int fd;
+	struct stat st;
+
+	fd = open(loader->paths[image->index], O_RDONLY);
+	if (fd < 0) {
+		image->err = errno;
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		image->err = errno;
+		goto close_and_exit;
+	}
+
+	if (st.st_size == 0) goto close_and_exit;
+
+	image->data = malloc(st.st_size);
+	if (!image->data) {
+		image->err = ENOMEM;
+		goto close_and_exit;
+	}
+
+	image->size = st.st_size;
+
+	return fd;
+
+close_and_exit:
+	close(fd);
+
+	return -1;
+}
+
+void read_rest(int fd, struct loaded_image *image, uint64 done)
+{
+	ssize_t n;
+	uint64 len;
+
+	while (done < image->size) {
+		len = image->size - done;
+		if (len > READ_CHUNK) len = READ_CHUNK;
+
+		n = pread(fd, image->data + done, len, done);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) {
+			image->err = errno;
+			free(image->data);
+			image->data = NULL;
+			return;
+		}
+
+		if (n == 0) break;
+		done += n;
+	}
+
+	image->size = done;
+}
+
+int submit_read(struct uring *ring, struct pending *pending, uint slot)
+{
+	struct io_uring_sqe *sqe;
+	uint64 len = pending->image.size - pending->done;
+
+	if (len > READ_CHUNK) len = READ_CHUNK;
+
+	// there are never more reads than ring entries, but entries the
+	// kernel hasn't taken yet still occupy the queue
+	sqe = uring_get_sqe(ring);
+	if (!sqe) {
+		uring_submit(ring, 0);
+		sqe = uring_get_sqe(ring);
+	}
+
+	if (!sqe) return -1;
+
+	sqe->opcode    = IORING_OP_READ;
+	sqe->fd        = pending->fd;
+	sqe->addr      = (uint64)(uintptr_t)(pending->image.data +
+	                                     pending->done);
+	sqe->len       = len;
+	sqe->off       = pending->done;
+	sqe->user_data = slot;
+
+	return 0;
+}
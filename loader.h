@@ -0,0 +1,69 @@
+#if !defined LOADER_H
+#define LOADER_H
+
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "common.h"
+#include "uring.h"
+
+// images loaded or being loaded at once, bounds memory of a batch
+#define LOADER_SLOTS   64
+// reads in flight on io_uring
+#define LOADER_DEPTH   32
+// reader threads of the fallback
+#define LOADER_THREADS 4
+
+// Image read into memory. On error 'data' is NULL and 'err' is errno.
+struct loaded_image
+{
+	uint64 index;  // index in the path list
+	uint8 *data;
+	uint64 size;
+	int    err;
+};
+
+// Reads files of a path list in the background: through io_uring if the
+// kernel allows it and on reader threads otherwise. Images are handed out in
+// order of completion.
+struct loader
+{
+	char          **paths;
+	uint64          count;
+
+	pthread_mutex_t lock;
+	pthread_cond_t  ready;  // image queued or loading finished
+	pthread_cond_t  space;  // slot released
+
+	// completed images
+	struct loaded_image queue[LOADER_SLOTS];
+	uint            head;
+	uint            queued;
+
+	uint            slots;     // images loading, queued or being decoded
+	uint64          next;      // next path to load
+	uint            running;   // reader threads that haven't finished
+
+	bool            uring;     // 'ring' is used instead of reader threads
+	struct uring    ring;
+	pthread_t       threads[LOADER_THREADS];
+	uint            thread_count;
+};
+
+// Starts loading 'count' files of 'paths'. io_uring isn't tried if
+// 'threads_only' is set. Returns 0 on success and negative value if error
+// occurred.
+extern int  loader_start(struct loader *loader, char **paths, uint64 count,
+                         bool threads_only);
+
+// Waits for the next loaded image. Returns 0 if 'image' is set and 1 when
+// all images were handed out.
+extern int  loader_next(struct loader *loader, struct loaded_image *image);
+
+// Frees image data and lets the loader read the next file.
+extern void loader_release(struct loader *loader, struct loaded_image *image);
+
+// Waits for reader threads. All images must be taken and released.
+extern void loader_stop(struct loader *loader);
+
+#endif /* LOADER_H */
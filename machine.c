@@ -0,0 +1,285 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "decoder.h"
+#include "machine.h"
+#include "profile.h"
+#include "threaded.h"
+
+// Returns valid block starting at cs:ip, building it if it isn't cached.
+// Returns NULL if the first instruction couldn't be decoded.
+static struct block *lookup_block(struct machine *machine, uint16 cs,
+                                  uint16 ip);
+
+// Decodes instructions at cs:ip into 'block'. Returns 0 on success and
+// negative value if the first instruction couldn't be decoded.
+static int build_block(struct machine *machine, struct block *block,
+                       uint16 cs, uint16 ip);
+
+// Decodes instruction at linear address 'addr' folding its prefixes in.
+// Returns 0 on success and negative value if error occurred.
+static int decode_op(struct machine *machine, struct block_op *op,
+                     uint32 addr);
+
+static inline uint32 block_key(uint16 cs, uint16 ip)
+{
+	return ((uint32)cs << 16) | ip;
+}
+
+// Code pages didn't change since the block was built
+static inline bool block_valid(struct machine *machine, struct block *block)
+{
+	return machine->code_gens[block->pages[0]] == block->gens[0] &&
+	       machine->code_gens[block->pages[1]] == block->gens[1];
+}
+
+// Control transfers and instructions that change cs end a block, so every
+// instruction of a block is at cs:ip of the block start plus its length.
+static inline bool ends_block(const struct inst *inst)
+{
+	uint8 sr = FIELD_SR(inst->fields);
+
+	if (inst->base.prefixes & (PFX_REP | PFX_REPNE)) return true;
+	if (inst->base.type >= INST_JA && inst->base.type <= INST_JS) {
+		return true;
+	}
+
+	switch (inst->base.type) {
+	case INST_CALL:
+	case INST_CALLF:
+	case INST_RET:
+	case INST_RETF:
+	case INST_LOOP:
+	case INST_LOOPZ:
+	case INST_LOOPNZ:
+	case INST_INT:
+	case INST_INT3:
+	case INST_INTO:
+	case INST_IRET:
+	case INST_HLT:
+	case INST_UNK:
+		return true;
+	case INST_MOV:
+		return inst->base.fmt == INST_FMT_RM_SR &&
+		       (inst->base.flags & F_D) && sr == 1;
+	case INST_POP:
+		return inst->base.fmt == INST_FMT_SR && sr == 1;
+	default:
+		return false;
+	}
+}
+
+int machine_init(struct machine *machine)
+{
+	assert(machine != NULL);
+
+	memset(machine, 0, sizeof(*machine));
+
+	if (executor_init_state(&machine->state) < 0) return -1;
+
+	// empty slots have zero count
+	machine->blocks = calloc(BLOCK_CACHE_SIZE, sizeof(*machine->blocks));
+	if (!machine->blocks) {
+		fprintf(stderr, "failed to allocate block cache\n");
+		executor_free_state(&machine->state);
+		return -1;
+	}
+
+	machine->state.code_pages = machine->code_pages;
+	machine->state.code_gens  = machine->code_gens;
+
+	return 0;
+}
+
+void machine_free(struct machine *machine)
+{
+	free(machine->blocks);
+	machine->blocks = NULL;
+
+	executor_free_state(&machine->state);
+}
+
+int machine_load(struct machine *machine, const uint8 *image, uint64 size)
+{
+	if (size > MEMORY_SIZE) {
+		fprintf(stderr, "image doesn't fit into memory (size: %" PRIu64
+		        ")\n", size);
+		return -1;
+	}
+
+	if (size > 0) memcpy(machine->state.memory, image, size);
+
+	return 0;
+}
+
+int machine_run(struct machine *machine, uint32 end)
+{
+	int rc = 0;
+	uint32 key;
+	struct cpu_state *state = &machine->state;
+	struct block *block = NULL, *next;
+
+	PROF_BEGIN(run, "machine_run");
+
+	machine->end = end;
+
+	for (;;) {
+		if (linear_addr(state->cs, state->ip) >= end) break;
+
+		// follow the chain while successors stay the same, the cache
+		// is only consulted for new or changed targets
+		key  = block_key(state->cs, state->ip);
+		next = NULL;
+
+		if (block) {
+			if (block->next[0] && block->next[0]->key == key) {
+				next = block->next[0];
+			} else if (block->next[1] &&
+			           block->next[1]->key == key) {
+				next = block->next[1];
+			}
+
+			if (next && next->count && block_valid(machine, next)) {
+				++machine->chained;
+			} else {
+				next = NULL;
+			}
+		}
+
+		if (!next) {
+			next = lookup_block(machine, state->cs, state->ip);
+			if (!next) {
+				rc = -1;
+				break;
+			}
+
+			if (block) block->next[block->next[0] ? 1 : 0] = next;
+		}
+
+		block = next;
+
+		rc = threaded_run(machine, block);
+		if (rc == EXEC_HALT) {
+			rc = 0;
+			break;
+		}
+
+		if (rc < 0) break;
+	}
+
+	PROF_END(run);
+
+	return rc;
+}
+
+struct block *lookup_block(struct machine *machine, uint16 cs, uint16 ip)
+{
+	uint32 key = block_key(cs, ip);
+	struct block *block;
+
+	// Fibonacci hashing spreads nearby addresses and segments
+	block = machine->blocks +
+	        ((key * 2654435769u) >> (32 - BLOCK_CACHE_BITS));
+
+	if (block->count && block->key == key && block_valid(machine, block)) {
+		return block;
+	}
+
+	if (build_block(machine, block, cs, ip) < 0) return NULL;
+
+	return block;
+}
+
+int build_block(struct machine *machine, struct block *block, uint16 cs,
+                uint16 ip)
+{
+	uint16 at = ip;
+	uint32 addr, first, last;
+	struct block_op *op;
+
+	block->count   = 0;
+	block->next[0] = NULL;
+	block->next[1] = NULL;
+
+	first = linear_addr(cs, ip) >> CODE_PAGE_BITS;
+	last  = first;
+
+	while (block->count < BLOCK_MAX_OPS) {
+		addr = linear_addr(cs, at);
+		if (addr >= machine->end && block->count > 0) break;
+
+		// keep blocks within two pages
+		if ((addr >> CODE_PAGE_BITS) != first &&
+		    (addr >> CODE_PAGE_BITS) != ((first + 1) %
+		                                 CODE_PAGE_COUNT)) {
+			break;
+		}
+
+		op = block->ops + block->count;
+		if (decode_op(machine, op, addr) < 0) {
+			if (block->count == 0) return -1;
+			break;
+		}
+
+		last = ((addr + op->len - 1) & MEMORY_MASK) >> CODE_PAGE_BITS;
+		if (last != first && last != (first + 1) % CODE_PAGE_COUNT) {
+			break;
+		}
+
+		threaded_translate(&machine->state, op);
+
+		++block->count;
+		++machine->decoded;
+		at += op->len;
+
+		if (ends_block(&op->inst)) break;
+	}
+
+	if (block->count == 0) return -1;
+
+	threaded_fuse(block);
+
+	op = block->ops + block->count;
+	op->kind = OP_END;
+	op->len  = 0;
+
+	last = ((linear_addr(cs, at) - 1) & MEMORY_MASK) >> CODE_PAGE_BITS;
+
+	block->key      = block_key(cs, ip);
+	block->pages[0] = first;
+	block->pages[1] = last;
+	block->gens[0]  = machine->code_gens[first];
+	block->gens[1]  = machine->code_gens[last];
+
+	machine->code_pages[first] = 1;
+	machine->code_pages[last]  = 1;
+	++machine->built;
+
+	return 0;
+}
+
+int decode_op(struct machine *machine, struct block_op *op, uint32 addr)
+{
+	uint8 prefixes = 0;
+	uint32 at = addr;
+
+	// prefixes are folded into the instruction they precede
+	do {
+		if (get_inst_data(&op->inst, machine->state.memory,
+		                  MEMORY_SIZE, at) < 0) {
+			return -1;
+		}
+
+		at += op->inst.base.size;
+		inst_apply_prefixes(&op->inst, &prefixes);
+	} while (decode_joins_next(&op->inst) &&
+	         at - addr < UINT8_MAX - INST_MAX_SIZE);
+
+	op->len         = at - addr;
+	op->inst.offset = addr;
+
+	return 0;
+}
@@ -0,0 +1,76 @@
+#if !defined MACHINE_H
+#define MACHINE_H
+
+#include "common.h"
+#include "executor.h"
+#include "inst.h"
+#include "threaded.h"
+
+// direct-mapped block cache keyed by cs:ip
+#define BLOCK_CACHE_BITS 12
+#define BLOCK_CACHE_SIZE (1 << BLOCK_CACHE_BITS)
+#define BLOCK_CACHE_MASK (BLOCK_CACHE_SIZE - 1)
+
+// longest block, a block also ends at control transfers and rep prefixes
+#define BLOCK_MAX_OPS 16
+
+// Instruction of a block with prefixes applied and its handler, see
+// threaded.h
+struct block_op
+{
+	uint8       kind;  // enum op_kind
+	uint8       len;   // prefixes included
+	uint16      imm;   // immediate or jump displacement
+	void       *dst;   // register operands
+	void       *src;
+	struct inst inst;
+};
+
+// Straight-line run of instructions starting at cs:ip 'key'. A block spans
+// at most two code pages, it's valid while their generations match 'gens'.
+struct block
+{
+	uint32 key;
+	uint32 pages[2];
+	uint16 gens[2];
+	uint16 count;  // 0 if slot is empty
+
+	// successors seen so far, checked by key before use
+	struct block *next[2];
+
+	// followed by OP_END
+	struct block_op ops[BLOCK_MAX_OPS + 1];
+};
+
+// Executes instructions from emulated memory following cs:ip
+struct machine
+{
+	struct cpu_state state;
+	struct block    *blocks;
+	uint32           end;  // execution stops at this linear address
+
+	uint8            code_pages[CODE_PAGE_COUNT];
+	uint16           code_gens[CODE_PAGE_COUNT];
+
+	uint64 steps;    // executed instructions
+	uint64 decoded;  // instructions decoded into blocks
+	uint64 built;    // blocks built, rebuilt ones included
+	uint64 chained;  // block transitions that skipped the cache lookup
+	uint64 fused[FUSE_COUNT];  // executed fused pairs and loop restarts
+};
+
+// Allocates memory and block cache. Returns 0 on success and negative value
+// if error occurred.
+extern int  machine_init(struct machine *machine);
+extern void machine_free(struct machine *machine);
+
+// Copies 'image' to address 0, execution starts at 0000:0000. Returns 0 on
+// success and negative value if image doesn't fit into memory.
+extern int  machine_load(struct machine *machine, const uint8 *image,
+                         uint64 size);
+
+// Runs until hlt or until cs:ip leaves [0, 'end'). Returns 0 on success and
+// negative value if instruction couldn't be decoded or executed.
+extern int  machine_run(struct machine *machine, uint32 end);
+
+#endif /* MACHINE_H */
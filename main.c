@@ -1,126 +1,843 @@
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-#include "inst.h"
+#include "batch.h"
+#include "bitmap.h"
+#include "cache.h"
 #include "decoder.h"
+#include "encoder.h"
 #include "executor.h"
+#include "flags.h"
+#include "format.h"
+#include "image.h"
+#include "inst.h"
+#include "labels.h"
+#include "machine.h"
+#include "outbuf.h"
+#include "parallel.h"
+#include "pool.h"
+#include "profile.h"
+#include "store.h"
+#include "stream.h"
+
+#define FLAG_EXEC   "-i"
+#define FLAG_RUN    "-r"
+#define FLAG_COUNT  "-c"
+#define FLAG_VERIFY "-V"
+#define FLAG_LOWMEM "-l"
+#define FLAG_STORE  "-S"
+#define FLAG_JOBS   "-j"
+#define FLAG_WINDOW "-w"
+#define FLAG_CACHE  "-C"
+#define FLAG_MEMO   "-m"
+#define FLAG_PROF   "--profile"
+#define FLAG_BATCH  "-B"
+#define FLAG_OUTDIR "-o"
+#define FLAG_THREAD "-T"
+#define FILE_STDIN  "-"
+
+struct options
+{
+	char  *path;
+	bool   exec;
+	bool   run;
+	bool   count;
+	bool   verify;
+	bool   lowmem;
+	bool   store;
+	long   jobs;
+	uint64 window;
+	char  *cache_dir;
+	bool   memo;
+	bool   profile;
+};
+
+// Context of print_inst()
+struct printer
+{
+	struct outbuf     out;
+	struct cpu_state *state; // NULL unless instructions are executed
+
+	// formatted text cache, image is NULL when reading standard input
+	struct decode_memo *memo;
+	const uint8        *image;
 
-#define FLAG_EXEC "-i"
+	// labels are named by ordinal if set, by offset otherwise
+	const struct label_index *labels;
+};
 
 void usage(char *argv[])
 {
-	fprintf(stderr, "Usage: %s <assembled-file> [-i]\n"
-	        "\t-i\texecute instuctions\n", argv[0]);
+	fprintf(stderr, "Usage: %s <assembled-file|-> [-i] [-r] [-c] [-V] [-l] "
+	        "[-S] "
+	        "[-j <threads>] [-w <bytes>] [-C <dir>] [-m] [--profile]\n"
+	        "\t-\tdecode from standard input\n"
+	        "\t-i\texecute instuctions\n"
+	        "\t-r\trun image from 0000:0000 following ip, print final "
+	        "state\n"
+	        "\t-c\tprint instruction count only\n"
+	        "\t-V\tre-encode decoded instructions and compare with "
+	        "image\n"
+	        "\t-l\tlow memory mode (don't keep decoded instructions)\n"
+	        "\t-S\tkeep decoded instructions in compact store\n"
+	        "\t-j\tdecode and format on several threads (0: one per "
+	        "CPU)\n"
+	        "\t-w\tlabel window for standard input (default: %d)\n"
+	        "\t-C\tcache decoded instructions in directory\n"
+	        "\t-m\treuse text of repeated instructions, print hit "
+	        "rate\n"
+	        "\t--profile\tprint time spent in annotated blocks "
+	        "(make PROFILE=1)\n"
+	        "       %s -B [-j <threads>] [-o <dir>] [-T] "
+	        "<assembled-file...|->\n"
+	        "\t-B\tdecode many images, '-' reads file list from standard "
+	        "input\n"
+	        "\t-o\twrite listing of each image into "
+	        "<dir>/<index>-<name>.asm\n\t\tinstead of framed stream on "
+	        "standard output\n"
+	        "\t-T\tread files on threads instead of io_uring\n",
+	        argv[0], STREAM_WINDOW, argv[0]);
 }
 
+// Writes instruction into output buffer of 'ctx' (struct printer) and
+// executes it if cpu state is set. Returns 0 on success and non-zero value if
+// an error occurred.
+static int print_inst(struct inst *inst, void *ctx);
+
+// length of a line written by print_regs()
+#define STATE_LINE_SIZE (6 + 3 * 5 + 4 * 4 + 1)
+
+// Writes one line of cpu state dump into 'p'. Returns pointer past the last
+// written byte.
+static char *print_regs(char *p, const char *n1, uint16 r1, const char *n2,
+                        uint16 r2, const char *n3, uint16 r3, const char *n4,
+                        uint16 r4);
+
+// Decodes image at 'path', encodes every instruction back and compares it with
+// the image. Prints summary. Returns 0 if every instruction matched and
+// negative value otherwise.
+static int verify_insts(const char *path);
+
+// Loads image at 'path' into emulated memory and runs it until hlt or until
+// ip leaves the image. Prints final cpu state. Returns 0 on success and
+// negative value otherwise.
+static int run_image(const char *path);
+
+// Prints hit rate of the text cache into stderr.
+static void print_memo_stats(struct decode_memo *memo);
+
+// Prints instruction count of image at 'path' using length-only scan.
+// Returns 0 on success and negative value if an error occurred.
+static int count_insts(const char *path);
+
+// Batch mode: parses batch arguments, decodes every listed image and prints
+// number of failed ones. Returns 0 if all images were decoded and negative
+// value otherwise.
+static int run_batch(int argc, char *argv[]);
+
+// Reads newline separated paths from standard input into '*paths'. Returns
+// path count or negative value if an error occurred.
+static int64 read_manifest(char ***paths);
+
+// Decoding modes. Return 0 on success and negative value if an error
+// occurred.
+static int decode_stdin(struct options *opts, struct printer *printer);
+static int decode_lowmem(struct image *image, struct printer *printer);
+static int decode_store(struct image *image, struct printer *printer);
+static int decode_arena(struct image *image, struct options *opts,
+                        struct printer *printer);
+static int decode_cached(struct image *image, struct options *opts,
+                         struct printer *printer);
+
 int main(int argc, char *argv[])
 {
 	int i, rc = 0;
-	uint nread, size = 0;
-
-	FILE *file   = NULL;
-	uint8 *image = NULL;
+	bool from_stdin;
+	char *end = NULL;
 
-	uint offset = 0;
-	int inst_count = 0;
-	struct inst *insts = NULL;
+	struct options opts;
+	struct image image;
 	struct cpu_state state;
+	struct printer printer;
+	struct decode_memo memo;
 
 	if (argc < 2) {
 		usage(argv);
 		return 1;
 	}
 
-	if (argc == 3 && strcmp(argv[2], FLAG_EXEC)) {
+	prof_start();
+
+	if (!strcmp(argv[1], FLAG_BATCH)) return run_batch(argc, argv);
+
+	memset(&opts, 0, sizeof(opts));
+	opts.path   = argv[1];
+	opts.jobs   = 1;
+	opts.window = STREAM_WINDOW;
+
+	for (i = 2; i < argc; ++i) {
+		if (!strcmp(argv[i], FLAG_EXEC)) {
+			opts.exec = true;
+		} else if (!strcmp(argv[i], FLAG_RUN)) {
+			opts.run = true;
+		} else if (!strcmp(argv[i], FLAG_COUNT)) {
+			opts.count = true;
+		} else if (!strcmp(argv[i], FLAG_VERIFY)) {
+			opts.verify = true;
+		} else if (!strcmp(argv[i], FLAG_LOWMEM)) {
+			opts.lowmem = true;
+		} else if (!strcmp(argv[i], FLAG_STORE)) {
+			opts.store = true;
+		} else if (!strcmp(argv[i], FLAG_JOBS) && i + 1 < argc) {
+			opts.jobs = strtol(argv[++i], &end, 0);
+			if (*end != '\0' || opts.jobs < 0) {
+				usage(argv);
+				return 2;
+			}
+		} else if (!strcmp(argv[i], FLAG_PROF)) {
+			opts.profile = true;
+		} else if (!strcmp(argv[i], FLAG_MEMO)) {
+			opts.memo = true;
+		} else if (!strcmp(argv[i], FLAG_CACHE) && i + 1 < argc) {
+			opts.cache_dir = argv[++i];
+		} else if (!strcmp(argv[i], FLAG_WINDOW) && i + 1 < argc) {
+			opts.window = strtoull(argv[++i], &end, 0);
+			if (*end != '\0' || opts.window == 0) {
+				usage(argv);
+				return 2;
+			}
+		} else {
+			usage(argv);
+			return 2;
+		}
+	}
+
+#if !defined PROFILE
+	if (opts.profile) {
+		fprintf(stderr, "profiling isn't compiled in, rebuild with "
+		        "'make PROFILE=1'\n");
+	}
+#endif
+
+	if (opts.count || opts.verify || opts.run) {
+		if (!strcmp(opts.path, FILE_STDIN)) {
+			usage(argv);
+			return 2;
+		}
+
+		if (opts.count) {
+			rc = count_insts(opts.path);
+		} else if (opts.run) {
+			rc = run_image(opts.path);
+		} else {
+			rc = verify_insts(opts.path);
+		}
+
+		if (opts.profile) prof_report();
+
+		return rc;
+	}
+
+	printer.state = NULL;
+	if (opts.exec) {
+		if (executor_init_state(&state) < 0) return -1;
+		printer.state = &state;
+	}
+
+	printer.memo   = NULL;
+	printer.image  = NULL;
+	printer.labels = NULL;
+	if (opts.memo) {
+		if (decode_memo_init(&memo) < 0) return -1;
+		printer.memo = &memo;
+	}
+
+	if (outbuf_init(&printer.out, STDOUT_FILENO, OUTBUF_SIZE) < 0) {
+		return -1;
+	}
+
+	// map the image first, so nothing is printed for a file that can't be
+	// read
+	PROF_BEGIN(read, "image_map");
+	from_stdin = !strcmp(opts.path, FILE_STDIN);
+	if (!from_stdin && image_map(&image, opts.path) < 0) {
+		PROF_END(read);
+		rc = -1;
+		goto free_and_exit;
+	}
+	PROF_END(read);
+
+	outbuf_write(&printer.out, "; ", 2);
+	outbuf_write(&printer.out, opts.path, strlen(opts.path));
+	outbuf_write(&printer.out, "\nbits 16\n\n", 10);
+
+	if (from_stdin) {
+		rc = decode_stdin(&opts, &printer);
+	} else {
+		printer.image = image.data;
+
+		if (opts.lowmem) {
+			rc = decode_lowmem(&image, &printer);
+		} else if (opts.cache_dir) {
+			rc = decode_cached(&image, &opts, &printer);
+		} else if (opts.store) {
+			rc = decode_store(&image, &printer);
+		} else {
+			rc = decode_arena(&image, &opts, &printer);
+		}
+
+		image_unmap(&image);
+	}
+
+free_and_exit:
+	PROF_BEGIN(flush, "flush output");
+	if (outbuf_free(&printer.out) < 0 && rc == 0) rc = -8;
+	PROF_END(flush);
+
+	if (printer.state) executor_free_state(printer.state);
+
+	if (printer.memo) {
+		print_memo_stats(printer.memo);
+		decode_memo_free(printer.memo);
+	}
+
+	if (opts.profile) prof_report();
+
+	return rc;
+}
+
+int print_inst(struct inst *inst, void *ctx)
+{
+	int rc;
+	char *p;
+	struct printer *printer = ctx;
+	struct cpu_state *state = printer->state;
+
+	if (printer->memo) {
+		rc = decode_inst_memo(&printer->out, printer->memo, inst,
+		                      printer->image ?
+		                      printer->image + inst->offset : NULL,
+		                      printer->labels);
+	} else {
+		rc = decode_inst(&printer->out, inst, printer->labels);
+	}
+
+	if (rc < 0) {
+		fprintf(stderr, "failed to decode instruction "
+		                "(exit code %d)\n", rc);
+		return rc;
+	}
+
+	p = outbuf_reserve(&printer->out, 1 + 3 * STATE_LINE_SIZE);
+	if (!p) return -8;
+
+	p = decode_inst_end(p, inst);
+
+	if (state && !decode_joins_next(inst)) {
+		// listing order is followed, jumps only change ip
+		state->ip = inst->offset + inst->base.size;
+
+		rc = executor_exec(state, inst);
+		if (rc < 0) {
+			outbuf_commit(&printer->out, p);
+			fprintf(stderr, "can't execute instruction at offset %"
+			        PRIu64 " (exit code %d)\n", inst->offset, rc);
+			return rc;
+		}
+
+		p = print_regs(p, "; ax: ", state->ax, " cx: ", state->cx,
+		               " dx: ", state->dx, " bx: ", state->bx);
+		p = print_regs(p, "; sp: ", state->sp, " bp: ", state->bp,
+		               " si: ", state->si, " di: ", state->di);
+		p = print_regs(p, "; es: ", state->es, " cs: ", state->cs,
+		               " ss: ", state->ss, " ds: ", state->ds);
+	}
+
+	outbuf_commit(&printer->out, p);
+
+	return 0;
+}
+
+// "; ax: %04X cx: %04X dx: %04X bx: %04X\n", all names are 6 bytes with the
+// separators around them
+char *print_regs(char *p, const char *n1, uint16 r1, const char *n2,
+                 uint16 r2, const char *n3, uint16 r3, const char *n4,
+                 uint16 r4)
+{
+	p = fmt_hex16(fmt_str(p, n1, 6), r1);
+	p = fmt_hex16(fmt_str(p, n2, 5), r2);
+	p = fmt_hex16(fmt_str(p, n3, 5), r3);
+	p = fmt_hex16(fmt_str(p, n4, 5), r4);
+	*p++ = '\n';
+
+	return p;
+}
+
+void print_memo_stats(struct decode_memo *memo)
+{
+	uint64 total = memo->hits + memo->misses + memo->bypassed;
+
+	fprintf(stderr, "memo: %" PRIu64 " hits, %" PRIu64 " misses, "
+	        "%" PRIu64 " bypassed (%.1f%% hit rate)\n", memo->hits,
+	        memo->misses, memo->bypassed,
+	        total ? 100.0 * memo->hits / total : 0.0);
+}
+
+int run_batch(int argc, char *argv[])
+{
+	int i, rc = 0;
+	long jobs = 0;
+	char *end = NULL, *out_dir = NULL;
+	char **paths = NULL;
+	int64 count = 0, failed, j;
+	bool manifest = false, threads_only = false;
+	struct pool pool;
+
+	for (i = 2; i < argc; ++i) {
+		if (!strcmp(argv[i], FLAG_JOBS) && i + 1 < argc) {
+			jobs = strtol(argv[++i], &end, 0);
+			if (*end != '\0' || jobs < 0) {
+				usage(argv);
+				return 2;
+			}
+		} else if (!strcmp(argv[i], FLAG_OUTDIR) && i + 1 < argc) {
+			out_dir = argv[++i];
+		} else if (!strcmp(argv[i], FLAG_THREAD)) {
+			threads_only = true;
+		} else if (!strcmp(argv[i], FILE_STDIN)) {
+			manifest = true;
+		} else {
+			break;
+		}
+	}
+
+	// either a file list on standard input or paths in arguments
+	if (manifest == (i < argc)) {
 		usage(argv);
 		return 2;
 	}
 
-	file = fopen(argv[1], "rb");
-	if (!file) {
-		perror("failed to open file");
+	if (manifest) {
+		count = read_manifest(&paths);
+		if (count < 0) return -1;
+	} else {
+		paths = argv + i;
+		count = argc - i;
+	}
+
+	if (pool_init(&pool, jobs) < 0) {
+		rc = -1;
+		goto free_and_exit;
+	}
+
+	failed = batch_decode(paths, count, out_dir, STDOUT_FILENO, &pool,
+	                      threads_only);
+
+	pool_free(&pool);
+
+	if (failed < 0) {
+		fprintf(stderr, "failed to write output\n");
+		rc = -8;
+	} else if (failed > 0) {
+		fprintf(stderr, "%" PRIi64 " of %" PRIi64 " images failed\n",
+		        failed, count);
+		rc = -4;
+	}
+
+free_and_exit:
+	if (manifest) {
+		for (j = 0; j < count; ++j) free(paths[j]);
+		free(paths);
+	}
+
+	return rc;
+}
+
+int64 read_manifest(char ***paths)
+{
+	char *line = NULL;
+	char **grown;
+	size_t line_cap = 0;
+	ssize_t len;
+	int64 count = 0, cap = 0;
+
+	*paths = NULL;
+
+	while ((len = getline(&line, &line_cap, stdin)) >= 0) {
+		if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+		if (len == 0) continue;
+
+		if (count == cap) {
+			cap   = cap ? cap * 2 : 64;
+			grown = realloc(*paths, cap * sizeof(**paths));
+			if (!grown) goto fail;
+			*paths = grown;
+		}
+
+		(*paths)[count] = strdup(line);
+		if (!(*paths)[count]) goto fail;
+		++count;
+	}
+
+	free(line);
+
+	return count;
+
+fail:
+	fprintf(stderr, "failed to read file list: out of memory\n");
+
+	while (count > 0) free((*paths)[--count]);
+	free(*paths);
+	free(line);
+
+	return -1;
+}
+
+int run_image(const char *path)
+{
+	int rc;
+	uint i;
+	char *p, *name, names[16];
+	uint16 flags;
+	char line[3 * STATE_LINE_SIZE];
+	struct image image;
+	struct machine machine;
+	struct cpu_state *state = &machine.state;
+
+	if (image_map(&image, path) < 0) return -1;
+
+	if (machine_init(&machine) < 0) {
+		image_unmap(&image);
 		return -1;
 	}
 
-	fseek(file, 0, SEEK_END);
-	size = ftell(file);
-	rewind(file);
+	rc = machine_load(&machine, image.data, image.size);
+	if (rc == 0) rc = machine_run(&machine, image.size);
 
-	image = malloc(size);
-	if (!image) {
-		perror("failed to allocate buffer for image");
-		return -2;
+	p = print_regs(line, "; ax: ", state->ax, " cx: ", state->cx,
+	               " dx: ", state->dx, " bx: ", state->bx);
+	p = print_regs(p, "; sp: ", state->sp, " bp: ", state->bp,
+	               " si: ", state->si, " di: ", state->di);
+	p = print_regs(p, "; es: ", state->es, " cs: ", state->cs,
+	               " ss: ", state->ss, " ds: ", state->ds);
+
+	// set flags as letters, lowest bit first
+	flags = flags_get(state);
+	name  = names;
+	for (i = 0; i < 12; ++i) {
+		if (flags & (1 << i)) *name++ = "C?P?A?ZSTIDO"[i];
 	}
+	*name = '\0';
+
+	printf("; %s\n; %" PRIu64 " instructions executed, %" PRIu64
+	       " decoded, %" PRIu64 " blocks built, %" PRIu64 " chained\n",
+	       path, machine.steps, machine.decoded, machine.built,
+	       machine.chained);
 
-	nread = fread(image, 1, size, file);
-	if (nread != size) {
-		perror("failed to read from file");
-		return -3;
+	// executions of each fused handler
+	printf("; fused:");
+	for (i = 0; i < FUSE_COUNT; ++i) {
+		printf("%s %s %" PRIu64, i ? "," : "", threaded_fuse_name(i),
+		       machine.fused[i]);
 	}
 
-	fclose(file);
+	printf("\n%.*s; ip: %04X flags: %s\n", (int)(p - line), line,
+	       state->ip, names);
+
+	machine_free(&machine);
+	image_unmap(&image);
+
+	return rc;
+}
+
+int count_insts(const char *path)
+{
+	int64 inst_count;
+	struct image image;
+
+	if (image_map(&image, path) < 0) {
+		return -1;
+	}
+
+	inst_count = inst_scan_lengths(NULL, image.data, image.size);
+	image_unmap(&image);
 
-	inst_count = inst_scan_image(NULL, 0, image, size);
 	if (inst_count < 0) {
 		fprintf(stderr, "failed to scan image for instructions "
-		        "(exit code %d)\n", inst_count);
+		        "(exit code %" PRId64 ")\n", inst_count);
 		return -4;
 	}
 
-	insts = malloc(inst_count * sizeof(*insts));
-	if (!insts) {
-		perror("failed to allocate array for instructions");
+	printf("%" PRId64 "\n", inst_count);
+
+	return 0;
+}
+
+int verify_insts(const char *path)
+{
+	int rc = 0;
+	int64 inst_count;
+	uint64 i, counts[ENCODE_MISMATCH + 1] = { 0 };
+	enum encode_match match;
+	struct image image;
+	struct inst_arena arena;
+	struct inst_encoder enc;
+
+	if (image_map(&image, path) < 0) {
+		return -1;
+	}
+
+	inst_arena_init(&arena);
+	inst_encoder_init(&enc);
+
+	inst_count = inst_scan(&arena, image.data, image.size);
+	if (inst_count < 0) {
+		fprintf(stderr, "failed to scan image for instructions "
+		        "(exit code %" PRId64 ")\n", inst_count);
+		rc = -4;
+		goto free_and_exit;
+	}
+
+	PROF_BEGIN(verify, "verify");
+	for (i = 0; i < arena.count; ++i) {
+		match = inst_verify(&enc, arena.insts + i,
+		                    image.data + arena.insts[i].offset);
+		counts[match]++;
+
+		if (match == ENCODE_MISMATCH) {
+			fprintf(stderr, "instruction at offset %" PRIu64 " "
+			        "(opcode 0x%02X) doesn't encode back\n",
+			        arena.insts[i].offset,
+			        image.data[arena.insts[i].offset]);
+		}
+	}
+	PROF_END(verify);
+
+	printf("%" PRIu64 " instructions: %" PRIu64 " exact, %" PRIu64
+	       " alias encodings, %" PRIu64 " mismatches\n", arena.count,
+	       counts[ENCODE_EXACT], counts[ENCODE_ALIAS],
+	       counts[ENCODE_MISMATCH]);
+
+	if (counts[ENCODE_MISMATCH] > 0) rc = -9;
+
+free_and_exit:
+	inst_arena_free(&arena);
+	image_unmap(&image);
+
+	return rc;
+}
+
+int decode_stdin(struct options *opts, struct printer *printer)
+{
+	int64 inst_count;
+
+	inst_count = inst_scan_stream(STDIN_FILENO, opts->window, print_inst,
+	                              printer);
+	if (inst_count < 0) {
+		fprintf(stderr, "failed to decode input stream "
+		        "(exit code %" PRId64 ")\n", inst_count);
+		return -4;
+	}
+
+	return 0;
+}
+
+// Two passes over the image: mark labels, then decode and print each
+// instruction right away. All labels are known before printing, so they are
+// numbered in image order.
+int decode_lowmem(struct image *image, struct printer *printer)
+{
+	int64 inst_count;
+	struct bitmap labels;
+	struct label_index index;
+
+	if (image->size == 0) return 0;
+
+	if (bitmap_init(&labels, image->size) < 0) {
+		fprintf(stderr, "failed to initialize bitmap for labels\n");
 		return -5;
 	}
 
-	rc = inst_scan_image(insts, inst_count, image, size);
-	if (rc < 0) {
+	inst_count = inst_mark_labels(&labels, image->data, image->size);
+	if (inst_count >= 0) {
+		if (label_index_init(&index, &labels) < 0) {
+			bitmap_free(&labels);
+			return -5;
+		}
+
+		printer->labels = &index;
+		inst_count = inst_scan_each(&labels, image->data, image->size,
+		                            print_inst, printer);
+		printer->labels = NULL;
+
+		label_index_free(&index);
+	}
+
+	bitmap_free(&labels);
+
+	if (inst_count < 0) {
 		fprintf(stderr, "failed to scan image for instructions "
-		                "(exit code %d)\n", rc);
-		return -6;
+		        "(exit code %" PRId64 ")\n", inst_count);
+		return -4;
 	}
 
-	executor_init_state(&state);
+	return 0;
+}
+
+int decode_store(struct image *image, struct printer *printer)
+{
+	int rc = 0;
+	int64 inst_count;
+	uint64 i, offset = 0, operand = 0;
+	struct inst inst;
+	struct inst_store store;
 
-	fprintf(stdout, "; %s\nbits 16\n\n", argv[1]);
+	inst_store_init(&store);
 
-	for (i = 0, offset = 0;
-	     i < inst_count && offset < size;
-	     ++i, offset += insts[i].base.size) {
-		rc = decode_inst(stdout, insts + i);
-		if (rc < 0) {
-			fprintf(stderr, "failed to decode instruction "
-			                "(exit code %d)\n", rc);
-			return -7;
-		}
-
-		switch (insts[i].base.type) {
-		case INST_SGMNT:
-			continue;
-		case INST_LOCK:
-		case INST_REP:
-		case INST_REPNE:
-			fputc(' ', stdout);
-			continue;
-		default:
+	inst_count = inst_scan_store(&store, image->data, image->size);
+	if (inst_count < 0) {
+		fprintf(stderr, "failed to scan image for instructions "
+		        "(exit code %" PRId64 ")\n", inst_count);
+		rc = -4;
+		goto free_and_exit;
+	}
+
+	// columns are read in order, one instruction at a time
+	for (i = 0; i < store.count; ++i) {
+		inst_store_read(&store, i, offset, &operand, &inst);
+		offset += inst_store_size(&store, i);
+
+		if (print_inst(&inst, printer) != 0) {
+			rc = -7;
+			goto free_and_exit;
+		}
+	}
+
+free_and_exit:
+	inst_store_free(&store);
+
+	return rc;
+}
+
+int decode_arena(struct image *image, struct options *opts,
+                 struct printer *printer)
+{
+	int rc = 0;
+	int64 inst_count;
+	uint64 i;
+	struct pool pool;
+	struct inst_arena arena;
+
+	inst_arena_init(&arena);
+
+	if (opts->jobs != 1) {
+		if (pool_init(&pool, opts->jobs) < 0) {
+			fprintf(stderr, "failed to start thread pool\n");
+			return -6;
+		}
+
+		inst_count = inst_scan_parallel(&arena, image->data,
+		                                image->size, &pool);
+	} else {
+		inst_count = inst_scan(&arena, image->data, image->size);
+	}
+
+	if (inst_count < 0) {
+		fprintf(stderr, "failed to scan image for instructions "
+		        "(exit code %" PRId64 ")\n", inst_count);
+		rc = -4;
+		goto free_and_exit;
+	}
+
+	// execution is serial and the memo isn't shared between threads
+	if (opts->jobs != 1 && !printer->state && !printer->memo) {
+		if (outbuf_flush(&printer->out) < 0) {
+			rc = -8;
+			goto free_and_exit;
+		}
+
+		PROF_BEGIN(pformat, "parallel format");
+		if (inst_format_parallel(printer->out.fd, arena.insts,
+		                         arena.count, &pool) < 0) {
+			rc = -7;
+		}
+		PROF_END(pformat);
+
+		goto free_and_exit;
+	}
+
+	PROF_BEGIN(print, "print");
+	for (i = 0; i < arena.count; ++i) {
+		if (print_inst(arena.insts + i, printer) != 0) {
+			rc = -7;
 			break;
 		}
+	}
+	PROF_END(print);
+
+free_and_exit:
+	if (opts->jobs != 1) pool_free(&pool);
+	inst_arena_free(&arena);
+
+	return rc;
+}
+
+// Prints instructions from the cache record of the image. On miss the image
+// is scanned and the record is written for the next run.
+int decode_cached(struct image *image, struct options *opts,
+                  struct printer *printer)
+{
+	int rc;
+	int64 inst_count;
+	uint64 i, hash;
+	struct inst inst;
+	struct inst_arena arena;
+	struct cache_entry entry;
+
+	hash = cache_hash(image->data, image->size);
+
+	rc = cache_load(&entry, opts->cache_dir, hash, image->size);
+	if (rc > 0) {
+		for (i = 0, rc = 0; i < entry.inst_count; ++i) {
+			inst = entry.insts[i];
+			if (print_inst(&inst, printer) != 0) {
+				rc = -7;
+				break;
+			}
+		}
+
+		cache_release(&entry);
+
+		return rc;
+	}
 
-		fputc('\n', stdout);
+	inst_arena_init(&arena);
 
-		if (argc == 3) {
-			executor_exec(&state, insts + i);
+	inst_count = inst_scan(&arena, image->data, image->size);
+	if (inst_count < 0) {
+		fprintf(stderr, "failed to scan image for instructions "
+		        "(exit code %" PRId64 ")\n", inst_count);
+		rc = -4;
+		goto free_and_exit;
+	}
 
-			printf("; ax: %04X cx: %04X dx: %04X bx: %04X\n",
-			       state.ax, state.cx, state.dx, state.bx);
-			printf("; sp: %04X bp: %04X si: %04X di: %04X\n",
-			       state.sp, state.bp, state.si, state.di);
-			printf("; es: %04X cs: %04X ss: %04X ds: %04X\n",
-			       state.es, state.cs, state.ss, state.ds);
+	// failing to write the record doesn't affect the output
+	cache_store(opts->cache_dir, hash, image->size, arena.insts,
+	            arena.count);
+
+	for (i = 0, rc = 0; i < arena.count; ++i) {
+		if (print_inst(arena.insts + i, printer) != 0) {
+			rc = -7;
+			goto free_and_exit;
 		}
 	}
 
-	return 0;
+free_and_exit:
+	inst_arena_free(&arena);
+
+	return rc;
 }
@@ -0,0 +1,89 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "outbuf.h"
+
+// Writes all 'len' bytes, retrying on partial writes. Returns 0 on success
+// and negative value if error occurred.
+static int write_all(int fd, const char *data, size_t len);
+
+int outbuf_init(struct outbuf *buf, int fd, size_t cap)
+{
+	buf->fd   = fd;
+	buf->len  = 0;
+	buf->cap  = cap;
+	buf->data = malloc(cap);
+
+	if (!buf->data) {
+		fprintf(stderr, "failed to allocate output buffer\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int outbuf_free(struct outbuf *buf)
+{
+	int rc;
+
+	rc = outbuf_flush(buf);
+
+	free(buf->data);
+	buf->data = NULL;
+	buf->cap  = 0;
+
+	return rc;
+}
+
+int outbuf_flush(struct outbuf *buf)
+{
+	int rc;
+
+	if (buf->len == 0) return 0;
+
+	rc = write_all(buf->fd, buf->data, buf->len);
+	buf->len = 0;
+
+	return rc;
+}
+
+int outbuf_write(struct outbuf *buf, const char *data, size_t len)
+{
+	char *p;
+
+	if (len > buf->cap / 2) {
+		if (outbuf_flush(buf) < 0) return -1;
+		return write_all(buf->fd, data, len);
+	}
+
+	p = outbuf_reserve(buf, len);
+	if (!p) return -1;
+
+	outbuf_commit(buf, fmt_str(p, data, len));
+
+	return 0;
+}
+
+int write_all(int fd, const char *data, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+
+			fprintf(stderr, "failed to write output: %s\n",
+			        strerror(errno));
+			return -1;
+		}
+
+		data += n;
+		len  -= n;
+	}
+
+	return 0;
+}
@@ -0,0 +1,93 @@
+#if !defined OUTBUF_H
+#define OUTBUF_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "common.h"
+
+#define OUTBUF_SIZE (256 * 1024)
+
+// Byte buffer in front of a file descriptor. Text is formatted directly into
+// the buffer and written out with a single write() once it fills up.
+struct outbuf
+{
+	int    fd;
+	char  *data;
+	size_t len;
+	size_t cap;
+};
+
+// Returns 0 on success and negative value if allocation failed.
+extern int  outbuf_init(struct outbuf *buf, int fd, size_t cap);
+// Flushes pending bytes and releases the buffer.
+extern int  outbuf_free(struct outbuf *buf);
+// Writes pending bytes to the file descriptor. Returns 0 on success and
+// negative value if write failed.
+extern int  outbuf_flush(struct outbuf *buf);
+// Appends 'len' bytes, large blocks are written directly. Returns 0 on
+// success and negative value if write failed.
+extern int  outbuf_write(struct outbuf *buf, const char *data, size_t len);
+
+// Returns pointer to at least 'len' free bytes, flushing the buffer if
+// needed, or NULL if write failed. Bytes are added with outbuf_commit().
+static inline char *outbuf_reserve(struct outbuf *buf, size_t len)
+{
+	assert(len <= buf->cap);
+
+	if (buf->cap - buf->len < len && outbuf_flush(buf) < 0) return NULL;
+	return buf->data + buf->len;
+}
+
+static inline void outbuf_commit(struct outbuf *buf, char *end)
+{
+	assert(end >= buf->data + buf->len && end <= buf->data + buf->cap);
+	buf->len = end - buf->data;
+}
+
+// Formatting helpers, each writes into 'p' and returns pointer past the last
+// written byte. No terminating zero is written.
+
+static inline char *fmt_str(char *p, const char *str, size_t len)
+{
+	memcpy(p, str, len);
+	return p + len;
+}
+
+static inline char *fmt_uint(char *p, uint64 value)
+{
+	char tmp[20], *t = tmp + sizeof(tmp);
+
+	do {
+		*--t = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	return fmt_str(p, t, tmp + sizeof(tmp) - t);
+}
+
+static inline char *fmt_int(char *p, int64 value)
+{
+	if (value < 0) {
+		*p++ = '-';
+		return fmt_uint(p, -(uint64)value);
+	}
+
+	return fmt_uint(p, value);
+}
+
+// Four upper case hex digits, same as "%04X"
+static inline char *fmt_hex16(char *p, uint16 value)
+{
+	static const char digits[16] = "0123456789ABCDEF";
+
+	p[0] = digits[(value >> 12) & 0xF];
+	p[1] = digits[(value >>  8) & 0xF];
+	p[2] = digits[(value >>  4) & 0xF];
+	p[3] = digits[(value >>  0) & 0xF];
+
+	return p + 4;
+}
+
+#endif /* OUTBUF_H */
@@ -0,0 +1,353 @@
+#include <assert.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "inst.h"
+#include "parallel.h"
+
+// jmp targets are never further than this from the jmp instruction
+#define LABEL_REACH (64 * 1024)
+
+struct chunk
+{
+	uint64 start;
+	uint64 end;
+
+	// speculatively decoded instructions starting at 'start'
+	struct inst_arena spec;
+	// error that stopped speculative decoding at 'err_offset'
+	int    err;
+	uint64 err_offset;
+
+	// instructions decoded by the fix-up pass before the true stream met
+	// the speculative one
+	struct inst_arena fix;
+	// index of the first speculative instruction on the true stream
+	uint64 sync;
+
+	// label targets of this chunk's part of the merged array, bit 0 is
+	// located at 'labels_base' in the image
+	struct bitmap labels;
+	uint64        labels_base;
+};
+
+struct scan
+{
+	const uint8  *image;
+	uint64        size;
+	struct chunk *chunks;
+	uint          chunk_count;
+
+	// merged instruction array
+	struct inst  *insts;
+	uint64        count;
+	struct bitmap labels;
+};
+
+static int  decode_one(struct inst *inst, const uint8 *image, uint64 size,
+                       uint64 offset);
+static void decode_chunk(void *ctx, uint task);
+static void collect_labels(void *ctx, uint task);
+static void mark_labels(void *ctx, uint task);
+
+int64 inst_scan_parallel(struct inst_arena *arena, const uint8 *image,
+                         uint64 size, struct pool *pool)
+{
+	int64 rc = 0;
+	uint k, chunk_count;
+	uint64 i, n, offset, lo, hi, mid;
+	uint8 prefixes = 0;
+	struct inst inst;
+	struct chunk *chunk;
+	struct scan scan;
+
+	if (!arena || (!image && size > 0) || !pool) {
+		fprintf(stderr, "invalid arguments (arena: %p, image: %p, "
+		        "pool: %p)\n", arena, image, pool);
+		return -4;
+	}
+
+	chunk_count = size / PARALLEL_MIN_CHUNK;
+	if (chunk_count > pool->thread_count * 4)
+		chunk_count = pool->thread_count * 4;
+
+	if (chunk_count < 2 || pool->thread_count < 2) {
+		return inst_scan(arena, image, size);
+	}
+
+	memset(&scan, 0, sizeof(scan));
+	scan.image       = image;
+	scan.size        = size;
+	scan.chunk_count = chunk_count;
+	scan.chunks      = calloc(chunk_count, sizeof(*scan.chunks));
+	if (!scan.chunks) {
+		fprintf(stderr, "failed to allocate chunks\n");
+		return -5;
+	}
+
+	for (k = 0; k < chunk_count; ++k) {
+		chunk = scan.chunks + k;
+		chunk->start = size / chunk_count * k;
+		chunk->end   = (k + 1 < chunk_count) ?
+		               size / chunk_count * (k + 1) : size;
+	}
+
+	pool_run(pool, chunk_count, decode_chunk, &scan);
+
+	// fix-up: follow the true instruction stream through every chunk
+	// until it meets the speculative one
+	for (k = 0, offset = 0; k < chunk_count; ++k) {
+		chunk = scan.chunks + k;
+		chunk->sync = chunk->spec.count;
+
+		if (chunk->err == -5) {
+			fprintf(stderr, "failed to grow instruction arena\n");
+			rc = -5;
+			goto free_and_exit;
+		}
+
+		for (lo = 0; offset < chunk->end;) {
+			hi = chunk->spec.count;
+			while (lo < hi) {
+				mid = lo + (hi - lo) / 2;
+				if (chunk->spec.insts[mid].offset < offset) {
+					lo = mid + 1;
+				} else {
+					hi = mid;
+				}
+			}
+
+			if (lo < chunk->spec.count &&
+			    chunk->spec.insts[lo].offset == offset) {
+				chunk->sync = lo;
+				break;
+			}
+
+			if (chunk->err && chunk->err_offset == offset) break;
+
+			if (chunk->fix.count == chunk->fix.cap &&
+			    inst_arena_reserve(&chunk->fix,
+			                       chunk->fix.cap + 1) < 0) {
+				fprintf(stderr, "failed to grow instruction "
+				        "arena\n");
+				rc = -5;
+				goto free_and_exit;
+			}
+
+			n = chunk->fix.count;
+			rc = decode_one(chunk->fix.insts + n, image, size,
+			                offset);
+			if (rc < 0) goto free_and_exit;
+
+			offset += chunk->fix.insts[n].base.size;
+			++chunk->fix.count;
+		}
+
+		if (chunk->sync < chunk->spec.count) {
+			n = chunk->spec.count - 1;
+			offset = chunk->spec.insts[n].offset +
+			         chunk->spec.insts[n].base.size;
+		}
+
+		// the true stream ran into the instruction that stopped
+		// speculative decoding, report it the same way inst_scan()
+		// does
+		if (chunk->err && offset == chunk->err_offset) {
+			rc = decode_one(&inst, image, size, offset);
+			assert(rc < 0);
+			goto free_and_exit;
+		}
+
+		scan.count += chunk->fix.count + chunk->spec.count - chunk->sync;
+	}
+
+	// merge per-chunk results into the arena
+	arena->count = 0;
+	if (inst_arena_reserve(arena, scan.count) < 0) {
+		fprintf(stderr, "failed to allocate instruction arena\n");
+		rc = -5;
+		goto free_and_exit;
+	}
+
+	for (k = 0, n = 0; k < chunk_count; ++k) {
+		chunk = scan.chunks + k;
+
+		memcpy(arena->insts + n, chunk->fix.insts,
+		       chunk->fix.count * sizeof(*arena->insts));
+		n += chunk->fix.count;
+
+		memcpy(arena->insts + n, chunk->spec.insts + chunk->sync,
+		       (chunk->spec.count - chunk->sync) *
+		       sizeof(*arena->insts));
+		n += chunk->spec.count - chunk->sync;
+
+		inst_arena_free(&chunk->fix);
+		inst_arena_free(&chunk->spec);
+	}
+
+	arena->count = n;
+
+	for (i = 0; i < n; ++i) {
+		inst_apply_prefixes(arena->insts + i, &prefixes);
+	}
+
+	// labels: every thread collects targets of its part of the array into
+	// its own bitmap, bitmaps are merged and F_LB flags are set in
+	// parallel
+	scan.insts = arena->insts;
+
+	if (bitmap_init(&scan.labels, size) < 0) {
+		fprintf(stderr, "failed to initialize bitmap for labels\n");
+		rc = -3;
+		goto free_and_exit;
+	}
+
+	pool_run(pool, chunk_count, collect_labels, &scan);
+
+	for (k = 0; k < chunk_count; ++k) {
+		chunk = scan.chunks + k;
+		if (chunk->err == -3) {
+			fprintf(stderr, "failed to initialize bitmap for "
+			        "labels\n");
+			rc = -3;
+			goto free_and_exit;
+		}
+
+		if (!chunk->labels.data) continue;
+
+		bitmap_or(&scan.labels, &chunk->labels, chunk->labels_base);
+	}
+
+	pool_run(pool, chunk_count, mark_labels, &scan);
+
+	rc = n;
+
+free_and_exit:
+	for (k = 0; k < chunk_count; ++k) {
+		chunk = scan.chunks + k;
+		inst_arena_free(&chunk->fix);
+		inst_arena_free(&chunk->spec);
+		if (chunk->labels.data) bitmap_free(&chunk->labels);
+	}
+
+	if (scan.labels.data) bitmap_free(&scan.labels);
+	free(scan.chunks);
+
+	if (rc < 0) arena->count = 0;
+
+	return rc;
+}
+
+// Decodes instruction on the true stream. Errors are reported the same way
+// inst_scan() does.
+int decode_one(struct inst *inst, const uint8 *image, uint64 size,
+               uint64 offset)
+{
+	if (get_inst_data(inst, image, size, offset) < 0) {
+		fprintf(stderr, "failed to get instruction data\n");
+		return -1;
+	}
+
+	if (inst->base.type == INST_UNK) {
+		fprintf(stderr, "unknown instruction encountered: 0x%02X\n",
+		        image[offset]);
+		return -2;
+	}
+
+	return 0;
+}
+
+void decode_chunk(void *ctx, uint task)
+{
+	int len;
+	uint64 offset;
+	struct scan *scan   = ctx;
+	struct chunk *chunk = scan->chunks + task;
+	struct inst *inst;
+
+	// most instructions are 2-3 bytes long
+	if (inst_arena_reserve(&chunk->spec,
+	                       (chunk->end - chunk->start) / 2 + 1) < 0) {
+		chunk->err        = -5;
+		chunk->err_offset = chunk->start;
+		return;
+	}
+
+	for (offset = chunk->start; offset < chunk->end;) {
+		// speculative errors are expected, so check the instruction
+		// quietly before decoding it
+		len = inst_length(scan->image, scan->size, offset);
+		if (len < 0) {
+			chunk->err        = len;
+			chunk->err_offset = offset;
+			return;
+		}
+
+		if (chunk->spec.count == chunk->spec.cap &&
+		    inst_arena_reserve(&chunk->spec, chunk->spec.cap + 1) < 0) {
+			chunk->err        = -5;
+			chunk->err_offset = offset;
+			return;
+		}
+
+		inst = chunk->spec.insts + chunk->spec.count++;
+		get_inst_data(inst, scan->image, scan->size, offset);
+
+		offset += inst->base.size;
+	}
+}
+
+void collect_labels(void *ctx, uint task)
+{
+	int64 label_addr;
+	uint64 i, from, to, first, last;
+	struct scan *scan   = ctx;
+	struct chunk *chunk = scan->chunks + task;
+
+	from = scan->count / scan->chunk_count * task;
+	to   = (task + 1 < scan->chunk_count) ?
+	       scan->count / scan->chunk_count * (task + 1) : scan->count;
+
+	if (from >= to) return;
+
+	// bitmap only covers offsets reachable from this part of the array
+	first = scan->insts[from].offset;
+	last  = scan->insts[to - 1].offset;
+
+	chunk->labels_base  = (first > LABEL_REACH) ? first - LABEL_REACH : 0;
+	chunk->labels_base -= chunk->labels_base % BITMAP_WORD_BITS;
+
+	if (bitmap_init(&chunk->labels, last + LABEL_REACH -
+	                chunk->labels_base) < 0) {
+		chunk->err = -3;
+		return;
+	}
+
+	for (i = from; i < to; ++i) {
+		label_addr = get_jmp_offset(scan->insts + i);
+		if (label_addr >= (int64)chunk->labels_base &&
+		    (uint64)label_addr < scan->size) {
+			bitmap_set_bit(&chunk->labels,
+			               label_addr - chunk->labels_base);
+		}
+	}
+}
+
+void mark_labels(void *ctx, uint task)
+{
+	uint64 i, from, to;
+	struct scan *scan = ctx;
+
+	from = scan->count / scan->chunk_count * task;
+	to   = (task + 1 < scan->chunk_count) ?
+	       scan->count / scan->chunk_count * (task + 1) : scan->count;
+
+	for (i = from; i < to; ++i) {
+		if (bitmap_get_bit(&scan->labels, scan->insts[i].offset) > 0) {
+			scan->insts[i].base.flags |= F_LB;
+		}
+	}
+}
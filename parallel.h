@@ -0,0 +1,19 @@
+#if !defined PARALLEL_H
+#define PARALLEL_H
+
+#include "common.h"
+#include "inst.h"
+#include "pool.h"
+
+// images smaller than this are not split
+#define PARALLEL_MIN_CHUNK (256 * 1024)
+
+// Same as inst_scan(), but the image is split into chunks that are decoded
+// on 'pool' threads. Every chunk is decoded speculatively from its first
+// byte; a serial fix-up pass then follows the true instruction stream until
+// it meets the speculative one. Result is identical to inst_scan(). Returns
+// instruction count on success and negative value if error occurred.
+extern int64 inst_scan_parallel(struct inst_arena *arena, const uint8 *image,
+                                uint64 size, struct pool *pool);
+
+#endif /* PARALLEL_H */
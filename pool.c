@@ -0,0 +1,143 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+static void *pool_worker(void *arg);
+static void  pool_work(struct pool *pool);
+
+int pool_init(struct pool *pool, uint thread_count)
+{
+	long cpus;
+	uint i;
+
+	assert(pool != NULL);
+
+	memset(pool, 0, sizeof(*pool));
+
+	if (thread_count == 0) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		thread_count = (cpus > 0) ? cpus : 1;
+	}
+
+	// the calling thread is one of the workers
+	pool->threads = calloc(thread_count, sizeof(*pool->threads));
+	if (!pool->threads) return -1;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	for (i = 1; i < thread_count; ++i) {
+		if (pthread_create(pool->threads + i, NULL, pool_worker,
+		                   pool) != 0) {
+			fprintf(stderr, "failed to create pool thread\n");
+			break;
+		}
+
+		++pool->thread_count;
+	}
+
+	++pool->thread_count;
+
+	return 0;
+}
+
+void pool_free(struct pool *pool)
+{
+	uint i;
+
+	if (!pool->threads) return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 1; i < pool->thread_count; ++i) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+
+	free(pool->threads);
+	pool->threads = NULL;
+}
+
+void pool_run(struct pool *pool, uint task_count, pool_task_fn fn, void *ctx)
+{
+	assert(pool != NULL && fn != NULL);
+
+	if (task_count == 0) return;
+
+	pthread_mutex_lock(&pool->lock);
+
+	pool->fn         = fn;
+	pool->ctx        = ctx;
+	pool->task_count = task_count;
+	pool->next_task  = 0;
+	pool->finished   = 0;
+	++pool->generation;
+
+	pthread_cond_broadcast(&pool->work);
+
+	pool_work(pool);
+
+	while (pool->finished < pool->task_count) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+
+	pool->fn = NULL;
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Takes tasks of the current job until there are none left. Must be called
+// with the lock held.
+void pool_work(struct pool *pool)
+{
+	uint task;
+	pool_task_fn fn = pool->fn;
+	void *ctx       = pool->ctx;
+
+	while (pool->next_task < pool->task_count) {
+		task = pool->next_task++;
+
+		pthread_mutex_unlock(&pool->lock);
+		fn(ctx, task);
+		pthread_mutex_lock(&pool->lock);
+
+		if (++pool->finished == pool->task_count) {
+			pthread_cond_broadcast(&pool->done);
+		}
+	}
+}
+
+void *pool_worker(void *arg)
+{
+	struct pool *pool = arg;
+	uint64 generation = 0;
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (;;) {
+		while (!pool->stop && (pool->generation == generation ||
+		                       !pool->fn)) {
+			pthread_cond_wait(&pool->work, &pool->lock);
+		}
+
+		if (pool->stop) break;
+
+		generation = pool->generation;
+		pool_work(pool);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
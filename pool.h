@@ -0,0 +1,42 @@
+#if !defined POOL_H
+#define POOL_H
+
+#include <pthread.h>
+
+#include "common.h"
+
+// Task function, 'task' is the index of the task in the current job.
+typedef void (*pool_task_fn)(void *ctx, uint task);
+
+struct pool
+{
+	pthread_t      *threads;
+	uint            thread_count;
+
+	pthread_mutex_t lock;
+	pthread_cond_t  work; // new job posted or pool is stopping
+	pthread_cond_t  done; // all tasks of the current job finished
+
+	// current job
+	pool_task_fn    fn;
+	void           *ctx;
+	uint            task_count;
+	uint            next_task;
+	uint            finished;
+	uint64          generation;
+
+	int             stop;
+};
+
+// Starts a pool of 'thread_count' worker threads. If 'thread_count' is 0,
+// number of online CPUs is used. Returns 0 on success and negative value if
+// error occurred.
+extern int  pool_init(struct pool *pool, uint thread_count);
+extern void pool_free(struct pool *pool);
+
+// Runs fn(ctx, i) for every i in [0, task_count) on the pool and waits until
+// all tasks are finished. The calling thread takes tasks as well.
+extern void pool_run(struct pool *pool, uint task_count, pool_task_fn fn,
+                     void *ctx);
+
+#endif /* POOL_H */
@@ -0,0 +1,131 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined __x86_64__ || defined __i386__
+#include <x86intrin.h>
+#endif
+
+#include "profile.h"
+
+// OS clock interval used to find timestamp counter frequency
+#define CALIBRATE_NS (100 * 1000 * 1000)
+
+// registered anchors in order of first use, every thread has its own list
+// and prof_report() prints the one of the calling thread
+static __thread struct prof_anchor *anchors;
+static __thread struct prof_anchor *anchors_tail;
+static __thread struct prof_anchor *parent;
+static uint64                       run_start;
+
+static uint64 read_os_timer(void);
+static uint64 estimate_timer_freq(void);
+
+uint64 prof_read_timer(void)
+{
+#if defined __x86_64__ || defined __i386__
+	return __rdtsc();
+#else
+	return read_os_timer();
+#endif
+}
+
+void prof_start(void)
+{
+	run_start = prof_read_timer();
+}
+
+void prof_begin(struct prof_block *block, struct prof_anchor *anchor,
+                uint64 bytes)
+{
+	if (!anchor->registered) {
+		anchor->registered = 1;
+		if (anchors_tail) {
+			anchors_tail->next = anchor;
+		} else {
+			anchors = anchor;
+		}
+		anchors_tail = anchor;
+	}
+
+	block->anchor        = anchor;
+	block->parent        = parent;
+	block->old_inclusive = anchor->inclusive;
+	block->bytes         = bytes;
+
+	parent = anchor;
+	block->start = prof_read_timer();
+}
+
+void prof_end(struct prof_block *block)
+{
+	uint64 elapsed = prof_read_timer() - block->start;
+	struct prof_anchor *anchor = block->anchor;
+
+	parent = block->parent;
+	if (parent) parent->exclusive -= elapsed;
+
+	// overwriting rather than adding keeps recursive blocks from being
+	// counted several times
+	anchor->inclusive  = block->old_inclusive + elapsed;
+	anchor->exclusive += elapsed;
+	anchor->bytes     += block->bytes;
+	anchor->hits      += 1;
+}
+
+void prof_report(void)
+{
+	uint64 total, freq;
+	double seconds;
+	struct prof_anchor *anchor;
+
+	total = prof_read_timer() - run_start;
+	freq  = estimate_timer_freq();
+
+	if (total == 0 || freq == 0) return;
+
+	fprintf(stderr, "\ntotal: %.3f ms (%" PRIu64 " cycles, timer %.3f "
+	        "GHz)\n", 1e3 * total / freq, total, freq / 1e9);
+	fprintf(stderr, "%-20s %10s %14s %7s %14s %7s %10s\n", "block",
+	        "hits", "self cycles", "self%", "total cycles", "total%",
+	        "MB/s");
+
+	for (anchor = anchors; anchor; anchor = anchor->next) {
+		fprintf(stderr, "%-20s %10" PRIu64 " %14" PRId64 " %6.2f%% "
+		        "%14" PRIu64 " %6.2f%% ", anchor->name, anchor->hits,
+		        anchor->exclusive, 100.0 * anchor->exclusive / total,
+		        anchor->inclusive, 100.0 * anchor->inclusive / total);
+
+		seconds = (double)anchor->inclusive / freq;
+		if (anchor->bytes > 0 && seconds > 0) {
+			fprintf(stderr, "%10.1f\n", anchor->bytes / seconds / 1e6);
+		} else {
+			fprintf(stderr, "%10s\n", "-");
+		}
+	}
+}
+
+uint64 read_os_timer(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64 estimate_timer_freq(void)
+{
+	uint64 os_start, os_end, start, end;
+
+	os_start = read_os_timer();
+	start    = prof_read_timer();
+
+	do {
+		os_end = read_os_timer();
+	} while (os_end - os_start < CALIBRATE_NS);
+
+	end = prof_read_timer();
+
+	return (end - start) * 1000000000 / (os_end - os_start);
+}
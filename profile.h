@@ -0,0 +1,69 @@
+#if !defined PROFILE_H
+#define PROFILE_H
+
+#include "common.h"
+
+// Lightweight profiler based on the CPU timestamp counter. Code is annotated
+// with nested blocks:
+//
+//     PROF_BEGIN(scan, "inst_scan");
+//     ...
+//     PROF_END(scan);
+//
+// Every block has an anchor that accumulates time spent in the block itself
+// (exclusive) and together with nested blocks (inclusive). Blocks are only
+// compiled in when PROFILE is defined (make PROFILE=1), otherwise the macros
+// expand to nothing. Anchors are thread-local, so blocks reached from worker
+// threads don't race, but only those run on the main thread are reported.
+// Library objects are built without PROFILE and carry no anchors.
+
+struct prof_anchor
+{
+	const char         *name;
+	uint64              inclusive; // cycles
+	int64               exclusive; // cycles without nested blocks
+	uint64              hits;
+	uint64              bytes;     // processed data, for throughput
+	struct prof_anchor *next;
+	int                 registered;
+};
+
+struct prof_block
+{
+	struct prof_anchor *anchor;
+	struct prof_anchor *parent;
+	uint64              start;
+	uint64              old_inclusive;
+	uint64              bytes;
+};
+
+extern uint64 prof_read_timer(void);
+
+// Starts measuring the whole run.
+extern void prof_start(void);
+// Prints table of all blocks into stderr.
+extern void prof_report(void);
+
+extern void prof_begin(struct prof_block *block, struct prof_anchor *anchor,
+                       uint64 bytes);
+extern void prof_end(struct prof_block *block);
+
+#if defined PROFILE
+
+#define PROF_BEGIN_BYTES(id, name, bytes)                                    \
+	static __thread struct prof_anchor prof_anchor_##id =                \
+		{ name, 0, 0, 0, 0, 0, 0 };                                  \
+	struct prof_block prof_block_##id;                                   \
+	prof_begin(&prof_block_##id, &prof_anchor_##id, (bytes))
+#define PROF_END(id) prof_end(&prof_block_##id)
+
+#else
+
+#define PROF_BEGIN_BYTES(id, name, bytes)
+#define PROF_END(id)
+
+#endif /* PROFILE */
+
+#define PROF_BEGIN(id, name) PROF_BEGIN_BYTES(id, name, 0)
+
+#endif /* PROFILE_H */
@@ -0,0 +1,200 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitmap.h"
+#include "inst.h"
+#include "store.h"
+
+static int store_grow(struct inst_store *store);
+
+// inst_emit_fn appending to the store passed in 'ctx'
+static int push_inst(struct inst *inst, void *ctx);
+
+void inst_store_init(struct inst_store *store)
+{
+	assert(store != NULL);
+
+	memset(store, 0, sizeof(*store));
+}
+
+void inst_store_free(struct inst_store *store)
+{
+	free(store->types);
+	free(store->fmts);
+	free(store->flags);
+	free(store->prefixes);
+	free(store->sizes);
+	free(store->fields);
+	free(store->offsets);
+	free(store->operand_index);
+	free(store->operands);
+
+	inst_store_init(store);
+}
+
+int inst_store_push(struct inst_store *store, const struct inst *inst)
+{
+	uint16 *operands;
+	uint64 i = store->count, cap;
+	uint8 mask;
+
+	if (i == store->cap && store_grow(store) < 0) return -1;
+
+	mask = inst_store_operands(inst->base.fmt, inst->fields);
+
+	if (store->operand_count + 3 > store->operand_cap) {
+		cap = store->operand_cap ? store->operand_cap * 2 : 1024;
+		operands = realloc(store->operands, cap * sizeof(*operands));
+		if (!operands) return -1;
+
+		store->operands    = operands;
+		store->operand_cap = cap;
+	}
+
+	if (i % STORE_BLOCK == 0) {
+		store->offsets[i / STORE_BLOCK]       = inst->offset;
+		store->operand_index[i / STORE_BLOCK] = store->operand_count;
+	}
+
+	store->types[i]    = inst->base.type;
+	store->fmts[i]     = inst->base.fmt;
+	store->flags[i]    = inst->base.flags;
+	store->prefixes[i] = inst->base.prefixes;
+	store->sizes[i]    = inst->base.size;
+	store->fields[i]   = inst->fields;
+
+	if (mask & STORE_DISP)
+		store->operands[store->operand_count++] = inst->disp;
+	if (mask & STORE_DATA)
+		store->operands[store->operand_count++] = inst->data;
+	if (mask & STORE_DATA_EXT)
+		store->operands[store->operand_count++] = inst->data_ext;
+
+	++store->count;
+
+	return 0;
+}
+
+void inst_store_get(const struct inst_store *store, uint64 index,
+                    struct inst *inst)
+{
+	struct inst_iter it;
+
+	assert(index < store->count);
+
+	inst_iter_init(&it, store, index);
+	inst_iter_next(&it, inst);
+}
+
+void inst_iter_init(struct inst_iter *it, const struct inst_store *store,
+                    uint64 index)
+{
+	uint64 i;
+
+	assert(it != NULL && store != NULL);
+
+	it->store   = store;
+	it->index   = index - index % STORE_BLOCK;
+	it->offset  = 0;
+	it->operand = 0;
+
+	if (it->index < store->count) {
+		it->offset  = store->offsets[it->index / STORE_BLOCK];
+		it->operand = store->operand_index[it->index / STORE_BLOCK];
+	}
+
+	// walk from the checkpoint
+	for (i = it->index; i < index && i < store->count; ++i) {
+		it->offset  += store->sizes[i];
+		it->operand += __builtin_popcount(
+			inst_store_operands(store->fmts[i], store->fields[i]));
+	}
+
+	it->index = i;
+}
+
+int inst_iter_next(struct inst_iter *it, struct inst *inst)
+{
+	if (it->index >= it->store->count) return 0;
+
+	inst_store_read(it->store, it->index, it->offset, &it->operand, inst);
+
+	it->offset += inst->base.size;
+	++it->index;
+
+	return 1;
+}
+
+int64 inst_scan_store(struct inst_store *store, const uint8 *image,
+                      uint64 size)
+{
+	int64 rc;
+	struct bitmap labels;
+
+	if (!store || (!image && size > 0)) {
+		fprintf(stderr, "invalid arguments (store: %p, image: %p)\n",
+		        store, image);
+		return -4;
+	}
+
+	store->count         = 0;
+	store->operand_count = 0;
+	if (size == 0) return 0;
+
+	if (bitmap_init(&labels, size) < 0) {
+		fprintf(stderr, "failed to initialize bitmap for labels\n");
+		return -3;
+	}
+
+	// labels are known before decoding, so F_LB goes into the flags
+	// column right away
+	rc = inst_mark_labels(&labels, image, size);
+	if (rc >= 0) rc = inst_scan_each(&labels, image, size, push_inst, store);
+
+	if (rc == -6) {
+		fprintf(stderr, "failed to grow instruction store\n");
+		rc = -5;
+	}
+
+	bitmap_free(&labels);
+
+	return rc;
+}
+
+int push_inst(struct inst *inst, void *ctx)
+{
+	return inst_store_push(ctx, inst);
+}
+
+int store_grow(struct inst_store *store)
+{
+	uint64 cap = store->cap ? store->cap * 2 : INST_ARENA_CHUNK;
+	uint64 blocks = cap / STORE_BLOCK;
+	void *p;
+
+	assert(cap % STORE_BLOCK == 0);
+
+#define GROW(column, count)                                                    \
+	do {                                                                   \
+		p = realloc(store->column, (count) * sizeof(*store->column)); \
+		if (!p) return -1;                                             \
+		store->column = p;                                             \
+	} while (0)
+
+	GROW(types,         cap);
+	GROW(fmts,          cap);
+	GROW(flags,         cap);
+	GROW(prefixes,      cap);
+	GROW(sizes,         cap);
+	GROW(fields,        cap);
+	GROW(offsets,       blocks);
+	GROW(operand_index, blocks);
+
+#undef GROW
+
+	store->cap = cap;
+
+	return 0;
+}
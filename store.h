@@ -0,0 +1,166 @@
+#if !defined STORE_H
+#define STORE_H
+
+#include "common.h"
+#include "inst.h"
+
+// instructions between two offset checkpoints
+#define STORE_BLOCK 64
+
+// words of the operand column used by an instruction
+#define STORE_DISP     (0b1 << 0)
+#define STORE_DATA     (0b1 << 1)
+#define STORE_DATA_EXT (0b1 << 2)
+
+// Structure-of-arrays instruction storage. Every field of struct inst lives
+// in its own packed column, so passes touching a few fields read only those.
+// Offsets are delta-encoded as instruction sizes with an absolute checkpoint
+// every STORE_BLOCK instructions. disp/data/data_ext words are kept only for
+// instructions whose format uses them.
+struct inst_store
+{
+	uint64  count;
+	uint64  cap;
+
+	uint8  *types;
+	uint8  *fmts;
+	uint8  *flags;
+	uint8  *prefixes;
+	uint8  *sizes;
+	uint16 *fields;
+
+	// offset and first operand word of every STORE_BLOCK-th instruction
+	uint64 *offsets;
+	uint64 *operand_index;
+
+	uint16 *operands;
+	uint64  operand_count;
+	uint64  operand_cap;
+};
+
+// Sequential reader of the store
+struct inst_iter
+{
+	const struct inst_store *store;
+	uint64 index;
+	uint64 offset;
+	uint64 operand;
+};
+
+extern void inst_store_init(struct inst_store *store);
+extern void inst_store_free(struct inst_store *store);
+
+// Appends instruction to the store. Instructions must be pushed in image
+// order. Returns 0 on success and negative value if allocation failed.
+extern int inst_store_push(struct inst_store *store, const struct inst *inst);
+
+// Reconstructs 'index'-th instruction of the store into 'inst'.
+extern void inst_store_get(const struct inst_store *store, uint64 index,
+                           struct inst *inst);
+
+// Same as inst_scan(), but instructions are written into 'store'. Returns
+// instruction count on success and negative value if error occurred.
+extern int64 inst_scan_store(struct inst_store *store, const uint8 *image,
+                             uint64 size);
+
+// Positions iterator at 'index'-th instruction of the store.
+extern void inst_iter_init(struct inst_iter *it,
+                           const struct inst_store *store, uint64 index);
+
+// Reconstructs the next instruction into 'inst'. Returns 1 on success and 0
+// if there are no instructions left.
+extern int inst_iter_next(struct inst_iter *it, struct inst *inst);
+
+// Column accessors. Offsets aren't stored per instruction, a pass over the
+// store sums sizes instead.
+
+static inline enum inst_type inst_store_type(const struct inst_store *store,
+                                             uint64 index)
+{
+	return store->types[index];
+}
+
+static inline enum inst_format inst_store_fmt(const struct inst_store *store,
+                                              uint64 index)
+{
+	return store->fmts[index];
+}
+
+static inline uint8 inst_store_flags(const struct inst_store *store,
+                                     uint64 index)
+{
+	return store->flags[index];
+}
+
+static inline uint8 inst_store_size(const struct inst_store *store,
+                                    uint64 index)
+{
+	return store->sizes[index];
+}
+
+// Returns which of disp/data/data_ext words are used by an instruction
+static inline uint8 inst_store_operands(uint8 fmt, uint16 fields)
+{
+	uint8 mod = FIELD_MOD(fields), rm = FIELD_RM(fields);
+	uint8 mask = 0;
+
+	switch (fmt) {
+	case INST_FMT_RM_IMM:
+		mask |= STORE_DATA;
+		/* fall through */
+	case INST_FMT_RM:
+	case INST_FMT_RM_V:
+	case INST_FMT_RM_SR:
+	case INST_FMT_RM_REG:
+	case INST_FMT_RM_ESC:
+		if (mod == MODE_MEM8 || mod == MODE_MEM16 ||
+		    (mod == MODE_MEM0 && rm == 0b110))
+			mask |= STORE_DISP;
+		break;
+	case INST_FMT_IMM:
+	case INST_FMT_ACC_IMM:
+	case INST_FMT_ACC_IMM8:
+	case INST_FMT_ACC_MEM:
+	case INST_FMT_REG_IMM:
+	case INST_FMT_JMP_SHORT:
+	case INST_FMT_JMP_NEAR:
+		mask |= STORE_DATA;
+		break;
+	case INST_FMT_JMP_FAR:
+		mask |= STORE_DATA | STORE_DATA_EXT;
+		break;
+	default:
+		break;
+	}
+
+	return mask;
+}
+
+// Fills 'inst' from the columns of 'index'-th instruction located at
+// 'offset'. '*operand' is position of its first word in the operand column
+// and is moved past its words. Every field of 'inst' is written.
+static inline void inst_store_read(const struct inst_store *store,
+                                   uint64 index, uint64 offset,
+                                   uint64 *operand, struct inst *inst)
+{
+	uint8 mask;
+
+	inst->base.type     = inst_store_type(store, index);
+	inst->base.fmt      = inst_store_fmt(store, index);
+	inst->base.flags    = inst_store_flags(store, index);
+	inst->base.prefixes = store->prefixes[index];
+	inst->base.size     = inst_store_size(store, index);
+	inst->fields        = store->fields[index];
+	inst->offset        = offset;
+
+	mask = inst_store_operands(inst->base.fmt, inst->fields);
+
+	inst->disp     = (mask & STORE_DISP) ?
+	                 store->operands[(*operand)++] : 0;
+	inst->data     = (mask & STORE_DATA) ?
+	                 store->operands[(*operand)++] : 0;
+	inst->data_ext = (mask & STORE_DATA_EXT) ?
+	                 store->operands[(*operand)++] : 0;
+}
+
+#endif /* STORE_H */
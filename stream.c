@@ -0,0 +1,227 @@
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "bitmap.h"
+#include "inst.h"
+#include "stream.h"
+
+// forward jumps reach at most 32K bytes ahead, so label targets are kept in a
+// bitmap indexed modulo this span
+#define LABEL_SPAN (64 * 1024)
+
+struct stream
+{
+	int    fd;
+	int    eof;
+
+	// input buffer, buf[0] is located at 'base' in the image
+	uint8 *buf;
+	uint64 base;
+	uint64 start;
+	uint64 end;
+
+	// instructions waiting to be emitted
+	struct inst *queue;
+	uint64       head;
+	uint64       count;
+	uint64       cap;
+
+	struct bitmap labels;
+	// backward targets that were emitted before the jump was decoded
+	uint64        lost;
+};
+
+static int  stream_fill(struct stream *s);
+static void stream_mark_label(struct stream *s, uint64 offset);
+static int  stream_emit(struct stream *s, uint64 count, inst_emit_fn emit,
+                        void *ctx);
+
+int64 inst_scan_stream(int fd, uint64 window, inst_emit_fn emit, void *ctx)
+{
+	int64 rc = 0, total = 0;
+	int64 label_addr;
+	uint64 i, offset;
+	uint8 prefixes = 0;
+	struct inst *inst;
+	struct stream s;
+
+	if (fd < 0 || window == 0 || !emit) {
+		fprintf(stderr, "invalid arguments (fd: %d, window: %" PRIu64
+		        ", emit: %p)\n", fd, window, emit);
+		return -1;
+	}
+
+	memset(&s, 0, sizeof(s));
+	s.fd = fd;
+
+	// every instruction is at least one byte long
+	s.cap   = window;
+	s.queue = malloc(s.cap * sizeof(*s.queue));
+	// extra room at the end so that reading a truncated instruction never
+	// goes out of the buffer
+	s.buf   = calloc(STREAM_CHUNK + 2 * INST_MAX_SIZE, 1);
+
+	if (!s.queue || !s.buf || bitmap_init(&s.labels, LABEL_SPAN) < 0) {
+		fprintf(stderr, "failed to allocate stream buffers\n");
+		rc = -2;
+		goto free_and_exit;
+	}
+
+	for (;;) {
+		if (stream_fill(&s) < 0) {
+			rc = -3;
+			goto free_and_exit;
+		}
+
+		if (s.start == s.end) break;
+
+		offset = s.base + s.start;
+
+		// the oldest instruction can't be a jump target anymore
+		while (s.count == s.cap ||
+		       (s.count > 0 && s.queue[s.head].offset + window <= offset)) {
+			if (stream_emit(&s, 1, emit, ctx) != 0) {
+				rc = -4;
+				goto free_and_exit;
+			}
+		}
+
+		inst = s.queue + (s.head + s.count) % s.cap;
+
+		if (get_inst_data(inst, s.buf, s.end, s.start) < 0) {
+			fprintf(stderr, "failed to get instruction data\n");
+			rc = -5;
+			goto free_and_exit;
+		}
+
+		if (inst->base.type == INST_UNK) {
+			fprintf(stderr, "unknown instruction encountered: "
+			        "0x%02X\n", s.buf[s.start]);
+			rc = -6;
+			goto free_and_exit;
+		}
+
+		inst->offset = offset;
+		inst_apply_prefixes(inst, &prefixes);
+
+		// label was set by one of the previous instructions
+		if (bitmap_get_bit(&s.labels, offset % LABEL_SPAN) > 0) {
+			inst->base.flags |= F_LB;
+		}
+
+		++s.count;
+		++total;
+
+		label_addr = get_jmp_offset(inst);
+		if (label_addr > (int64)offset) {
+			bitmap_set_bit(&s.labels, label_addr % LABEL_SPAN);
+		} else if (label_addr >= 0) {
+			stream_mark_label(&s, label_addr);
+		}
+
+		// bytes covered by this instruction can't be targets anymore
+		for (i = 0; i < inst->base.size; ++i) {
+			bitmap_clear_bit(&s.labels, (offset + i) % LABEL_SPAN);
+		}
+
+		s.start += inst->base.size;
+	}
+
+	if (stream_emit(&s, s.count, emit, ctx) != 0) {
+		rc = -4;
+		goto free_and_exit;
+	}
+
+	if (s.lost > 0) {
+		fprintf(stderr, "warning: %" PRIu64 " label(s) outside of the "
+		        "%" PRIu64 " byte window\n", s.lost, window);
+	}
+
+	rc = total;
+
+free_and_exit:
+	bitmap_free(&s.labels);
+	free(s.queue);
+	free(s.buf);
+
+	return rc;
+}
+
+// Makes sure at least INST_MAX_SIZE bytes are buffered unless the input has
+// ended. Partial instruction is moved to the front of the buffer first.
+int stream_fill(struct stream *s)
+{
+	ssize_t nread;
+
+	while (!s->eof && s->end - s->start < INST_MAX_SIZE) {
+		if (s->start > 0) {
+			memmove(s->buf, s->buf + s->start, s->end - s->start);
+			s->base += s->start;
+			s->end  -= s->start;
+			s->start = 0;
+		}
+
+		nread = read(s->fd, s->buf + s->end, STREAM_CHUNK - s->end);
+		if (nread < 0) {
+			if (errno == EINTR) continue;
+
+			perror("failed to read from input");
+			return -1;
+		}
+
+		if (nread == 0) s->eof = 1;
+		s->end += nread;
+	}
+
+	return 0;
+}
+
+// Sets F_LB flag on a queued instruction located at 'offset'. Targets that
+// have already been emitted can't be marked.
+void stream_mark_label(struct stream *s, uint64 offset)
+{
+	uint64 lo = 0, hi = s->count, mid;
+	struct inst *inst;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (s->queue[(s->head + mid) % s->cap].offset < offset) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (lo == 0 && (s->count == 0 || s->queue[s->head].offset > offset)) {
+		++s->lost;
+		return;
+	}
+
+	if (lo == s->count) return;
+
+	inst = s->queue + (s->head + lo) % s->cap;
+	if (inst->offset == offset) inst->base.flags |= F_LB;
+}
+
+int stream_emit(struct stream *s, uint64 count, inst_emit_fn emit,
+                void *ctx)
+{
+	int rc;
+
+	assert(count <= s->count);
+
+	while (count-- > 0) {
+		rc = emit(s->queue + s->head, ctx);
+		if (rc != 0) return rc;
+
+		s->head = (s->head + 1) % s->cap;
+		--s->count;
+	}
+
+	return 0;
+}
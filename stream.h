@@ -0,0 +1,21 @@
+#if !defined STREAM_H
+#define STREAM_H
+
+#include "common.h"
+#include "inst.h"
+
+// size of a single read from the input
+#define STREAM_CHUNK  (64 * 1024)
+// default distance (in bytes) instructions are held back before emitting, it
+// covers the longest backward jump (near jmp with -32768 displacement)
+#define STREAM_WINDOW (64 * 1024)
+
+// Decodes instructions read from 'fd' until end of input and passes them to
+// 'emit'. Instructions are held back until they are 'window' bytes behind
+// the decoding position, so backward jumps within the window still mark
+// their targets with F_LB. Memory use is bounded by 'window'. Returns
+// instruction count on success and negative value if error occurred.
+extern int64 inst_scan_stream(int fd, uint64 window, inst_emit_fn emit,
+                              void *ctx);
+
+#endif /* STREAM_H */
@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "bitmap.h"
+#include "labels.h"
+
+#define COUNT_OF(array) (sizeof(array) / sizeof(*(array)))
+
+// bits of one rank directory entry
+#define SUPER_BITS (BITMAP_RANK_WORDS * BITMAP_WORD_BITS)
+
+// Checks rank, select and the label index of 'map' against a bit by bit
+// walk. Returns 0 if they agree and negative value otherwise.
+static int check_map(struct bitmap *map, size_t bit_count);
+
+int main(void)
+{
+	int rc = 0;
+	uint i;
+	uint32 seed = 1;
+	size_t bit;
+	struct bitmap map;
+
+	// bits around word and directory entry boundaries
+	static const size_t edges[] =
+	{
+		0, 1, 62, 63, 64, 65, 127, 128,
+		SUPER_BITS - 1, SUPER_BITS, SUPER_BITS + 1,
+		2 * SUPER_BITS - 1, 2 * SUPER_BITS, 3 * SUPER_BITS + 63,
+	};
+	// sizes ending inside a word, on a word and on a directory entry
+	static const size_t sizes[] =
+	{
+		1, 64, 65, SUPER_BITS, SUPER_BITS + 1, 4 * SUPER_BITS,
+		4 * SUPER_BITS + 37,
+	};
+
+	for (i = 0; i < COUNT_OF(sizes) && rc == 0; ++i) {
+		if (bitmap_init(&map, sizes[i]) < 0) return 1;
+
+		// empty, boundary bits only, then boundary and random bits
+		rc = check_map(&map, sizes[i]);
+
+		for (bit = 0; bit < COUNT_OF(edges); ++bit) {
+			if (edges[bit] < sizes[i]) {
+				bitmap_set_bit(&map, edges[bit]);
+			}
+		}
+
+		if (rc == 0) rc = check_map(&map, sizes[i]);
+
+		for (bit = 0; bit < sizes[i] / 3; ++bit) {
+			seed = seed * 1103515245 + 12345;
+			bitmap_set_bit(&map, (seed >> 8) % sizes[i]);
+		}
+
+		if (rc == 0) rc = check_map(&map, sizes[i]);
+
+		bitmap_free(&map);
+	}
+
+	if (rc < 0) return 1;
+
+	printf("bitmap: ok\n");
+
+	return 0;
+}
+
+int check_map(struct bitmap *map, size_t bit_count)
+{
+	size_t bit, rank = 0;
+	struct label_index index;
+
+	if (label_index_init(&index, map) < 0) return -1;
+
+	for (bit = 0; bit < bit_count; ++bit) {
+		if (bitmap_rank(map, bit) != rank) {
+			fprintf(stderr, "rank of bit %zu: %zu, expected %zu\n",
+			        bit, bitmap_rank(map, bit), rank);
+			goto fail;
+		}
+
+		if (bitmap_get_bit(map, bit) <= 0) {
+			if (label_index_ordinal(&index, bit) != -1) {
+				fprintf(stderr, "bit %zu: ordinal of a clear "
+				        "bit\n", bit);
+				goto fail;
+			}
+
+			continue;
+		}
+
+		if (bitmap_select(map, rank) != (int64_t)bit ||
+		    label_index_offset(&index, rank) != (int64)bit ||
+		    label_index_ordinal(&index, bit) != (int64)rank) {
+			fprintf(stderr, "set bit %zu (rank %zu): select %lld, "
+			        "offset %lld, ordinal %lld\n", bit, rank,
+			        (long long)bitmap_select(map, rank),
+			        (long long)label_index_offset(&index, rank),
+			        (long long)label_index_ordinal(&index, bit));
+			goto fail;
+		}
+
+		++rank;
+	}
+
+	if (bitmap_count(map) != rank || bitmap_select(map, rank) != -1 ||
+	    label_index_offset(&index, rank) != -1) {
+		fprintf(stderr, "%zu set bits: count %zu, select past the "
+		        "end %lld\n", rank, bitmap_count(map),
+		        (long long)bitmap_select(map, rank));
+		goto fail;
+	}
+
+	label_index_free(&index);
+
+	return 0;
+
+fail:
+	label_index_free(&index);
+
+	return -1;
+}
@@ -0,0 +1,241 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "flags.h"
+
+// carry before the checked operation: set or clear, stored in flags or
+// pending from add
+#define CARRY_SET  0b01
+#define CARRY_LAZY 0b10
+#define CARRY_CASES 4
+
+#define COUNT_OF(array) (sizeof(array) / sizeof(*(array)))
+
+// 16-bit operands checked besides the pseudo-random ones
+static const uint16 edge_values[] =
+{
+	0x0000, 0x0001, 0x0002, 0x000F, 0x0010, 0x007F, 0x0080, 0x0081,
+	0x00FF, 0x0100, 0x0F0F, 0x7FFE, 0x7FFF, 0x8000, 0x8001, 0xFFFE,
+	0xFFFF,
+};
+
+static const enum inst_type alu_types[] =
+{
+	INST_ADD, INST_ADC, INST_SUB, INST_SBB, INST_CMP, INST_AND, INST_OR,
+	INST_XOR, INST_TEST, INST_INC, INST_DEC, INST_NEG,
+};
+
+// Reference: computes result and flags of 'type' one flag at a time with
+// plain integer arithmetic. Flags other than arithmetic are taken from
+// 'flags'.
+static uint16 eager_alu(enum inst_type type, bool wide, uint16 dst,
+                        uint16 src, uint16 flags, uint16 *res);
+
+// Runs one operation through flags_alu() and eager_alu(). Returns 0 if
+// result and flags match and negative value otherwise.
+static int check_one(enum inst_type type, bool wide, uint16 dst, uint16 src,
+                     uint carry);
+
+// Compares lazily computed flags of every alu operation against a
+// straightforward eager implementation: all 8-bit operand pairs and a set of
+// 16-bit ones, with carry clear, set and pending from add for operations
+// that depend on it. Returns 0 if they match bit for bit and negative value
+// otherwise.
+static int flags_check(void);
+
+int main(void)
+{
+	if (flags_check() < 0) return 1;
+
+	printf("flags: ok\n");
+
+	return 0;
+}
+
+int flags_check(void)
+{
+	uint i, j, t, carry, carry_cases;
+	uint32 seed = 1;
+	uint16 a, b;
+	enum inst_type type;
+
+	for (t = 0; t < COUNT_OF(alu_types); ++t) {
+		type = alu_types[t];
+
+		// previous carry only matters to instructions that read or keep
+		// it
+		carry_cases = 1;
+		if (type == INST_ADC || type == INST_SBB || type == INST_INC ||
+		    type == INST_DEC) {
+			carry_cases = CARRY_CASES;
+		}
+
+		for (carry = 0; carry < carry_cases; ++carry) {
+			for (i = 0; i < 0x10000; ++i) {
+				if (check_one(type, false, i & 0xFF, i >> 8,
+				              carry) < 0) {
+					return -1;
+				}
+			}
+
+			for (i = 0; i < COUNT_OF(edge_values); ++i) {
+				for (j = 0; j < COUNT_OF(edge_values); ++j) {
+					if (check_one(type, true,
+					              edge_values[i],
+					              edge_values[j], carry) < 0) {
+						return -1;
+					}
+				}
+			}
+
+			for (i = 0; i < 0x4000; ++i) {
+				seed = seed * 1103515245 + 12345;
+				a    = seed >> 16;
+				seed = seed * 1103515245 + 12345;
+				b    = seed >> 16;
+
+				if (check_one(type, true, a, b, carry) < 0) {
+					return -1;
+				}
+			}
+		}
+	}
+
+	return 0;
+}
+
+int check_one(enum inst_type type, bool wide, uint16 dst, uint16 src,
+              uint carry)
+{
+	uint16 res, expected_res, expected, flags;
+	struct cpu_state state, copy;
+
+	memset(&state, 0, sizeof(state));
+
+	// flags that survive alu operations are set to see that they do
+	state.flags = FLAG_IF | FLAG_DF;
+
+	if (carry & CARRY_LAZY) {
+		// carry comes from a pending add, as in add + adc chains
+		flags_alu(&state, INST_ADD, wide, (carry & CARRY_SET) ?
+		          0xFFFF : 0, 1);
+	} else {
+		state.flags |= FLAG_AF | FLAG_OF |
+		               ((carry & CARRY_SET) ? FLAG_CF : 0);
+	}
+
+	copy     = state;
+	expected = eager_alu(type, wide, dst, src, flags_get(&copy),
+	                     &expected_res);
+
+	res = flags_alu(&state, type, wide, dst, src);
+
+	// single flag getters are what jcc uses, check them before
+	// flags_get() drops the pending operation
+	flags = state.flags & ~FLAGS_ARITH;
+	if (flag_cf(&state)) flags |= FLAG_CF;
+	if (flag_pf(&state)) flags |= FLAG_PF;
+	if (flag_af(&state)) flags |= FLAG_AF;
+	if (flag_zf(&state)) flags |= FLAG_ZF;
+	if (flag_sf(&state)) flags |= FLAG_SF;
+	if (flag_of(&state)) flags |= FLAG_OF;
+
+	if (res != expected_res || flags != expected ||
+	    flags_get(&state) != expected) {
+		fprintf(stderr, "lazy flags mismatch (type: %d, wide: %d, "
+		        "dst: %04X, src: %04X, carry: %u, result: %04X/%04X, "
+		        "flags: %04X/%04X)\n", type, wide, dst, src, carry, res,
+		        expected_res, flags, expected);
+		return -1;
+	}
+
+	return 0;
+}
+
+uint16 eager_alu(enum inst_type type, bool wide, uint16 dst, uint16 src,
+                 uint16 flags, uint16 *res)
+{
+	int32 sdst, ssrc, sres, wres;
+	int32 smin  = wide ? -0x8000 : -0x80;
+	int32 smax  = wide ?  0x7FFF :  0x7F;
+	uint32 mask = wide ?  0xFFFF :  0xFF;
+	uint bits   = 0, i;
+	bool cf = flags & FLAG_CF, af = false, of = false, cin = false;
+
+	dst &= mask;
+	src &= mask;
+
+	switch (type) {
+	case INST_INC:
+	case INST_DEC:
+	case INST_NEG:
+	case INST_ADC:
+	case INST_SBB:
+		break;
+	default:
+		cf = false;
+	}
+
+	if (type == INST_NEG) {
+		src = dst;
+		dst = 0;
+	}
+
+	if (type == INST_INC || type == INST_DEC) src = 1;
+	if (type == INST_ADC || type == INST_SBB) cin = cf;
+
+	// sign extended operands
+	sdst = (dst & (mask ^ (mask >> 1))) ? (int32)dst - (int32)mask - 1 :
+	                                      (int32)dst;
+	ssrc = (src & (mask ^ (mask >> 1))) ? (int32)src - (int32)mask - 1 :
+	                                      (int32)src;
+
+	switch (type) {
+	case INST_ADD:
+	case INST_ADC:
+	case INST_INC:
+		wres = (int32)dst + (int32)src + cin;
+		sres = sdst + ssrc + cin;
+		af   = (dst & 0xF) + (src & 0xF) + cin > 0xF;
+		if (type != INST_INC) cf = wres > (int32)mask;
+		break;
+	case INST_SUB:
+	case INST_SBB:
+	case INST_CMP:
+	case INST_DEC:
+	case INST_NEG:
+		wres = (int32)dst - (int32)src - cin;
+		sres = sdst - ssrc - cin;
+		af   = (int32)(dst & 0xF) - (int32)(src & 0xF) - cin < 0;
+		if (type != INST_DEC) cf = wres < 0;
+		break;
+	case INST_AND:
+	case INST_TEST:
+		wres = dst & src;
+		sres = 0;
+		break;
+	case INST_OR:
+		wres = dst | src;
+		sres = 0;
+		break;
+	default:
+		wres = dst ^ src;
+		sres = 0;
+		break;
+	}
+
+	of   = sres < smin || sres > smax;
+	*res = wres & mask;
+
+	for (i = 0; i < 8; ++i) bits += (*res >> i) & 1;
+
+	flags &= ~FLAGS_ARITH;
+	if (cf) flags |= FLAG_CF;
+	if (bits % 2 == 0) flags |= FLAG_PF;
+	if (af) flags |= FLAG_AF;
+	if (*res == 0) flags |= FLAG_ZF;
+	if (*res & (mask ^ (mask >> 1))) flags |= FLAG_SF;
+	if (of) flags |= FLAG_OF;
+
+	return flags;
+}
@@ -0,0 +1,95 @@
+#include <stdio.h>
+
+// lookup tables and their accessors are private to inst.c
+#include "inst.c"
+
+// Verifies decode lookup tables against inst_table and inst_table_extd.
+// Returns 0 if they are consistent and negative value otherwise.
+static int inst_check_tables(void);
+
+int main(void)
+{
+	if (inst_check_tables() < 0) return 1;
+
+	printf("inst tables: ok\n");
+
+	return 0;
+}
+
+int inst_check_tables(void)
+{
+	uint op, modrm, row;
+	uint8 mod, rm, disp_size;
+	const struct inst_data *ref, *got;
+
+	static const uint8 extd_ops[17] =
+	{
+		0x80, 0x81, 0x82, 0x83, 0x8C, 0x8E, 0x8F, 0xC6, 0xC7,
+		0xD0, 0xD1, 0xD2, 0xD3, 0xF6, 0xF7, 0xFE, 0xFF,
+	};
+
+	for (op = 0; op <= INST_FMT_JMP_FAR; ++op) {
+		if (!fmt_extract[op]) {
+			fprintf(stderr, "format %u: no extraction routine\n", op);
+			return -5;
+		}
+	}
+
+	for (op = 0; op < 256; ++op) {
+		for (row = 0; row < 17 && extd_ops[row] != op; ++row) {}
+
+		if ((row < 17) != (inst_table[op].type == INST_EXTD)) {
+			fprintf(stderr, "opcode 0x%02X: extended opcode "
+			        "mismatch\n", op);
+			return -1;
+		}
+
+		for (modrm = 0; modrm < 256; ++modrm) {
+			ref = &inst_table[op];
+			if (row < 17) ref = &inst_table_extd[row][EXTD(modrm)];
+
+			got = inst_lookup(op, modrm);
+			if (got != ref) {
+				fprintf(stderr, "opcode 0x%02X 0x%02X: table "
+				        "entry mismatch\n", op, modrm);
+				return -2;
+			}
+
+			mod = MOD(modrm);
+			rm  = RM(modrm);
+
+			disp_size = 0;
+			if (mod == MODE_MEM16 || (mod == MODE_MEM0 && rm == 0b110))
+				disp_size = 2;
+			if (mod == MODE_MEM8)
+				disp_size = 1;
+
+			switch (ref->fmt) {
+			case INST_FMT_RM:
+			case INST_FMT_RM_V:
+			case INST_FMT_RM_SR:
+			case INST_FMT_RM_REG:
+			case INST_FMT_RM_IMM:
+			case INST_FMT_RM_ESC:
+				break;
+			default:
+				disp_size = 0;
+			}
+
+			if (inst_disp_size(ref->fmt, modrm) != disp_size) {
+				fprintf(stderr, "opcode 0x%02X 0x%02X: "
+				        "displacement size mismatch\n", op, modrm);
+				return -3;
+			}
+
+			if (len_lookup(op, modrm) != ((ref->type == INST_UNK) ?
+			    0 : ref->size + disp_size)) {
+				fprintf(stderr, "opcode 0x%02X 0x%02X: length "
+				        "class mismatch\n", op, modrm);
+				return -4;
+			}
+		}
+	}
+
+	return 0;
+}
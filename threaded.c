@@ -0,0 +1,494 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include "flags.h"
+#include "machine.h"
+#include "threaded.h"
+
+// Computed goto is a GNU extension, THREADED_SWITCH forces the portable
+// dispatch
+#if defined __GNUC__ && !defined THREADED_SWITCH
+#define THREADED_GOTO 1
+#endif
+
+// Register operand of mod r/m instruction with mod 11
+static void *rm_reg(struct cpu_state *state, const struct inst *inst,
+                    bool wide);
+static void *reg_ptr(struct cpu_state *state, uint8 reg, bool wide);
+
+// Handler kind of alu instruction
+static enum op_kind alu_kind(enum inst_type type, uint form);
+
+// alu operand forms, in the order of OP_ALU_KINDS
+#define FORM_R16_R16 0
+#define FORM_R8_R8   1
+#define FORM_R16_IMM 2
+#define FORM_R8_IMM  3
+
+void threaded_translate(struct cpu_state *state, struct block_op *op)
+{
+	const struct inst *inst = &op->inst;
+	uint8 reg = FIELD_REG(inst->fields);
+	bool wide = inst->base.flags & F_W;
+	bool d    = inst->base.flags & F_D;
+	bool mreg = FIELD_MOD(inst->fields) == MODE_REG;
+
+	op->kind = OP_GENERIC;
+	op->imm  = inst->data;
+	op->dst  = NULL;
+	op->src  = NULL;
+
+	switch (inst->base.type) {
+	case INST_MOV:
+		if (inst->base.fmt == INST_FMT_RM_REG && mreg) {
+			op->kind = wide ? OP_MOV_R16_R16 : OP_MOV_R8_R8;
+			op->dst  = d ? reg_ptr(state, reg, wide) :
+			               rm_reg(state, inst, wide);
+			op->src  = d ? rm_reg(state, inst, wide) :
+			               reg_ptr(state, reg, wide);
+		} else if (inst->base.fmt == INST_FMT_REG_IMM) {
+			op->kind = wide ? OP_MOV_R16_IMM : OP_MOV_R8_IMM;
+			op->dst  = reg_ptr(state, reg, wide);
+		} else if (inst->base.fmt == INST_FMT_RM_IMM && mreg) {
+			op->kind = wide ? OP_MOV_R16_IMM : OP_MOV_R8_IMM;
+			op->dst  = rm_reg(state, inst, wide);
+		}
+		break;
+	case INST_ADD:
+	case INST_ADC:
+	case INST_SUB:
+	case INST_SBB:
+	case INST_CMP:
+	case INST_AND:
+	case INST_OR:
+	case INST_XOR:
+	case INST_TEST:
+		if (inst->base.fmt == INST_FMT_RM_REG && mreg) {
+			op->kind = alu_kind(inst->base.type, wide ?
+			                    FORM_R16_R16 : FORM_R8_R8);
+			op->dst  = d ? reg_ptr(state, reg, wide) :
+			               rm_reg(state, inst, wide);
+			op->src  = d ? rm_reg(state, inst, wide) :
+			               reg_ptr(state, reg, wide);
+		} else if (inst->base.fmt == INST_FMT_RM_IMM && mreg) {
+			op->kind = alu_kind(inst->base.type, wide ?
+			                    FORM_R16_IMM : FORM_R8_IMM);
+			op->dst  = rm_reg(state, inst, wide);
+		} else if (inst->base.fmt == INST_FMT_ACC_IMM) {
+			op->kind = alu_kind(inst->base.type, wide ?
+			                    FORM_R16_IMM : FORM_R8_IMM);
+			op->dst  = reg_ptr(state, 0, wide);
+		}
+		break;
+	case INST_INC:
+	case INST_DEC:
+		if (inst->base.fmt == INST_FMT_REG) {
+			op->kind = (inst->base.type == INST_INC) ? OP_INC_R16 :
+			                                           OP_DEC_R16;
+			op->dst  = &state->regs16[reg];
+		}
+		break;
+	case INST_PUSH:
+	case INST_POP:
+		// push sp stores the decremented value, leave it to executor
+		if (inst->base.fmt == INST_FMT_REG && reg != 4) {
+			op->kind = (inst->base.type == INST_PUSH) ?
+			           OP_PUSH_R16 : OP_POP_R16;
+			op->dst  = &state->regs16[reg];
+		}
+		break;
+	case INST_JMP:
+		if (inst->base.fmt == INST_FMT_JMP_SHORT) {
+			op->kind = OP_JMP;
+			op->imm  = (int8)(inst->data & 0xFF);
+		} else if (inst->base.fmt == INST_FMT_JMP_NEAR) {
+			op->kind = OP_JMP;
+		}
+		break;
+#define JCC_CASE(type)                                                       \
+	case INST_##type:                                                    \
+		if (inst->base.fmt != INST_FMT_JMP_SHORT) break;             \
+		op->kind = OP_##type;                                        \
+		op->imm  = (int8)(inst->data & 0xFF);                        \
+		break;
+	OP_JCC_TYPES(JCC_CASE)
+#undef JCC_CASE
+	case INST_HLT:
+		op->kind = OP_HLT;
+		break;
+	default:
+		break;
+	}
+}
+
+void threaded_fuse(struct block *block)
+{
+	uint i;
+	bool wide;
+	enum op_kind kind;
+	struct block_op *op, *jmp;
+
+#define CMP_JCC_FUSE(type, cond)                                             \
+	case OP_##type:                                                      \
+		op->kind = wide ? OP_CMP_##type##_R16 : OP_CMP_##type##_R8;  \
+		break;
+#define TEST_JCC_FUSE(type, cond)                                            \
+	case OP_##type:                                                      \
+		op->kind = wide ? OP_TEST_##type##_R16 : OP_TEST_##type##_R8;\
+		break;
+
+	for (i = 0; i + 1 < block->count; ++i) {
+		op   = block->ops + i;
+		jmp  = op + 1;
+		kind = op->kind;
+		wide = op->kind == OP_CMP_R16_R16 || op->kind == OP_CMP_R16_IMM ||
+		       op->kind == OP_TEST_R16_R16 ||
+		       op->kind == OP_TEST_R16_IMM;
+
+		switch (op->kind) {
+		case OP_CMP_R16_R16:
+		case OP_CMP_R8_R8:
+		case OP_CMP_R16_IMM:
+		case OP_CMP_R8_IMM:
+			switch (jmp->kind) {
+			OP_CMP_JCC_TYPES(CMP_JCC_FUSE)
+			default:
+				break;
+			}
+
+			break;
+		case OP_TEST_R16_R16:
+		case OP_TEST_R8_R8:
+		case OP_TEST_R16_IMM:
+		case OP_TEST_R8_IMM:
+			switch (jmp->kind) {
+			OP_TEST_JCC_TYPES(TEST_JCC_FUSE)
+			default:
+				break;
+			}
+
+			break;
+		case OP_DEC_R16:
+			if (jmp->kind == OP_JNE) op->kind = OP_DEC_JNE_R16;
+			break;
+		default:
+			break;
+		}
+
+		// fused handlers read immediate through the source operand
+		if (op->kind != kind && !op->src) op->src = &op->imm;
+	}
+
+#undef TEST_JCC_FUSE
+#undef CMP_JCC_FUSE
+}
+
+const char *threaded_fuse_name(enum fuse_kind kind)
+{
+#define FUSE_NAME(name, text) [FUSE_##name] = text,
+	static const char *const names[FUSE_COUNT] =
+	{
+		FUSE_TYPES(FUSE_NAME)
+	};
+#undef FUSE_NAME
+
+	assert(kind < FUSE_COUNT);
+
+	return names[kind];
+}
+
+int threaded_run(struct machine *machine, struct block *block)
+{
+	int rc = 0;
+	uint16 value;
+	uint16 a, b;
+	int16 sa, sb;
+	uint32 addr, next;
+	uint16 start = block->key & 0xFFFF;
+	struct cpu_state *state = &machine->state;
+	struct block_op *op = block->ops;
+
+#if defined THREADED_GOTO
+#define OP_ALU_LABELS(type, writes)                                          \
+	[OP_##type##_R16_R16] = &&op_##type##_R16_R16,                       \
+	[OP_##type##_R8_R8]   = &&op_##type##_R8_R8,                         \
+	[OP_##type##_R16_IMM] = &&op_##type##_R16_IMM,                       \
+	[OP_##type##_R8_IMM]  = &&op_##type##_R8_IMM,
+#define OP_JCC_LABEL(type) [OP_##type] = &&op_##type,
+#define OP_CMP_JCC_LABELS(type, cond)                                        \
+	[OP_CMP_##type##_R16] = &&op_CMP_##type##_R16,                       \
+	[OP_CMP_##type##_R8]  = &&op_CMP_##type##_R8,
+#define OP_TEST_JCC_LABELS(type, cond)                                       \
+	[OP_TEST_##type##_R16] = &&op_TEST_##type##_R16,                     \
+	[OP_TEST_##type##_R8]  = &&op_TEST_##type##_R8,
+
+	static void *const labels[OP_KIND_COUNT] =
+	{
+		[OP_END]         = &&op_END,
+		[OP_GENERIC]     = &&op_GENERIC,
+		[OP_MOV_R16_R16] = &&op_MOV_R16_R16,
+		[OP_MOV_R8_R8]   = &&op_MOV_R8_R8,
+		[OP_MOV_R16_IMM] = &&op_MOV_R16_IMM,
+		[OP_MOV_R8_IMM]  = &&op_MOV_R8_IMM,
+		[OP_INC_R16]     = &&op_INC_R16,
+		[OP_DEC_R16]     = &&op_DEC_R16,
+		[OP_PUSH_R16]    = &&op_PUSH_R16,
+		[OP_POP_R16]     = &&op_POP_R16,
+		[OP_JMP]         = &&op_JMP,
+		[OP_HLT]         = &&op_HLT,
+		OP_ALU_TYPES(OP_ALU_LABELS)
+		OP_JCC_TYPES(OP_JCC_LABEL)
+		OP_CMP_JCC_TYPES(OP_CMP_JCC_LABELS)
+		OP_TEST_JCC_TYPES(OP_TEST_JCC_LABELS)
+		[OP_DEC_JNE_R16] = &&op_DEC_JNE_R16,
+	};
+
+#undef OP_TEST_JCC_LABELS
+#undef OP_CMP_JCC_LABELS
+#undef OP_JCC_LABEL
+#undef OP_ALU_LABELS
+
+#define HANDLER(name) op_##name:
+#define DISPATCH()    goto *labels[op->kind]
+#else
+#define HANDLER(name) case OP_##name:
+#define DISPATCH()    goto dispatch
+#endif
+
+// ip points past the instruction while it executes
+#define NEXT()                                                               \
+	do {                                                                 \
+		++op;                                                        \
+		state->ip += op->len;                                        \
+		DISPATCH();                                                  \
+	} while (0)
+
+// Taken jump, restarts the block if it jumps back to its start. Each pass
+// adds its instructions to 'steps'.
+#define TAKEN()                                                              \
+	do {                                                                 \
+		state->ip += op->imm;                                        \
+		if (state->ip != start) NEXT();                              \
+		++machine->fused[FUSE_LOOP];                                 \
+		machine->steps += op + 1 - block->ops;                       \
+		op = block->ops;                                             \
+		state->ip += op->len;                                        \
+		DISPATCH();                                                  \
+	} while (0)
+
+#define R16(ptr) (*(uint16 *)(ptr))
+#define R8(ptr)  (*(uint8 *)(ptr))
+
+	state->ip += op->len;
+
+#if defined THREADED_GOTO
+	DISPATCH();
+#else
+dispatch:
+	switch (op->kind) {
+#endif
+
+	HANDLER(MOV_R16_R16)
+		R16(op->dst) = R16(op->src);
+		NEXT();
+	HANDLER(MOV_R8_R8)
+		R8(op->dst) = R8(op->src);
+		NEXT();
+	HANDLER(MOV_R16_IMM)
+		R16(op->dst) = op->imm;
+		NEXT();
+	HANDLER(MOV_R8_IMM)
+		R8(op->dst) = op->imm;
+		NEXT();
+	HANDLER(INC_R16)
+		R16(op->dst) = flags_alu(state, INST_INC, true, R16(op->dst), 0);
+		NEXT();
+	HANDLER(DEC_R16)
+		R16(op->dst) = flags_alu(state, INST_DEC, true, R16(op->dst), 0);
+		NEXT();
+	HANDLER(PUSH_R16)
+		addr = linear_addr(state->ss, state->sp - 2);
+		next = (addr + 1) & MEMORY_MASK;
+
+		// stack sharing a page with code, executor tracks the write
+		if (state->code_pages[addr >> CODE_PAGE_BITS] ||
+		    state->code_pages[next >> CODE_PAGE_BITS]) {
+			goto generic;
+		}
+
+		state->sp -= 2;
+		state->memory[addr] = R16(op->dst) & 0xFF;
+		state->memory[next] = R16(op->dst) >> 8;
+		NEXT();
+	HANDLER(POP_R16)
+		addr = linear_addr(state->ss, state->sp);
+		R16(op->dst) = state->memory[addr] |
+		               state->memory[(addr + 1) & MEMORY_MASK] << 8;
+		state->sp += 2;
+		NEXT();
+	HANDLER(JMP)
+		TAKEN();
+	HANDLER(HLT)
+		rc = EXEC_HALT;
+		++op;
+		goto exit;
+
+#define OP_ALU_HANDLERS(type, writes)                                        \
+	HANDLER(type##_R16_R16)                                              \
+		value = flags_alu(state, INST_##type, true, R16(op->dst),    \
+		                  R16(op->src));                             \
+		if (writes) R16(op->dst) = value;                            \
+		NEXT();                                                      \
+	HANDLER(type##_R8_R8)                                                \
+		value = flags_alu(state, INST_##type, false, R8(op->dst),    \
+		                  R8(op->src));                              \
+		if (writes) R8(op->dst) = value;                             \
+		NEXT();                                                      \
+	HANDLER(type##_R16_IMM)                                              \
+		value = flags_alu(state, INST_##type, true, R16(op->dst),    \
+		                  op->imm);                                  \
+		if (writes) R16(op->dst) = value;                            \
+		NEXT();                                                      \
+	HANDLER(type##_R8_IMM)                                               \
+		value = flags_alu(state, INST_##type, false, R8(op->dst),    \
+		                  op->imm);                                  \
+		if (writes) R8(op->dst) = value;                             \
+		NEXT();
+
+	OP_ALU_TYPES(OP_ALU_HANDLERS)
+#undef OP_ALU_HANDLERS
+
+#define OP_JCC_HANDLER(type)                                                 \
+	HANDLER(type)                                                        \
+		if (jmp_taken(state, INST_##type)) TAKEN();                  \
+		NEXT();
+
+	OP_JCC_TYPES(OP_JCC_HANDLER)
+#undef OP_JCC_HANDLER
+
+// Fused pairs: condition is evaluated on the first instruction, then 'op'
+// moves to the jump
+#define OP_CMP_JCC_HANDLERS(type, cond)                                      \
+	HANDLER(CMP_##type##_R16)                                            \
+		a  = R16(op->dst);                                           \
+		b  = R16(op->src);                                           \
+		sa = (int16)a;                                               \
+		sb = (int16)b;                                               \
+		flags_record(state, LAZY_SUB, true, a, b, a - b);            \
+		goto cmp_##type;                                             \
+	HANDLER(CMP_##type##_R8)                                             \
+		a  = R8(op->dst);                                            \
+		b  = R8(op->src);                                            \
+		sa = (int8)a;                                                \
+		sb = (int8)b;                                                \
+		flags_record(state, LAZY_SUB, false, a, b, (a - b) & 0xFF);  \
+	cmp_##type:                                                          \
+		++machine->fused[FUSE_CMP_JCC];                              \
+		++op;                                                        \
+		state->ip += op->len;                                        \
+		if (cond) TAKEN();                                           \
+		NEXT();
+
+	OP_CMP_JCC_TYPES(OP_CMP_JCC_HANDLERS)
+#undef OP_CMP_JCC_HANDLERS
+
+#define OP_TEST_JCC_HANDLERS(type, cond)                                     \
+	HANDLER(TEST_##type##_R16)                                           \
+		a = R16(op->dst);                                            \
+		b = R16(op->src);                                            \
+		flags_record(state, LAZY_LOGIC, true, a, b, a & b);          \
+		goto test_##type;                                            \
+	HANDLER(TEST_##type##_R8)                                            \
+		a = R8(op->dst);                                             \
+		b = R8(op->src);                                             \
+		flags_record(state, LAZY_LOGIC, false, a, b, a & b);         \
+	test_##type:                                                         \
+		++machine->fused[FUSE_TEST_JCC];                             \
+		++op;                                                        \
+		state->ip += op->len;                                        \
+		if (cond) TAKEN();                                           \
+		NEXT();
+
+	OP_TEST_JCC_TYPES(OP_TEST_JCC_HANDLERS)
+#undef OP_TEST_JCC_HANDLERS
+
+	HANDLER(DEC_JNE_R16)
+		value = flags_alu(state, INST_DEC, true, R16(op->dst), 0);
+		R16(op->dst) = value;
+		++machine->fused[FUSE_DEC_JNZ];
+		++op;
+		state->ip += op->len;
+		if (value != 0) TAKEN();
+		NEXT();
+
+	HANDLER(GENERIC)
+generic:
+		rc = executor_exec(state, &op->inst);
+		if (rc < 0) {
+			// leave ip at the failed instruction
+			state->ip -= op->len;
+			fprintf(stderr, "can't execute instruction at %04X:%04X "
+			        "(exit code %d)\n", state->cs, state->ip, rc);
+			goto exit;
+		}
+
+		if (rc == EXEC_HALT) {
+			++op;
+			goto exit;
+		}
+
+		if (state->code_written) goto written;
+		NEXT();
+	HANDLER(END)
+		// ip was advanced by the zero length of OP_END
+		goto exit;
+
+#if !defined THREADED_GOTO
+	default:
+		assert(0 && "unknown op kind");
+	}
+#endif
+
+#undef R8
+#undef R16
+#undef TAKEN
+#undef NEXT
+#undef DISPATCH
+#undef HANDLER
+
+written:
+	// the rest of the block may be stale now
+	state->code_written = false;
+	++op;
+
+exit:
+	machine->steps += op - block->ops;
+
+	return rc;
+}
+
+void *rm_reg(struct cpu_state *state, const struct inst *inst, bool wide)
+{
+	return reg_ptr(state, FIELD_RM(inst->fields), wide);
+}
+
+void *reg_ptr(struct cpu_state *state, uint8 reg, bool wide)
+{
+	if (wide) return &state->regs16[reg];
+
+	return &state->regs8[reg & 0b11][reg >> 2];
+}
+
+enum op_kind alu_kind(enum inst_type type, uint form)
+{
+#define ALU_KIND(name, writes)                                               \
+	case INST_##name: return OP_##name##_R16_R16 + form;
+
+	switch (type) {
+	OP_ALU_TYPES(ALU_KIND)
+	default:
+		return OP_GENERIC;
+	}
+
+#undef ALU_KIND
+}
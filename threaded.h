@@ -0,0 +1,100 @@
+#if !defined THREADED_H
+#define THREADED_H
+
+#include "common.h"
+#include "executor.h"
+#include "inst.h"
+
+struct machine;
+struct block;
+struct block_op;
+
+// Operations with their own handler. ALU and JCC families expand to one
+// handler per instruction type, e.g. OP_ADD_R16_IMM or OP_JNE.
+#define OP_ALU_TYPES(X)                                                      \
+	X(ADD, 1) X(ADC, 1) X(SUB, 1) X(SBB, 1) X(CMP, 0) X(AND, 1)          \
+	X(OR, 1)  X(XOR, 1) X(TEST, 0)
+
+#define OP_JCC_TYPES(X)                                                      \
+	X(JO) X(JNO) X(JB) X(JAE) X(JE) X(JNE) X(JBE) X(JA) X(JS) X(JNS)     \
+	X(JP) X(JPO) X(JL) X(JGE) X(JLE) X(JG) X(JCXZ) X(LOOP) X(LOOPZ)      \
+	X(LOOPNZ)
+
+// Pairs executed by one handler: cmp or test followed by jcc and dec
+// followed by jne. The jump condition comes straight from the operands 'a'
+// and 'b' (signed 'sa' and 'sb'), flags are only recorded for later readers.
+#define OP_CMP_JCC_TYPES(X)                                                  \
+	X(JE, a == b)   X(JNE, a != b)  X(JB, a < b)    X(JAE, a >= b)       \
+	X(JBE, a <= b)  X(JA, a > b)    X(JL, sa < sb)  X(JGE, sa >= sb)     \
+	X(JLE, sa <= sb) X(JG, sa > sb)
+
+#define OP_TEST_JCC_TYPES(X)                                                 \
+	X(JE, (a & b) == 0) X(JNE, (a & b) != 0)
+
+// Idioms counted in 'fused' of struct machine, LOOP counts jumps back to
+// the start of the running block, which restart it without leaving
+// threaded_run()
+#define FUSE_TYPES(X)                                                        \
+	X(CMP_JCC, "cmp+jcc") X(TEST_JCC, "test+jcc") X(DEC_JNZ, "dec+jnz")  \
+	X(LOOP, "loop body")
+
+#define OP_ALU_KINDS(type, writes)                                           \
+	OP_##type##_R16_R16, OP_##type##_R8_R8, OP_##type##_R16_IMM,         \
+	OP_##type##_R8_IMM,
+
+#define OP_JCC_KIND(type) OP_##type,
+#define OP_CMP_JCC_KIND(type, cond) OP_CMP_##type##_R16, OP_CMP_##type##_R8,
+#define OP_TEST_JCC_KIND(type, cond)                                         \
+	OP_TEST_##type##_R16, OP_TEST_##type##_R8,
+#define FUSE_KIND(name, text) FUSE_##name,
+
+enum op_kind
+{
+	OP_END,     // past the last instruction of a block
+	OP_GENERIC, // executor_exec()
+
+	OP_MOV_R16_R16,
+	OP_MOV_R8_R8,
+	OP_MOV_R16_IMM,
+	OP_MOV_R8_IMM,
+	OP_INC_R16,
+	OP_DEC_R16,
+	OP_PUSH_R16,
+	OP_POP_R16,
+	OP_JMP,
+	OP_HLT,
+
+	OP_ALU_TYPES(OP_ALU_KINDS)
+	OP_JCC_TYPES(OP_JCC_KIND)
+
+	OP_CMP_JCC_TYPES(OP_CMP_JCC_KIND)
+	OP_TEST_JCC_TYPES(OP_TEST_JCC_KIND)
+	OP_DEC_JNE_R16,
+
+	OP_KIND_COUNT,
+};
+
+enum fuse_kind
+{
+	FUSE_TYPES(FUSE_KIND)
+	FUSE_COUNT,
+};
+
+// Picks handler of 'op->inst' and resolves its register operands to
+// pointers into 'state'. Instructions without a handler of their own get
+// OP_GENERIC.
+extern void threaded_translate(struct cpu_state *state, struct block_op *op);
+
+// Replaces adjacent instructions of 'block' that have a fused handler, the
+// first of them gets the handler and the second one keeps its operands.
+extern void threaded_fuse(struct block *block);
+
+// Name of fused idiom for statistics
+extern const char *threaded_fuse_name(enum fuse_kind kind);
+
+// Executes 'block' dispatching from one handler straight to the next.
+// Returns 0 if execution continues after the block, EXEC_HALT after hlt and
+// negative value if instruction failed.
+extern int  threaded_run(struct machine *machine, struct block *block);
+
+#endif /* THREADED_H */
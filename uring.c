@@ -0,0 +1,155 @@
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+#define load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+int uring_init(struct uring *ring, uint32 entries)
+{
+	struct io_uring_params params;
+	uint8 *sq, *cq;
+
+	assert(ring != NULL);
+
+	memset(ring, 0, sizeof(*ring));
+	memset(&params, 0, sizeof(params));
+
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0) return -1;
+
+	ring->sq_ring_size = params.sq_off.array +
+	                     params.sq_entries * sizeof(uint32);
+	ring->cq_ring_size = params.cq_off.cqes +
+	                     params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_size    = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	// both rings share one mapping on newer kernels
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = 0;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+	                     MAP_SHARED | MAP_POPULATE, ring->fd,
+	                     IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) goto fail;
+
+	if (ring->cq_ring_size) {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size,
+		                     PROT_READ | PROT_WRITE,
+		                     MAP_SHARED | MAP_POPULATE, ring->fd,
+		                     IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) goto fail;
+	} else {
+		ring->cq_ring = ring->sq_ring;
+	}
+
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+	                  MAP_SHARED | MAP_POPULATE, ring->fd,
+	                  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) goto fail;
+
+	sq = ring->sq_ring;
+	ring->sq_head    = (uint32 *)(sq + params.sq_off.head);
+	ring->sq_tail    = (uint32 *)(sq + params.sq_off.tail);
+	ring->sq_mask    = (uint32 *)(sq + params.sq_off.ring_mask);
+	ring->sq_array   = (uint32 *)(sq + params.sq_off.array);
+	ring->sq_entries = params.sq_entries;
+
+	cq = ring->cq_ring;
+	ring->cq_head = (uint32 *)(cq + params.cq_off.head);
+	ring->cq_tail = (uint32 *)(cq + params.cq_off.tail);
+	ring->cq_mask = (uint32 *)(cq + params.cq_off.ring_mask);
+	ring->cqes    = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+	return 0;
+
+fail:
+	if (ring->sqes == MAP_FAILED) ring->sqes = NULL;
+	if (ring->cq_ring == MAP_FAILED) ring->cq_ring = NULL;
+	if (ring->sq_ring == MAP_FAILED) ring->sq_ring = NULL;
+	uring_free(ring);
+
+	return -1;
+}
+
+void uring_free(struct uring *ring)
+{
+	if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+	if (ring->fd >= 0) close(ring->fd);
+
+	memset(ring, 0, sizeof(*ring));
+	ring->fd = -1;
+}
+
+struct io_uring_sqe *uring_get_sqe(struct uring *ring)
+{
+	uint32 tail, index;
+	struct io_uring_sqe *sqe;
+
+	tail = *ring->sq_tail + ring->sq_pending;
+	if (tail - load_acquire(ring->sq_head) >= ring->sq_entries) return NULL;
+
+	index = tail & *ring->sq_mask;
+	ring->sq_array[index] = index;
+	++ring->sq_pending;
+
+	sqe = ring->sqes + index;
+	memset(sqe, 0, sizeof(*sqe));
+
+	return sqe;
+}
+
+int uring_submit(struct uring *ring, uint32 wait)
+{
+	long rc;
+	uint32 submit = ring->sq_queued + ring->sq_pending;
+
+	store_release(ring->sq_tail, *ring->sq_tail + ring->sq_pending);
+	ring->sq_pending = 0;
+	ring->sq_queued  = 0;
+
+	if (submit == 0 && wait == 0) return 0;
+
+	for (;;) {
+		rc = syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+		             wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (rc < 0 && errno == EINTR) continue;
+		if (rc < 0) {
+			ring->sq_queued = submit;
+			return -errno;
+		}
+
+		// entries are consumed before the kernel starts waiting
+		submit -= rc;
+		if (submit == 0) break;
+	}
+
+	return 0;
+}
+
+struct io_uring_cqe *uring_peek_cqe(struct uring *ring)
+{
+	uint32 head = *ring->cq_head;
+
+	if (head == load_acquire(ring->cq_tail)) return NULL;
+
+	return ring->cqes + (head & *ring->cq_mask);
+}
+
+void uring_cqe_seen(struct uring *ring)
+{
+	store_release(ring->cq_head, *ring->cq_head + 1);
+}
@@ -0,0 +1,54 @@
+#if !defined URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+
+#include "common.h"
+
+// Minimal io_uring wrapper over raw system calls, liburing isn't required.
+struct uring
+{
+	int   fd;
+
+	// submission queue
+	uint32 *sq_head;
+	uint32 *sq_tail;
+	uint32 *sq_mask;
+	uint32 *sq_array;
+	uint32  sq_entries;
+	uint32  sq_pending;  // prepared entries not visible to the kernel
+	uint32  sq_queued;   // visible entries the kernel hasn't taken yet
+	struct io_uring_sqe *sqes;
+
+	// completion queue
+	uint32 *cq_head;
+	uint32 *cq_tail;
+	uint32 *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	void   *sq_ring;
+	void   *cq_ring;
+	size_t  sq_ring_size;
+	size_t  cq_ring_size;
+	size_t  sqes_size;
+};
+
+// Creates a ring with 'entries' submission entries. Returns 0 on success and
+// negative value if io_uring isn't available.
+extern int  uring_init(struct uring *ring, uint32 entries);
+extern void uring_free(struct uring *ring);
+
+// Returns next free submission entry (zeroed) or NULL if the queue is full.
+extern struct io_uring_sqe *uring_get_sqe(struct uring *ring);
+
+// Submits prepared entries and waits for at least 'wait' completions.
+// Returns 0 on success and negative errno otherwise, entries that weren't
+// taken are submitted by the next call.
+extern int uring_submit(struct uring *ring, uint32 wait);
+
+// Returns oldest completion or NULL if there is none. uring_cqe_seen() must
+// be called before the next uring_peek_cqe().
+extern struct io_uring_cqe *uring_peek_cqe(struct uring *ring);
+extern void uring_cqe_seen(struct uring *ring);
+
+#endif /* URING_H */